@@ -0,0 +1,128 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "a-memory-library/aml_alloc.h"
+#include "the-io-library/io.h"
+#include "the-io-library/io_in.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Measures delimiter scanning in GB/s for newline delimited text with an
+  average line length of 100 and 10 bytes.
+
+  before - the byte at a time loop the delimited readers used previously
+  after  - io_find_delimiter (AVX2/SSE2/NEON when available)
+  io_in  - reading the same data from a file with io_in_advance
+
+  bench_delimiter [size_in_mb] [tmp_dir]  (defaults to 1024 and /tmp)
+*/
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static char *generate(size_t size, size_t avg) {
+  char *buf = (char *)aml_malloc(size);
+  srand(avg);
+  size_t pos = 0;
+  while (pos < size) {
+    size_t len = (rand() % ((avg * 2) - 1)) + 1;
+    if (pos + len > size)
+      len = size - pos;
+    memset(buf + pos, 'a' + (pos % 26), len - 1);
+    buf[pos + len - 1] = '\n';
+    pos += len;
+  }
+  return buf;
+}
+
+static const char *find_before(const char *p, const char *ep, int delim) {
+  while (p < ep) {
+    if (*p == delim)
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
+static size_t count_before(const char *p, const char *ep) {
+  size_t n = 0;
+  while ((p = find_before(p, ep, '\n')) != NULL) {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+static size_t count_after(const char *p, const char *ep) {
+  size_t n = 0;
+  while ((p = io_find_delimiter(p, ep, '\n')) != NULL) {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+static size_t count_io_in(const char *filename) {
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_format(&opts, io_delimiter('\n'));
+  io_in_options_buffer_size(&opts, 1024 * 1024);
+  return io_in_count(io_in_init(filename, &opts));
+}
+
+static void report(const char *name, size_t avg, size_t bytes, size_t lines,
+                   double t) {
+  printf("%-8s avg=%-4zu lines=%-12zu %8.3f sec %8.2f GB/s\n", name, avg,
+         lines, t, (bytes / t) / (1024.0 * 1024.0 * 1024.0));
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = 1024;
+  const char *tmp_dir = "/tmp";
+  if (argc > 1)
+    size = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    tmp_dir = argv[2];
+  size *= 1024 * 1024;
+
+  size_t avgs[] = {100, 10};
+  for (size_t i = 0; i < sizeof(avgs) / sizeof(avgs[0]); i++) {
+    char *buf = generate(size, avgs[i]);
+
+    double t = now();
+    size_t lines = count_before(buf, buf + size);
+    report("before", avgs[i], size, lines, now() - t);
+
+    t = now();
+    lines = count_after(buf, buf + size);
+    report("after", avgs[i], size, lines, now() - t);
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/bench_delimiter_%zu.txt",
+             tmp_dir, avgs[i]);
+    FILE *out = fopen(filename, "wb");
+    if (!out || fwrite(buf, 1, size, out) != size) {
+      fprintf(stderr, "unable to write %s\n", filename);
+      return 1;
+    }
+    fclose(out);
+    aml_free(buf);
+
+    t = now();
+    lines = count_io_in(filename);
+    report("io_in", avgs[i], size, lines, now() - t);
+    unlink(filename);
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "a-memory-library/aml_alloc.h"
+#include "the-io-library/io.h"
+#include "the-io-library/io_in.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+  Merges k sorted streams of 8 byte keys with io_in_ext using the binary
+  heap and the loser tree (with and without a cached key prefix) and reports
+  records/sec and compares/record.
+
+  bench_merge [total_records]  (defaults to 16 million)
+*/
+
+static size_t num_compares = 0;
+
+static int compare_u64(const io_record_t *a, const io_record_t *b,
+                       void *arg) {
+  (void)arg;
+  num_compares++;
+  uint64_t x, y;
+  memcpy(&x, a->record, sizeof(x));
+  memcpy(&y, b->record, sizeof(y));
+  if (x != y)
+    return x < y ? -1 : 1;
+  return 0;
+}
+
+static uint64_t prefix_u64(const io_record_t *r, void *arg) {
+  (void)arg;
+  uint64_t x;
+  memcpy(&x, r->record, sizeof(x));
+  return x;
+}
+
+static int sort_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static void merge(const char *name, io_record_t *records, size_t k,
+                  size_t per, size_t threshold, bool prefix) {
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_loser_tree(&opts, threshold);
+  io_in_t *in = io_in_ext_init(compare_u64, NULL, &opts);
+  if (prefix)
+    io_in_ext_key_prefix(in, prefix_u64, NULL);
+  for (size_t i = 0; i < k; i++)
+    io_in_ext_add(in, io_in_records_init(records + (i * per), per, &opts),
+                  (int)i);
+
+  num_compares = 0;
+  double t = now();
+  size_t n = 0;
+  while (io_in_advance(in))
+    n++;
+  t = now() - t;
+  io_in_destroy(in);
+  printf("%-8s k=%-5zu records=%-10zu %8.3f sec %8.2f M rec/sec %6.2f "
+         "compares/rec\n",
+         name, k, n, t, (n / t) / 1000000.0, (double)num_compares / n);
+}
+
+int main(int argc, char *argv[]) {
+  size_t total = 16 * 1000 * 1000;
+  if (argc > 1)
+    total = strtoul(argv[1], NULL, 10);
+
+  size_t ks[] = {8, 64, 512, 4096};
+  for (size_t i = 0; i < sizeof(ks) / sizeof(ks[0]); i++) {
+    size_t k = ks[i];
+    size_t per = total / k;
+    uint64_t *keys = (uint64_t *)aml_malloc(sizeof(uint64_t) * k * per);
+    io_record_t *records =
+        (io_record_t *)aml_malloc(sizeof(io_record_t) * k * per);
+    srand(k);
+    for (size_t j = 0; j < k * per; j++)
+      keys[j] = ((uint64_t)rand() << 31) ^ rand();
+    for (size_t j = 0; j < k; j++)
+      qsort(keys + (j * per), per, sizeof(uint64_t), sort_u64);
+    for (size_t j = 0; j < k * per; j++) {
+      records[j].record = (char *)(keys + j);
+      records[j].length = sizeof(uint64_t);
+      records[j].tag = 0;
+    }
+
+    merge("heap", records, k, per, 0, false);
+    merge("loser", records, k, per, 1, false);
+    merge("heap+p", records, k, per, 0, true);
+    merge("loser+p", records, k, per, 1, true);
+    aml_free(records);
+    aml_free(keys);
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "a-memory-library/aml_alloc.h"
+#include "the-io-library/io.h"
+#include "the-io-library/io_out.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Writes 16 byte records (an 8 byte random key and an 8 byte value) to one
+  partitioned io_out from 1, 2, 4, ... producer threads
+  (io_out_ext_options_concurrent) and reports the producer throughput and the
+  total time including the final flush.  The first line writes the same
+  records from one thread without the concurrent option.  The partitions are
+  plain files so that the numbers reflect staging and locking rather than
+  compression.
+
+  bench_partition [total_records] [max_threads] [num_partitions] [tmp_dir]
+    (defaults to 16 million, 32, 64, and /tmp)
+*/
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static size_t partition_u64(const io_record_t *r, size_t num_partitions,
+                            void *arg) {
+  (void)arg;
+  uint64_t x;
+  memcpy(&x, r->record, sizeof(x));
+  return x % num_partitions;
+}
+
+typedef struct {
+  io_out_t *out;
+  uint64_t seed;
+  size_t num_records;
+} producer_t;
+
+static void *produce(void *arg) {
+  producer_t *p = (producer_t *)arg;
+  uint64_t x = p->seed;
+  uint64_t rec[2];
+  for (size_t i = 0; i < p->num_records; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    rec[0] = x;
+    rec[1] = i;
+    io_out_write_record(p->out, rec, sizeof(rec));
+  }
+  return NULL;
+}
+
+static void write_partitions(const char *filename, size_t total,
+                             size_t num_threads, size_t num_partitions,
+                             bool concurrent) {
+  io_out_options_t opts;
+  io_out_options_init(&opts);
+  io_out_options_format(&opts, io_prefix());
+  io_out_options_buffer_size(&opts, 64 * 1024 * 1024);
+  io_out_ext_options_t ext_opts;
+  io_out_ext_options_init(&ext_opts);
+  io_out_ext_options_partition(&ext_opts, partition_u64, NULL);
+  io_out_ext_options_num_partitions(&ext_opts, num_partitions);
+  if (concurrent)
+    io_out_ext_options_concurrent(&ext_opts);
+  io_out_t *out = io_out_ext_init(filename, &opts, &ext_opts);
+
+  producer_t *producers =
+      (producer_t *)aml_malloc(sizeof(producer_t) * num_threads);
+  pthread_t *threads =
+      (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    producers[i].out = out;
+    producers[i].seed = 88172645463325252ULL + i;
+    producers[i].num_records = total / num_threads;
+  }
+
+  double t = now();
+  if (num_threads == 1)
+    produce(producers);
+  else {
+    for (size_t i = 0; i < num_threads; i++)
+      pthread_create(threads + i, NULL, produce, producers + i);
+    for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+  }
+  double produced = now() - t;
+  io_out_destroy(out);
+  t = now() - t;
+
+  size_t n = (total / num_threads) * num_threads;
+  printf("%-10s threads=%-3zu records=%-10zu %8.3f sec %8.2f M rec/sec "
+         "(%.3f sec with flush)\n",
+         concurrent ? "concurrent" : "single", num_threads, n, produced,
+         (n / produced) / 1000000.0, t);
+  aml_free(threads);
+  aml_free(producers);
+}
+
+int main(int argc, char *argv[]) {
+  size_t total = 16 * 1000 * 1000;
+  size_t max_threads = 32;
+  size_t num_partitions = 64;
+  const char *tmp_dir = "/tmp";
+  if (argc > 1)
+    total = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    max_threads = strtoul(argv[2], NULL, 10);
+  if (argc > 3)
+    num_partitions = strtoul(argv[3], NULL, 10);
+  if (argc > 4)
+    tmp_dir = argv[4];
+
+  char filename[1024];
+  snprintf(filename, sizeof(filename), "%s/bench_partition", tmp_dir);
+  write_partitions(filename, total, 1, num_partitions, false);
+  for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    write_partitions(filename, total, num_threads, num_partitions, true);
+
+  for (size_t i = 0; i < num_partitions; i++) {
+    snprintf(filename, sizeof(filename), "%s/bench_partition_%zu",
+             tmp_dir, i);
+    unlink(filename);
+  }
+  return 0;
+}
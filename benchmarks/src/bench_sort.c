@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "a-memory-library/aml_alloc.h"
+#include "the-io-library/io.h"
+#include "the-io-library/io_in.h"
+#include "the-io-library/io_out.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+  Writes 8 byte random keys to a sorted io_out whose buffer holds all of
+  them and reads the sorted result back with 1, 2, 4, ... buffer sort
+  threads (io_out_ext_options_num_buffer_sort_threads), sorting with the
+  compare function and with io_out_ext_options_radix_key.
+
+  bench_sort [total_records] [max_threads] [tmp_dir]
+    (defaults to 8 million, 16, and /tmp)
+*/
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static int compare_u64(const io_record_t *a, const io_record_t *b,
+                       void *arg) {
+  (void)arg;
+  uint64_t x, y;
+  memcpy(&x, a->record, sizeof(x));
+  memcpy(&y, b->record, sizeof(y));
+  if (x != y)
+    return x < y ? -1 : 1;
+  return 0;
+}
+
+static void sort(const char *filename, size_t total, size_t num_threads,
+                 bool radix) {
+  io_out_options_t opts;
+  io_out_options_init(&opts);
+  io_out_options_format(&opts, io_prefix());
+  io_out_options_buffer_size(&opts, (total * 40) + (1024 * 1024));
+  io_out_ext_options_t ext_opts;
+  io_out_ext_options_init(&ext_opts);
+  io_out_ext_options_compare(&ext_opts, compare_u64, NULL);
+  io_out_ext_options_num_buffer_sort_threads(&ext_opts, num_threads);
+  if (radix)
+    io_out_ext_options_radix_key(&ext_opts, 0, sizeof(uint64_t));
+  io_out_t *out = io_out_ext_init(filename, &opts, &ext_opts);
+
+  srand(1);
+  for (size_t i = 0; i < total; i++) {
+    uint64_t key = ((uint64_t)rand() << 31) ^ rand();
+    io_out_write_record(out, &key, sizeof(key));
+  }
+
+  double t = now();
+  io_in_t *in = io_out_in(out);
+  size_t n = 0;
+  while (io_in_advance(in))
+    n++;
+  t = now() - t;
+  io_in_destroy(in);
+  printf("%-8s threads=%-3zu records=%-10zu %8.3f sec %8.2f M rec/sec\n",
+         radix ? "radix" : "compare", num_threads, n, t,
+         (n / t) / 1000000.0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t total = 8 * 1000 * 1000;
+  size_t max_threads = 16;
+  const char *tmp_dir = "/tmp";
+  if (argc > 1)
+    total = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    max_threads = strtoul(argv[2], NULL, 10);
+  if (argc > 3)
+    tmp_dir = argv[3];
+
+  char filename[1024];
+  snprintf(filename, sizeof(filename), "%s/bench_sort.lz4", tmp_dir);
+  for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    sort(filename, total, num_threads, false);
+    sort(filename, total, num_threads, true);
+  }
+  return 0;
+}
@@ -47,6 +47,16 @@ typedef bool (*io_reducer_cb)(io_record_t *res, const io_record_t *r,
 typedef int (*io_compare_cb)(const io_record_t *, const io_record_t *,
                                void *tag);
 
+/* Returns an integer key for the record which must agree with the compare
+   method being used (if prefix(a) < prefix(b) then compare(a, b) < 0 and if
+   compare(a, b) == 0 then prefix(a) == prefix(b)).  Merges compare the
+   prefixes first and only call compare when the prefixes are equal. */
+typedef uint64_t (*io_key_prefix_cb)(const io_record_t *r, void *tag);
+
+/* Returns a hash of the record's key.  Records which compare equal must hash
+   to the same value. */
+typedef uint64_t (*io_hash_cb)(const io_record_t *r, void *tag);
+
 /* A function which is expected to return 0..num_part-1 based upon the given record and the user provided tag. */
 typedef size_t (*io_partition_cb)(const io_record_t *r, size_t num_part,
                                     void *tag);
@@ -90,6 +100,42 @@ typedef struct io_file_info_s {
   int32_t tag; // defaults to zero
 } io_file_info_t;
 
+/* one entry per lz4 block in an lz4 index.  offset is where the block starts
+   in the compressed file and uncompressed_offset is where its data starts
+   once decompressed.  first_record is the number of the first record which
+   starts at or after uncompressed_offset and first_record_offset is where
+   that record starts (which is past the block if no record starts in it). */
+typedef struct {
+  uint64_t offset;
+  uint64_t uncompressed_offset;
+  uint64_t first_record;
+  uint64_t first_record_offset;
+} io_lz4_block_t;
+
+/* the index written alongside an lz4 file (see io_out_options_lz4_index) */
+typedef struct {
+  size_t num_blocks;
+  uint64_t num_records;
+  uint64_t uncompressed_size;
+  io_lz4_block_t *blocks;
+} io_lz4_index_t;
+
+/* an access point in a gz file (see io_gz_index_build).  Decompression can
+   start at in (less one byte if bits is non-zero, since the point starts
+   within that byte) using the 32KB of output before out as the dictionary. */
+typedef struct {
+  uint64_t out;
+  uint64_t in;
+  int32_t bits;
+  unsigned char window[32768];
+} io_gz_point_t;
+
+typedef struct {
+  size_t num_points;
+  uint64_t uncompressed_size;
+  io_gz_point_t *points;
+} io_gz_index_t;
+
 
 /* A function which is expected to return 0..num_part-1 based upon the given file_info structure
    and the user provided tag.  Files can be skipped by returning num_part. */
@@ -220,6 +266,17 @@ bool io_make_path_valid(char *filename);
 */
 bool io_extension(const char *filename, const char *extension);
 
+/* Find the first delim (or delim2) in [p, ep) and return NULL if it isn't
+   found.  These use AVX2/SSE2 (or NEON) when the cpu supports it and are
+   what the delimited readers use to find the end of each record. */
+char *io_find_delimiter(const char *p, const char *ep, int delim);
+char *io_find_delimiter2(const char *p, const char *ep, int delim, int delim2);
+
+/* Similar to io_find_delimiter, except that delimiters inside of double
+   quotes are skipped.  in_quote carries the quote state across calls. */
+char *io_find_csv_delimiter(const char *p, const char *ep, int delim,
+                            bool *in_quote);
+
 /* compare the first 32 or 64 bits of a record */
 static inline int io_compare_uint32_t(const io_record_t *p1,
                                          const io_record_t *p2, void *tag __attribute__((unused))) {
@@ -239,6 +296,29 @@ static inline int io_compare_uint64_t(const io_record_t *p1,
   return 0;
 }
 
+/* key prefixes for io_compare_uint32_t and io_compare_uint64_t */
+static inline uint64_t io_key_prefix_uint32_t(const io_record_t *r,
+                                              void *tag __attribute__((unused))) {
+  return *(uint32_t *)r->record;
+}
+
+static inline uint64_t io_key_prefix_uint64_t(const io_record_t *r,
+                                              void *tag __attribute__((unused))) {
+  return *(uint64_t *)r->record;
+}
+
+/* key prefix for records compared bytewise (memcmp and then length), the
+   first 8 bytes as a big endian integer padded with zeros */
+static inline uint64_t io_key_prefix_bytes(const io_record_t *r,
+                                           void *tag __attribute__((unused))) {
+  const unsigned char *p = (const unsigned char *)r->record;
+  uint32_t len = r->length < 8 ? r->length : 8;
+  uint64_t v = 0;
+  for (uint32_t i = 0; i < len; i++)
+    v |= (uint64_t)p[i] << (56 - (i << 3));
+  return v;
+}
+
 /* split by the first 32 or 64 bits of a record */
 static inline size_t io_split_by_uint32_t(const io_record_t *r,
                                              size_t num_part, void *tag __attribute__((unused))) {
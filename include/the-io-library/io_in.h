@@ -18,7 +18,7 @@
    to reduce the non-distinct elements.
 
    Another useful feature supported by io_in is built in compression.  Files
-   with an extension of .gz or .lz4 are automatically read from their
+   with an extension of .gz, .lz4, or .zst are automatically read from their
    respective formats without the need to first decompress the files.
 
    In general, the io_in object is meant to iterate over one or more files of
@@ -125,9 +125,45 @@ void io_in_options_tag(io_in_options_t *h, int tag);
    will default to buffer_size. */
 void io_in_options_gz(io_in_options_t *h, size_t buffer_size);
 void io_in_options_lz4(io_in_options_t *h, size_t buffer_size);
+
+/* Indicate that the file descriptor is zstd compressed (filenames ending in
+   .zst are detected).  zstd input is decompressed on the read ahead thread
+   when io_in_options_read_ahead is set. */
+void io_in_options_zstd(io_in_options_t *h);
 void io_in_options_compressed_buffer_size(io_in_options_t *h,
                                           size_t buffer_size);
 
+/* Memory map uncompressed files instead of reading them through the buffer.
+   Records are returned as pointers directly into the mapping, which avoids
+   copying the data and refilling the buffer.  The mapping is read-only, so
+   records are NOT zero terminated in this mode (use length).  The
+   buffer_size is used as the read ahead window.  Compressed (.gz, .zst)
+   input and anything which can't be mapped (pipes, empty files) is read
+   normally.
+   Under .lz4 input, the compressed blocks are read from the mapping. */
+void io_in_options_mmap(io_in_options_t *h);
+
+/* Read (and decompress) the next part of the input in a helper thread while
+   the current buffer is being consumed, so that io_in_advance doesn't stall
+   on IO.  For gz input, gzread runs on the helper thread, zstd input is
+   decompressed there, and for lz4 input, the next block is decompressed
+   there.  Each cursor with this option uses
+   one thread (two for lz4, one to read and one to decompress).  This has no
+   effect for buffers and memory mapped files. */
+void io_in_options_read_ahead(io_in_options_t *h);
+
+/* Decompress lz4 input with num_threads helper threads.  The threads read
+   the blocks in order and decompress them into a ring of num_threads + 1
+   blocks which the cursor consumes in order.  read_ahead for lz4 is the
+   same as one thread. */
+void io_in_options_lz4_threads(io_in_options_t *h, size_t num_threads);
+
+/* When an io_in_ext cursor merges at least min_streams streams, use a loser
+   (tournament) tree instead of a binary heap.  The loser tree needs about
+   log2(k) compares per record instead of ~2*log2(k).  The default is 8.  Use
+   0 to always use the heap and 1 to always use the loser tree. */
+void io_in_options_loser_tree(io_in_options_t *h, size_t min_streams);
+
 /* Within a single cursor, reduce equal items.  In this case, it is assumed
    that the contents are sorted.  */
 void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
@@ -135,7 +171,8 @@ void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
                            void *reducer_arg);
 
 /* The filename dictates whether the file is normal, gzip compressed (.gz
-   extension), or lz4 compressed (.lz4 extension).  If options is NULL, default
+   extension), lz4 compressed (.lz4 extension), or zstd compressed (.zst
+   extension).  If options is NULL, default
    options will be used. NULL will be returned if the file cannot be opened.
 */
 io_in_t *io_in_init(const char *filename, io_in_options_t *options);
@@ -158,6 +195,93 @@ io_in_t *io_in_init_with_fd(int fd, bool can_close, io_in_options_t *options);
 io_in_t *io_in_init_with_buffer(void *buf, size_t len, bool can_free,
                                 io_in_options_t *options);
 
+/* Read the records in [offset, offset + length) of an uncompressed file.  The
+   range must begin and end on record boundaries.  The range is read with
+   pread, so many ranges of one file can be read at once. */
+io_in_t *io_in_init_range(const char *filename, size_t offset, size_t length,
+                          io_in_options_t *options);
+
+/* Build an index of access points for a gz file by inflating it once.  A
+   point is saved at the first deflate block boundary after every span bytes
+   of uncompressed data, and each point holds 32KB, so span should be several
+   MB for large files.  NULL is returned if the file can't be read. */
+io_gz_index_t *io_gz_index_build(const char *filename, size_t span);
+
+/* Save the index to filename.idx and load it back. */
+bool io_gz_index_save(const io_gz_index_t *h, const char *filename);
+io_gz_index_t *io_gz_index_load(const char *filename);
+
+/* Load filename.idx if it is newer than the gz file, otherwise build the
+   index and save it next to the file. */
+io_gz_index_t *io_gz_index_init(const char *filename, size_t span);
+
+void io_gz_index_destroy(io_gz_index_t *h);
+
+/* Read the records in [offset, offset + length) of the uncompressed data of
+   a gz file.  Only the data after the closest access point before offset is
+   inflated, so several threads can read different parts of one file.  The
+   range must begin and end on record boundaries. */
+io_in_t *io_in_init_gz_range(const char *filename, const io_gz_index_t *index,
+                             size_t offset, size_t length,
+                             io_in_options_t *options);
+
+/* Split filename into n cursors over ranges which are aligned to records, so
+   that a large file can be read by n threads.  Together the cursors return
+   each record once and in order.  Delimited files are split after the next
+   delimiter, fixed files on a multiple of the record size, and prefix files
+   by their record index (see io_out_options_record_index).  lz4 files are
+   split by block when they have an index (see io_lz4_index_load) and
+   delimited or fixed gz files are split when they have an index (see
+   io_gz_index_init).  Prefix files without a record index, other
+   compressed files and csv files are returned as the first cursor (the rest
+   are empty).  The array should be freed with aml_free after the cursors
+   are destroyed. */
+io_in_t **io_in_split(const char *filename, io_format_t format, size_t n,
+                      io_in_options_t *options);
+
+/* Load the index written with an lz4 file (filename.idx, see
+   io_out_options_lz4_index).  NULL is returned if it doesn't exist. */
+io_lz4_index_t *io_lz4_index_load(const char *filename);
+
+void io_lz4_index_destroy(io_lz4_index_t *h);
+
+/* Read the records which start in blocks [first_block, end_block) of the lz4
+   file without decompressing the blocks before them.  Splitting the blocks
+   into ranges allows one file to be read by several threads, each range
+   returns the records of its blocks exactly once. */
+io_in_t *io_in_init_lz4_blocks(const char *filename,
+                               const io_lz4_index_t *index,
+                               size_t first_block, size_t end_block,
+                               io_in_options_t *options);
+
+/* Read the lz4 file starting with the given record number (0 based). */
+io_in_t *io_in_init_lz4_at_record(const char *filename,
+                                  const io_lz4_index_t *index,
+                                  uint64_t record, io_in_options_t *options);
+
+/* Read the lz4 file starting with the first record which begins at or after
+   the given uncompressed byte offset. */
+io_in_t *io_in_init_lz4_at_offset(const char *filename,
+                                  const io_lz4_index_t *index,
+                                  uint64_t offset, io_in_options_t *options);
+
+/* Merge the sorted runs in filenames into n cursors over disjoint key
+   ranges, so that n threads can merge them at once.  Cursor i returns the
+   records between splitter keys i - 1 and i (sampled from the runs) in
+   sorted order, equal records are always in the same cursor (and reduced
+   with reducer if it is not NULL), and reading the cursors in order is the
+   same as merging all of the runs.  Each run must either be an lz4 file
+   with an index (see io_out_options_lz4_index) or an uncompressed fixed
+   length file (options format), as the split points are found by binary
+   search.  Otherwise, the first cursor merges every run and the rest are
+   empty.  The records of filenames[i] are tagged i.  The splitters are
+   located by the calling thread and up to n - 2 more.  The array should be
+   freed with aml_free after the cursors are destroyed. */
+io_in_t **io_in_range_merge(char **filenames, size_t num_files, size_t n,
+                            io_compare_cb compare, void *compare_arg,
+                            io_reducer_cb reducer, void *reducer_arg,
+                            io_in_options_t *options);
+
 /* Use this to create an io_in_t which allows cursoring over an array of
    io_record_t structures. */
 io_in_t *io_in_records_init(io_record_t *records, size_t num_records,
@@ -194,6 +318,10 @@ io_in_t *io_in_transform(io_in_t *in, io_format_t format, size_t buffer_size,
    record across the streams. */
 void io_in_ext_keep_first(io_in_t *h);
 
+/* When there are multiple input streams, compare an integer key prefix of
+   each record before calling compare (see io_key_prefix_cb in io.h). */
+void io_in_ext_key_prefix(io_in_t *h, io_key_prefix_cb key_prefix, void *arg);
+
 /* When there are multiple input streams, set the reducer */
 void io_in_ext_reducer(io_in_t *h, io_reducer_cb reducer, void *arg);
 
@@ -208,6 +336,15 @@ size_t io_in_count(io_in_t *h);
 /* Advance to the next record and return it. */
 io_record_t *io_in_advance(io_in_t *h);
 
+/* Advance up to max records at once and copy them into out, returning the
+   number of records (0 at the end of the input).  The records remain valid
+   until the next call to advance (or advance_batch) and the current record
+   is the last one returned.  Normal (including lz4), records, and list
+   cursors return as many records as are already buffered.  Other cursors
+   return one record per call.  Because the records are not copied, records
+   from a batch are not zero terminated. */
+size_t io_in_advance_batch(io_in_t *h, io_record_t *out, size_t max);
+
 /* Get the current record (this will be NULL if advance hasn't been called or
  * io_in_reset was called). */
 io_record_t *io_in_current(io_in_t *h);
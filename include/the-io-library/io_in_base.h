@@ -8,6 +8,7 @@
 #define _io_in_base_H
 
 #include "a-memory-library/aml_alloc.h"
+#include "the-io-library/io.h"
 
 #include <inttypes.h>
 #include <sys/types.h>
@@ -28,12 +29,56 @@ io_in_base_t *io_in_base_init_gz(const char *filename, int fd, bool can_close,
                                  size_t buffer_size);
 io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
                               size_t buffer_size);
+/*
+  reads a zstd compressed file (or fd).  Concatenated frames are read as one
+  stream.
+*/
+io_in_base_t *io_in_base_init_zstd(const char *filename, int fd,
+                                   bool can_close, size_t buffer_size);
+/*
+  maps the file into memory instead of reading it through a buffer.  Records
+  point directly into the (read-only) mapping and are not zero terminated.
+  buffer_size is the amount to read ahead.  If the file cannot be mapped,
+  this falls back to io_in_base_init.
+*/
+io_in_base_t *io_in_base_init_mmap(const char *filename, int fd, bool can_close,
+                                   size_t buffer_size);
+/*
+  reads length bytes of filename starting at offset.  The file is read with
+  pread on its own descriptor, so several ranges of the same file can be read
+  at once.
+*/
+io_in_base_t *io_in_base_init_range(const char *filename, size_t offset,
+                                    size_t length, size_t buffer_size);
+/*
+  reads length bytes of the uncompressed data of a gz file starting at
+  offset.  Decompression starts from the closest access point in the index
+  (see io_gz_index_build), so only the bytes after that point are inflated.
+*/
+io_in_base_t *io_in_base_init_gz_index(const char *filename,
+                                       const io_gz_index_t *index,
+                                       size_t offset, size_t length,
+                                       size_t buffer_size);
 io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free);
 io_in_base_t *io_in_base_reinit(io_in_base_t *base, size_t buffer_size);
 
+/*
+  starts a thread which reads (and for gz and zstd, decompresses) the next chunk_size
+  bytes while the current buffer is consumed.  This does nothing for buffers
+  and memory mapped files.
+*/
+void io_in_base_read_ahead(io_in_base_t *h, size_t chunk_size);
+
 const char *io_in_base_filename(io_in_base_t *h);
 
+/*
+  moves a plain file or a range (see io_in_base_init_range) to offset and
+  drops what is buffered.  A range keeps its end.  Returns false for
+  compressed and memory mapped input and once read ahead is started.
+*/
+bool io_in_base_seek(io_in_base_t *h, size_t offset);
+
 char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
                                 bool required);
 
@@ -47,6 +92,13 @@ char *io_in_base_read(io_in_base_t *h, int32_t len);
 */
 char *io_in_base_readz(io_in_base_t *h, int32_t *rlen, int32_t len);
 
+/*
+  returns the unread bytes which are already buffered without reading more
+  (*len is set to the number of bytes).  Use io_in_base_skip to consume them.
+*/
+char *io_in_base_peek(io_in_base_t *h, size_t *len);
+void io_in_base_skip(io_in_base_t *h, size_t len);
+
 void io_in_base_destroy(io_in_base_t *h);
 
 #ifdef __cplusplus
@@ -37,6 +37,25 @@ bool io_out_write_record(io_out_t *h, const void *d, size_t len);
    final file and give you access to the cursor. */
 io_in_t *io_out_in(io_out_t *h);
 
+/* Finish a partitioned output and return a cursor for each of its
+   num_partitions partitions (in order), so that the partitions can be
+   processed by separate threads as soon as they are written.  Sorted
+   partitions which fit in their sort buffer are returned from memory and
+   larger ones are merged from their tmp files, so the final partition files
+   are not written.  Unsorted partitions are read back from their files, which
+   are removed as the cursors are destroyed.  An output with zero or one
+   partitions returns one cursor.  The array should be freed with aml_free
+   after the cursors are destroyed. */
+io_in_t **io_out_partitioned_in(io_out_t *h);
+
+/* Like io_out_in, except that a sorted partitioned output is merged as n
+   cursors over disjoint key ranges which can be read by n threads (see
+   io_in_range_merge).  The partitions must be fixed length or lz4 with an
+   index (io_out_options_lz4_index) to be split.  Other outputs are returned
+   as the first cursor and the rest are empty.  The array should be freed
+   with aml_free after the cursors are destroyed. */
+io_in_t **io_out_in_ranges(io_out_t *h, size_t n);
+
 /* destroy the output. */
 void io_out_destroy(io_out_t *h);
 
@@ -92,6 +111,23 @@ void io_out_options_write_ack_file(io_out_options_t *h);
 */
 void io_out_options_gz(io_out_options_t *h, int level);
 
+/* Compress gz output on num_threads worker threads (0, the default, uses
+   gzwrite on the writing thread).  Each buffer (at least 1MB) is compressed
+   as a separate gzip member and the members are written in order.
+   Concatenated members are a valid gzip file which io_in and gunzip read as
+   one stream. */
+void io_out_options_gz_threads(io_out_options_t *h, size_t num_threads);
+
+/*
+  Set the level of compression and identify the output as zstd if filename
+  is not present (otherwise a .zst extension selects zstd).  num_threads > 0
+  compresses on libzstd's worker threads, which produces a single frame just
+  like the single threaded mode.  Low levels (1-3) compress at speeds
+  similar to gz level 1 with a better ratio.
+*/
+void io_out_options_zstd(io_out_options_t *h, int level,
+                         size_t num_threads);
+
 /*
   Set the level of compression, the block size, whether block checksums are
   used, and content checksums.  The default is that the checksums are not
@@ -101,6 +137,26 @@ void io_out_options_lz4(io_out_options_t *h, int level,
                         lz4_block_size_t size, bool block_checksum,
                         bool content_checksum);
 
+/* Compress lz4 blocks on num_threads worker threads (0, the default,
+   compresses on the writing thread).  The blocks are written in order, so
+   the output is the same.  This is ignored if the content checksum is
+   enabled.  Sorted output passes this to its lz4 tmp files. */
+void io_out_options_lz4_threads(io_out_options_t *h, size_t num_threads);
+
+/* Write an index of the lz4 blocks to filename.idx when the output is
+   destroyed.  The index has the offset of each block along with the number
+   of the first record in it, so that io_in can seek by record or byte offset
+   and read ranges of blocks (see io_lz4_index_load).  This is ignored for
+   outputs without a filename. */
+void io_out_options_lz4_index(io_out_options_t *h);
+
+/* Write an index of uncompressed output to filename.idx when the output is
+   destroyed.  It has the same format as the lz4 index where each write of
+   the buffer is a block (its offset and uncompressed offset are the same),
+   so that prefix files can be split by io_in_split.  This is ignored for
+   compressed output, append mode and outputs without a filename. */
+void io_out_options_record_index(io_out_options_t *h);
+
 /* extended options are for partitioned output, sorted output, or both */
 void io_out_ext_options_init(io_out_ext_options_t *h);
 
@@ -116,10 +172,69 @@ void io_out_ext_options_sort_before_partitioning(io_out_ext_options_t *h);
    are being written out using this option. */
 void io_out_ext_options_sort_while_partitioning(io_out_ext_options_t *h);
 
+/* Allow many threads to call io_out_write_record on one partitioned output
+   at the same time.  Each producer thread stages its records in its own 1MB
+   buffer, and when the buffer fills, the records are grouped by partition and
+   appended to each partition while holding only that partition's lock.  All
+   of the producers must be finished before the output is destroyed (or
+   io_out_in is called).  A single partition is still written through the
+   partitioned writer so that this holds.  This is ignored without partitions
+   or with sort_before_partitioning. */
+void io_out_ext_options_concurrent(io_out_ext_options_t *h);
+
+/* Normally each partition gets buffer_size / num_partitions bytes, which
+   leaves cold partitions mostly idle while hot partitions write constantly.
+   With this option, the partitions share one arena of 64KB blocks which are
+   handed out as records arrive.  When the arena is full, the partition using
+   the most blocks is written out in one sequential burst and its blocks are
+   reused.  Each partition keeps a small output buffer of its own (at most
+   64KB).  This is ignored with sort_while_partitioning (each partition needs
+   its own sort buffer) and with concurrent writers. */
+void io_out_ext_options_shared_partition_buffer(io_out_ext_options_t *h);
+
 /* when partitioning and sorting - how many partitions can be sorted at once? */
 void io_out_ext_options_num_sort_threads(io_out_ext_options_t *h,
                                          size_t num_sort_threads);
 
+/* Sort each sorted output buffer with num_threads threads before it is
+   written.  The buffer is split into num_threads chunks which are sorted in
+   parallel and then merged as they are written. */
+void io_out_ext_options_num_buffer_sort_threads(io_out_ext_options_t *h,
+                                                size_t num_threads);
+
+/* Generate the sorted tmp files with replacement selection.  Once the buffer
+   fills, the buffered records are kept in a heap and each new record pushes
+   the smallest record which can extend the open run out to it, reusing its
+   space.  A run keeps growing until none of the buffered records can follow
+   it.  Runs are about 1.6 times the buffer size on random input (each record
+   carries a few bytes of bookkeeping) and nearly sorted input is written as
+   a single run, which means fewer tmp files to merge.  The buffer isn't
+   split for use_extra_thread in this mode.  This is ignored for fixed
+   records which are sorted in place. */
+void io_out_ext_options_replacement_selection(io_out_ext_options_t *h);
+
+/* Only keep the first limit records in sort order (after reducing).  Each
+   tmp file is cut to limit records as it is written (by the extra or spill
+   threads when they are used), and the last record of a cut tmp file means
+   that records which sort after it are discarded as they are written.  When
+   limit records fit in half of the buffer, a full buffer is cut in memory
+   instead and is only written if those records don't.  The merges and the
+   final cursor are cut to limit records as well.  A reducer which drops
+   records can make this return fewer than limit records.  This disables
+   replacement_selection. */
+void io_out_ext_options_limit(io_out_ext_options_t *h, size_t limit);
+
+/* When there are more sorted tmp files than can be merged at once, the
+   smallest are merged first (Huffman order) into larger tmp files until the
+   final merge has at most fan_in inputs.  By default, fan_in is the smaller
+   of buffer_size / 64KB (but at least 64) and what RLIMIT_NOFILE allows for
+   the merge threads.  The merges of each pass are independent and run on
+   num_threads threads (default 1). */
+void io_out_ext_options_merge_fan_in(io_out_ext_options_t *h, size_t fan_in);
+
+void io_out_ext_options_num_merge_threads(io_out_ext_options_t *h,
+                                          size_t num_threads);
+
 /* options for creating a partitioned output */
 void io_out_ext_options_partition(io_out_ext_options_t *h,
                                   io_partition_cb part, void *arg);
@@ -141,6 +256,14 @@ void io_out_ext_options_intermediate_compare(io_out_ext_options_t *h,
                                              io_compare_cb compare,
                                              void *arg);
 
+/* Sort by the unsigned 4 or 8 byte (native endian) integer at offset in each
+   record with a radix sort instead of calling compare.  Every record must
+   contain the key and compare must order records by the key first (as
+   io_compare_uint32_t and io_compare_uint64_t do).  compare is only called
+   for records with equal keys, including when the sorted runs are merged. */
+void io_out_ext_options_radix_key(io_out_ext_options_t *h, size_t offset,
+                                  size_t width);
+
 /* set the reducers */
 void io_out_ext_options_reducer(io_out_ext_options_t *h,
                                 io_reducer_cb reducer, void *arg);
@@ -151,12 +274,57 @@ void io_out_ext_options_intermediate_reducer(io_out_ext_options_t *h,
                                              io_reducer_cb reducer,
                                              void *arg);
 
+/* Combine records with equal keys as they are written instead of after the
+   buffer is sorted.  A quarter of the buffer becomes an open addressing hash
+   table (keyed by hash and then compare) and a record whose key is already
+   buffered is reduced into it with the intermediate reducer.  The buffer is
+   only sorted and written once the table or the buffer fills, so data with
+   many duplicate keys writes far fewer tmp files.  The reducer is called
+   with two records at a time, so it must be able to reduce partial results.
+   This requires a reducer and is ignored for fixed records sorted in
+   place and with replacement_selection. */
+void io_out_ext_options_combiner(io_out_ext_options_t *h, io_hash_cb hash,
+                                 void *arg);
+
+/* Options for sorted output of fixed length records (io_fixed format).  When
+   fixed_sort is set, records are kept in the sort buffer without an
+   io_record_t for each record and sorted in place with fixed_sort.  Equal
+   records (by fixed_compare, or the intermediate compare) are passed to the
+   fixed reducer which should reduce them into the first record and return
+   false if the record should be dropped.  fixed_compare and fixed_reducer
+   are also used to merge the tmp files if compare and reducer are not
+   set. */
+void io_out_ext_options_fixed_compare(io_out_ext_options_t *h,
+                                      io_fixed_compare_cb compare, void *arg);
+
+void io_out_ext_options_fixed_sort(io_out_ext_options_t *h,
+                                   io_fixed_sort_cb sort, void *arg);
+
+void io_out_ext_options_fixed_reducer(io_out_ext_options_t *h,
+                                      io_fixed_reducer_cb reducer, void *arg);
+
 /* Use an extra thread when sorting output. */
 void io_out_ext_options_use_extra_thread(io_out_ext_options_t *h);
 
+/* A generalization of use_extra_thread.  The buffer is split into
+   num_buffers buffers.  When one fills, it is queued for num_threads spill
+   threads which sort, compress and write it as a tmp file while the writer
+   continues with a free buffer.  The writer only waits when every buffer is
+   full or being written.  num_threads is limited to num_buffers - 1.  This
+   is ignored with replacement_selection or an intermediate group size. */
+void io_out_ext_options_spill_threads(io_out_ext_options_t *h,
+                                      size_t num_buffers, size_t num_threads);
+
 /* Default tmp files are stored in lz4 format.  Disable this behavior. */
 void io_out_ext_options_dont_compress_tmp(io_out_ext_options_t *h);
 
+/* Store the sorted tmp files as zstd at level (1 is a good choice) instead of
+   lz4.  zstd tmp files are typically much smaller than lz4 ones for similar
+   compression speed, which reduces the spill I/O.  The output's zstd_threads
+   (io_out_options_zstd) are used to compress them.  Partition files are
+   still written as lz4. */
+void io_out_ext_options_zstd_tmp(io_out_ext_options_t *h, int level);
+
 /* used to create a partitioned filename */
 void io_out_partition_filename(char *dest, const char *filename, size_t id);
 
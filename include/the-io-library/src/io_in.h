@@ -21,10 +21,16 @@ typedef struct {
   int32_t tag;
 
   bool gz;
+  bool zstd;
   bool lz4;
+  bool mmap;
+  bool read_ahead;
+  size_t lz4_threads;
 
   bool full_record_required;
 
+  size_t loser_tree_threshold;
+
   io_compare_cb compare;
   void *compare_arg;
   io_reducer_cb reducer;
@@ -18,17 +18,34 @@ typedef struct {
   bool content_checksum;
 
   bool gz;
+  size_t gz_threads;
+  bool zstd;
+  size_t zstd_threads;
   bool lz4;
+  size_t lz4_threads;
+  bool lz4_index;
+  bool record_index;
 } io_out_options_t;
 
 typedef struct {
   /* need to set first block */
   bool use_extra_thread;
+  size_t num_spill_buffers;
+  size_t num_spill_threads;
   bool lz4_tmp;
+  bool zstd_tmp;
+  int zstd_tmp_level;
 
   bool sort_before_partitioning;
   bool sort_while_partitioning;
+  bool concurrent;
+  bool shared_partition_buffer;
   size_t num_sort_threads;
+  size_t num_buffer_sort_threads;
+  bool replacement_selection;
+  size_t limit;
+  size_t merge_fan_in;
+  size_t num_merge_threads;
 
   io_partition_cb partition;
   void *partition_arg;
@@ -37,6 +54,9 @@ typedef struct {
   io_compare_cb compare;
   void *compare_arg;
 
+  size_t radix_key_offset;
+  size_t radix_key_width;
+
   size_t num_per_group;
   io_compare_cb int_compare;
   void *int_compare_arg;
@@ -47,6 +67,9 @@ typedef struct {
   io_reducer_cb int_reducer;
   void *int_reducer_arg;
 
+  io_hash_cb combine_hash;
+  void *combine_hash_arg;
+
   io_fixed_reducer_cb fixed_reducer;
   void *fixed_reducer_arg;
 
@@ -0,0 +1,189 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "the-io-library/io_in.h"
+
+#include "a-memory-library/aml_alloc.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+  The index is built the same way as zlib's zran example.  The file is
+  inflated once with Z_BLOCK so that inflate stops at the end of every
+  deflate block.  At the first block boundary after every span bytes of
+  output, an access point is saved with the compressed position (down to
+  the bit) and the last 32KB of output, which is all that is needed to start
+  inflating from that point.
+*/
+#define IO_GZ_WINDOW 32768
+#define IO_GZ_CHUNK (64 * 1024)
+
+static void add_point(io_gz_index_t *h, size_t *size, int bits, uint64_t in,
+                      uint64_t out, unsigned left, unsigned char *window) {
+  if (h->num_points == *size) {
+    *size = *size ? *size * 2 : 16;
+    h->points = (io_gz_point_t *)aml_realloc(h->points,
+                                             *size * sizeof(io_gz_point_t));
+  }
+  io_gz_point_t *p = h->points + h->num_points;
+  p->bits = bits;
+  p->in = in;
+  p->out = out;
+  /* the window is circular and left bytes of it have not been written */
+  if (left)
+    memcpy(p->window, window + IO_GZ_WINDOW - left, left);
+  if (left < IO_GZ_WINDOW)
+    memcpy(p->window + left, window, IO_GZ_WINDOW - left);
+  h->num_points++;
+}
+
+io_gz_index_t *io_gz_index_build(const char *filename, size_t span) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 47) != Z_OK) {
+    close(fd);
+    return NULL;
+  }
+
+  unsigned char *input = (unsigned char *)aml_malloc(IO_GZ_CHUNK + IO_GZ_WINDOW);
+  unsigned char *window = input + IO_GZ_CHUNK;
+  io_gz_index_t *h = (io_gz_index_t *)aml_zalloc(sizeof(io_gz_index_t));
+  size_t size = 0;
+  uint64_t totin = 0, totout = 0, last = 0;
+  bool ok = false;
+  int ret = Z_OK;
+  strm.avail_out = 0;
+  while (true) {
+    if (!strm.avail_in) {
+      ssize_t n = read(fd, input, IO_GZ_CHUNK);
+      if (n < 0)
+        break;
+      if (n == 0) {
+        /* the end of the file is only valid after a complete member */
+        ok = ret == Z_STREAM_END;
+        break;
+      }
+      strm.avail_in = n;
+      strm.next_in = input;
+    }
+    if (ret == Z_STREAM_END) {
+      /* another member follows (concatenated gzip files) */
+      inflateReset(&strm);
+    }
+    if (!strm.avail_out) {
+      strm.avail_out = IO_GZ_WINDOW;
+      strm.next_out = window;
+    }
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    ret = inflate(&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END)
+      break;
+    /* at the end of a deflate block which isn't the last block */
+    if (ret == Z_OK && (strm.data_type & 128) && !(strm.data_type & 64) &&
+        (totout == 0 || totout - last > span)) {
+      add_point(h, &size, strm.data_type & 7, totin, totout, strm.avail_out,
+                window);
+      last = totout;
+    }
+  }
+  inflateEnd(&strm);
+  aml_free(input);
+  close(fd);
+  if (!ok) {
+    io_gz_index_destroy(h);
+    return NULL;
+  }
+  h->uncompressed_size = totout;
+  return h;
+}
+
+static char *index_filename(const char *filename) {
+  char *r = (char *)aml_malloc(strlen(filename) + 5);
+  strcpy(r, filename);
+  strcat(r, ".idx");
+  return r;
+}
+
+bool io_gz_index_save(const io_gz_index_t *h, const char *filename) {
+  char *idx_filename = index_filename(filename);
+  FILE *out = fopen(idx_filename, "wb");
+  aml_free(idx_filename);
+  if (!out)
+    return false;
+
+  uint64_t header[2] = {h->num_points, h->uncompressed_size};
+  bool written =
+      fwrite("IOGZIDX1", 8, 1, out) == 1 &&
+      fwrite(header, sizeof(header), 1, out) == 1 &&
+      (!h->num_points || fwrite(h->points, sizeof(io_gz_point_t),
+                                h->num_points, out) == h->num_points);
+  if (fclose(out))
+    written = false;
+  return written;
+}
+
+io_gz_index_t *io_gz_index_load(const char *filename) {
+  char *idx_filename = index_filename(filename);
+  FILE *in = fopen(idx_filename, "rb");
+  aml_free(idx_filename);
+  if (!in)
+    return NULL;
+
+  io_gz_index_t *h = NULL;
+  char magic[8];
+  uint64_t header[2];
+  if (fread(magic, 8, 1, in) == 1 && !memcmp(magic, "IOGZIDX1", 8) &&
+      fread(header, sizeof(header), 1, in) == 1) {
+    h = (io_gz_index_t *)aml_zalloc(sizeof(io_gz_index_t));
+    h->num_points = header[0];
+    h->uncompressed_size = header[1];
+    if (h->num_points) {
+      h->points = (io_gz_point_t *)aml_malloc(h->num_points *
+                                              sizeof(io_gz_point_t));
+      if (fread(h->points, sizeof(io_gz_point_t), h->num_points, in) !=
+          h->num_points) {
+        io_gz_index_destroy(h);
+        h = NULL;
+      }
+    }
+  }
+  fclose(in);
+  return h;
+}
+
+io_gz_index_t *io_gz_index_init(const char *filename, size_t span) {
+  char *idx_filename = index_filename(filename);
+  bool current = io_file_exists(idx_filename) &&
+                 io_modified(idx_filename) >= io_modified(filename);
+  aml_free(idx_filename);
+  io_gz_index_t *h = current ? io_gz_index_load(filename) : NULL;
+  if (h)
+    return h;
+
+  h = io_gz_index_build(filename, span);
+  if (h)
+    io_gz_index_save(h, filename);
+  return h;
+}
+
+void io_gz_index_destroy(io_gz_index_t *h) {
+  if (!h)
+    return;
+  if (h->points)
+    aml_free(h->points);
+  aml_free(h);
+}
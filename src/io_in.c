@@ -133,6 +133,8 @@ struct io_in_s {
   uint32_t block_header_size;
   char *zerop;
   char zero;
+
+  struct io_in_lz4_read_ahead_s *ra;
 };
 
 io_record_t *io_in_advance_unique_single(io_in_t *h, size_t *num_r) {
@@ -416,6 +418,7 @@ void io_in_ext_destroy(io_in_t *h);
 void io_in_records_destroy(io_in_t *hp);
 void io_in_destroy_from_list(io_in_t *hp);
 void io_in_destroy_from_cb(io_in_t *hp);
+static void lz4_read_ahead_destroy(struct io_in_lz4_read_ahead_s *ra);
 
 void io_in_destroy(io_in_t *h) {
   if (!h)
@@ -429,6 +432,8 @@ void io_in_destroy(io_in_t *h) {
   else if (h->type == IO_IN_CB_TYPE)
     io_in_destroy_from_cb(h);
   else {
+    if (h->ra)
+      lz4_read_ahead_destroy(h->ra);
     if (h->base)
       io_in_base_destroy(h->base);
     if (h->lz4)
@@ -450,30 +455,219 @@ void reset_block(io_in_buffer_t *b) {
   b->pos = 0;
 }
 
-static int read_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
-  uint32_t *s = (uint32_t *)io_in_base_read(h->base, 4);
+/* returns the next compressed block (within the base's buffer) or NULL */
+static char *read_lz4_compressed(io_in_base_t *base, uint32_t block_header_size,
+                                 uint32_t *len, bool *compressed) {
+  uint32_t *s = (uint32_t *)io_in_base_read(base, 4);
   if (!s)
-    return 0;
+    return NULL;
 
   uint32_t length = *s;
-  bool compressed = true;
+  *compressed = true;
   if (length & 0x80000000U) {
-    compressed = false;
+    *compressed = false;
     length -= 0x80000000U;
   }
   if (!length)
-    return 0;
+    return NULL;
+
+  length += block_header_size;
+  *len = length;
+  return io_in_base_read(base, length);
+}
 
-  length += h->block_header_size;
-  char *p = io_in_base_read(h->base, length);
+static int read_lz4_block(io_in_base_t *base, lz4_t *lz4,
+                          uint32_t block_size, uint32_t block_header_size,
+                          char *dp) {
+  uint32_t length;
+  bool compressed;
+  char *p = read_lz4_compressed(base, block_header_size, &length, &compressed);
   if (!p)
     return 0;
 
-  char *dp = dest->buffer + dest->used;
-  int n = lz4_decompress(h->lz4, p, length, dp, h->block_size, compressed);
-  if (n < 0)
-    return -1;
+  return lz4_decompress(lz4, p, length, dp, block_size, compressed);
+}
 
+/*
+  With read ahead (or lz4 threads), helper threads decompress the blocks
+  ahead of the consumer into a ring of slots.  Each thread copies the next
+  compressed block out of the base (the reads are serialized by read_mutex
+  and numbered in file order), decompresses it with its own lz4_t, and the
+  consumer takes the slots back in order.
+*/
+typedef struct {
+  char *in;
+  char *out;
+  uint32_t in_len;
+  bool compressed;
+  int length;
+  bool busy;
+  bool done;
+} io_in_lz4_slot_t;
+
+struct io_in_lz4_read_ahead_s {
+  pthread_mutex_t read_mutex;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  io_in_base_t *base;
+  uint32_t block_size;
+  uint32_t block_header_size;
+
+  io_in_lz4_slot_t *slots;
+  size_t num_slots;
+  size_t next; /* the next block to be read */
+  size_t rd;   /* the next block to be consumed */
+  bool eof;
+  bool stop;
+
+  size_t num_threads;
+  pthread_t *threads;
+  lz4_t **lz4;
+};
+typedef struct io_in_lz4_read_ahead_s io_in_lz4_read_ahead_t;
+
+typedef struct {
+  io_in_lz4_read_ahead_t *ra;
+  lz4_t *lz4;
+} io_in_lz4_worker_t;
+
+static void *lz4_read_ahead_thread(void *arg) {
+  io_in_lz4_read_ahead_t *ra = ((io_in_lz4_worker_t *)arg)->ra;
+  lz4_t *lz4 = ((io_in_lz4_worker_t *)arg)->lz4;
+  aml_free(arg);
+
+  while (true) {
+    pthread_mutex_lock(&ra->read_mutex);
+    pthread_mutex_lock(&ra->mutex);
+    io_in_lz4_slot_t *slot = ra->slots + (ra->next % ra->num_slots);
+    while (!ra->stop && !ra->eof && slot->busy)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    if (ra->stop || ra->eof) {
+      pthread_mutex_unlock(&ra->mutex);
+      pthread_mutex_unlock(&ra->read_mutex);
+      break;
+    }
+    ra->next++;
+    slot->busy = true;
+    pthread_mutex_unlock(&ra->mutex);
+
+    char *p = read_lz4_compressed(ra->base, ra->block_header_size,
+                                  &slot->in_len, &slot->compressed);
+    if (p)
+      memcpy(slot->in, p, slot->in_len);
+    else {
+      pthread_mutex_lock(&ra->mutex);
+      ra->eof = true;
+      pthread_mutex_unlock(&ra->mutex);
+    }
+    pthread_mutex_unlock(&ra->read_mutex);
+
+    int n = 0;
+    if (p)
+      n = lz4_decompress(lz4, slot->in, slot->in_len, slot->out,
+                         ra->block_size, slot->compressed);
+    pthread_mutex_lock(&ra->mutex);
+    slot->length = n;
+    slot->done = true;
+    if (n <= 0)
+      ra->eof = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+  }
+  return NULL;
+}
+
+static void lz4_read_ahead_init(io_in_t *h, const char *header,
+                                size_t num_threads) {
+  size_t num_slots = num_threads + 1;
+  size_t in_size = lz4_compressed_size(h->lz4) + h->block_header_size + 4;
+  io_in_lz4_read_ahead_t *ra = (io_in_lz4_read_ahead_t *)aml_zalloc(
+      sizeof(*ra) +
+      (num_slots * (sizeof(io_in_lz4_slot_t) + in_size + h->block_size)) +
+      (num_threads * (sizeof(pthread_t) + sizeof(lz4_t *))));
+  ra->base = h->base;
+  ra->block_size = h->block_size;
+  ra->block_header_size = h->block_header_size;
+  ra->slots = (io_in_lz4_slot_t *)(ra + 1);
+  ra->num_slots = num_slots;
+  ra->threads = (pthread_t *)(ra->slots + num_slots);
+  ra->lz4 = (lz4_t **)(ra->threads + num_threads);
+  char *p = (char *)(ra->lz4 + num_threads);
+  for (size_t i = 0; i < num_slots; i++) {
+    ra->slots[i].in = p;
+    p += in_size;
+    ra->slots[i].out = p;
+    p += h->block_size;
+  }
+  pthread_mutex_init(&ra->read_mutex, NULL);
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    ra->lz4[i] = lz4_init_decompress(header, 7);
+    io_in_lz4_worker_t *w =
+        (io_in_lz4_worker_t *)aml_malloc(sizeof(io_in_lz4_worker_t));
+    w->ra = ra;
+    w->lz4 = ra->lz4[i];
+    if (pthread_create(ra->threads + i, NULL, lz4_read_ahead_thread, w) !=
+        0) {
+      aml_free(w);
+      lz4_destroy(ra->lz4[i]);
+      break;
+    }
+    ra->num_threads++;
+  }
+  if (!ra->num_threads) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    pthread_mutex_destroy(&ra->read_mutex);
+    aml_free(ra);
+    return;
+  }
+  h->ra = ra;
+}
+
+static void lz4_read_ahead_destroy(io_in_lz4_read_ahead_t *ra) {
+  pthread_mutex_lock(&ra->mutex);
+  ra->stop = true;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+  for (size_t i = 0; i < ra->num_threads; i++) {
+    pthread_join(ra->threads[i], NULL);
+    lz4_destroy(ra->lz4[i]);
+  }
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mutex);
+  pthread_mutex_destroy(&ra->read_mutex);
+  aml_free(ra);
+}
+
+static int next_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
+  char *dp = dest->buffer + dest->used;
+  int n;
+  io_in_lz4_read_ahead_t *ra = h->ra;
+  if (ra) {
+    io_in_lz4_slot_t *slot = ra->slots + (ra->rd % ra->num_slots);
+    pthread_mutex_lock(&ra->mutex);
+    while (!slot->done)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    pthread_mutex_unlock(&ra->mutex);
+    n = slot->length;
+    if (n <= 0)
+      return n;
+    memcpy(dp, slot->out, n);
+    ra->rd++;
+    pthread_mutex_lock(&ra->mutex);
+    slot->done = false;
+    slot->busy = false;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+  } else {
+    n = read_lz4_block(h->base, h->lz4, h->block_size, h->block_header_size,
+                       dp);
+    if (n <= 0)
+      return n;
+  }
   dest->used += n;
   return n;
 }
@@ -481,7 +675,7 @@ static int read_lz4_block(io_in_t *h, io_in_buffer_t *dest) {
 static void fill_blocks(io_in_t *h, io_in_buffer_t *dest) {
   while (1) {
     if (dest->used + h->block_size <= dest->size) {
-      if (read_lz4_block(h, dest) <= 0) {
+      if (next_lz4_block(h, dest) <= 0) {
         dest->eof = true;
         return;
       }
@@ -519,6 +713,88 @@ io_in_t *io_in_quick_init(const char *filename, io_format_t format, size_t buffe
   return io_in_init(filename, &opts);
 }
 
+/* sets up the lz4 cursor over base (which is positioned at the first block)
+   and returns NULL (destroying base) if the header isn't valid */
+static io_in_t *_io_in_init_lz4(io_in_base_t *base, const char *header,
+                                io_in_options_t *options) {
+  lz4_t *lz4 = lz4_init_decompress(header, 7);
+  if (!lz4) {
+    io_in_base_destroy(base);
+    return NULL;
+  }
+  uint32_t buffer_size = options->buffer_size;
+  uint32_t block_size = lz4_block_size(lz4);
+  uint32_t block_header_size = lz4_block_header_size(lz4);
+  uint32_t compressed_size = lz4_compressed_size(lz4);
+  if (buffer_size < compressed_size + block_header_size + 4) {
+    // printf("reinit\n");
+    base = io_in_base_reinit(base, compressed_size + block_header_size + 4);
+  }
+  buffer_size = options->compressed_buffer_size;
+  if (buffer_size < (block_size * 2) + 100)
+    buffer_size = (block_size * 2) + 100;
+
+  io_in_t *h = (io_in_t *)aml_malloc(sizeof(io_in_t) + buffer_size + 1);
+  memset(h, 0, sizeof(*h));
+  h->lz4 = lz4;
+  h->buf.buffer = (char *)(h + 1);
+  h->buf.size = buffer_size;
+  h->block_size = block_size;
+  h->block_header_size = block_header_size;
+
+  h->options = *options;
+  h->base = base;
+  h->rec.tag = options->tag;
+  if (options->format < 0) {
+    h->delimiter = (-options->format) - 1;
+    h->advance = _advance_delimited_lz4;
+  } else if (options->format > 0) {
+    h->fixed = options->format;
+    h->advance = _advance_fixed_lz4;
+  } else
+    h->advance = _advance_prefix_lz4;
+  if (options->lz4_threads)
+    lz4_read_ahead_init(h, header, options->lz4_threads);
+  else if (options->read_ahead)
+    lz4_read_ahead_init(h, header, 1);
+  // printf("%p filling\n", h);
+  fill_blocks(h, &(h->buf));
+  return h;
+}
+
+static io_in_t *_io_in_init_plain(io_in_base_t *base,
+                                  io_in_options_t *options) {
+  io_in_t *h = (io_in_t *)aml_zalloc(sizeof(io_in_t));
+  h->options = *options;
+  h->base = base;
+  h->rec.tag = options->tag;
+  if (options->format < 0) {
+    h->delimiter = (-options->format) - 1;
+    h->advance = _advance_delimited;
+  } else if (options->format > 0) {
+    h->fixed = options->format;
+    h->advance = _advance_fixed;
+  } else
+    h->advance = _advance_prefix;
+  return h;
+}
+
+/* the part of init which is common to every format */
+static io_in_t *_io_in_init_advance(io_in_t *h, io_in_options_t *options) {
+  h->advance_unique = io_in_advance_unique_single;
+  h->advance_unique_tmp = h->advance_unique;
+
+  if (options->reducer) {
+    h->reducer_bh = aml_buffer_init(256);
+    h->reducer_group_bh = aml_buffer_init(256);
+    h->sub_advance = h->advance;
+    h->advance = advance_reduced;
+  }
+
+  h->advance_tmp = h->advance;
+  return h;
+}
+
 io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
                      size_t buf_len, bool can_free, io_in_options_t *options) {
   io_in_options_t opts;
@@ -544,15 +820,22 @@ io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
 
   io_in_base_t *base = NULL;
   if (buf) {
-    if (options->gz)
+    if (options->gz || options->zstd)
       abort();
 
     base = io_in_base_init_from_buffer((char *)buf, buf_len, can_free);
   } else {
     if ((!filename && options->gz) || io_extension(filename, "gz"))
       base = io_in_base_init_gz(filename, fd, can_close, options->buffer_size);
+    else if ((!filename && options->zstd) || io_extension(filename, "zst"))
+      base = io_in_base_init_zstd(filename, fd, can_close,
+                                  options->buffer_size);
+    else if (options->mmap)
+      base = io_in_base_init_mmap(filename, fd, can_close, options->buffer_size);
     else
       base = io_in_base_init(filename, fd, can_close, options->buffer_size);
+    if (base && options->read_ahead)
+      io_in_base_read_ahead(base, options->buffer_size);
   }
   io_in_t *h = NULL;
   if (!base) {
@@ -574,75 +857,19 @@ io_in_t *_io_in_init(const char *filename, int fd, bool can_close, void *buf,
       _io_in_empty(h);
       return h;
     }
-    lz4_t *lz4 = lz4_init_decompress(headerp, 7);
-    if (!lz4) {
-      io_in_base_destroy(base);
+    char header[7];
+    memcpy(header, headerp, 7);
+    h = _io_in_init_lz4(base, header, options);
+    if (!h) {
       if (options->abort_on_error)
         abort();
       h = (io_in_t *)aml_zalloc(sizeof(io_in_t));
       _io_in_empty(h);
       return h;
     }
-    uint32_t buffer_size = options->buffer_size;
-    uint32_t block_size = lz4_block_size(lz4);
-    uint32_t block_header_size = lz4_block_header_size(lz4);
-    uint32_t compressed_size = lz4_compressed_size(lz4);
-    if (buffer_size < compressed_size + block_header_size + 4) {
-      // printf("reinit\n");
-      base = io_in_base_reinit(base, compressed_size + block_header_size + 4);
-    }
-    buffer_size = options->compressed_buffer_size;
-    if (buffer_size < (block_size * 2) + 100)
-      buffer_size = (block_size * 2) + 100;
-
-    h = (io_in_t *)aml_malloc(sizeof(io_in_t) + buffer_size + 1);
-    memset(h, 0, sizeof(*h));
-    h->lz4 = lz4;
-    h->buf.buffer = (char *)(h + 1);
-    h->buf.size = buffer_size;
-    h->block_size = block_size;
-    h->block_header_size = block_header_size;
-
-    h->options = *options;
-    h->base = base;
-    h->rec.tag = options->tag;
-    if (options->format < 0) {
-      h->delimiter = (-options->format) - 1;
-      h->advance = _advance_delimited_lz4;
-    } else if (options->format > 0) {
-      h->fixed = options->format;
-      h->advance = _advance_fixed_lz4;
-    } else
-      h->advance = _advance_prefix_lz4;
-    // printf("%p filling\n", h);
-    fill_blocks(h, &(h->buf));
-    // printf("%p filled: %lu, %s\n", h, buffer_size, filename ? filename : "");
-  } else {
-    h = (io_in_t *)aml_zalloc(sizeof(io_in_t));
-    h->options = *options;
-    h->base = base;
-    h->rec.tag = options->tag;
-    if (options->format < 0) {
-      h->delimiter = (-options->format) - 1;
-      h->advance = _advance_delimited;
-    } else if (options->format > 0) {
-      h->fixed = options->format;
-      h->advance = _advance_fixed;
-    } else
-      h->advance = _advance_prefix;
-  }
-  h->advance_unique = io_in_advance_unique_single;
-  h->advance_unique_tmp = h->advance_unique;
-
-  if (options->reducer) {
-    h->reducer_bh = aml_buffer_init(256);
-    h->reducer_group_bh = aml_buffer_init(256);
-    h->sub_advance = h->advance;
-    h->advance = advance_reduced;
-  }
-
-  h->advance_tmp = h->advance;
-  return h;
+  } else
+    h = _io_in_init_plain(base, options);
+  return _io_in_init_advance(h, options);
 }
 
 io_record_t *advance_file_list(io_in_t *hp) {
@@ -898,9 +1125,760 @@ io_in_t *io_in_init_with_buffer(void *buf, size_t len, bool can_free,
   return _io_in_init(NULL, -1, false, buf, len, can_free, options);
 }
 
+io_in_t *io_in_init_range(const char *filename, size_t offset, size_t length,
+                          io_in_options_t *options) {
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+
+  io_in_base_t *base =
+      io_in_base_init_range(filename, offset, length, opts.buffer_size);
+  if (!base) {
+    if (opts.abort_on_file_not_found)
+      abort();
+    return io_in_empty();
+  }
+  if (opts.read_ahead)
+    io_in_base_read_ahead(base, opts.buffer_size);
+  return _io_in_init_advance(_io_in_init_plain(base, &opts), &opts);
+}
+
+io_in_t *io_in_init_gz_range(const char *filename, const io_gz_index_t *index,
+                             size_t offset, size_t length,
+                             io_in_options_t *options) {
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+
+  if (offset >= index->uncompressed_size)
+    return io_in_empty();
+  io_in_base_t *base = io_in_base_init_gz_index(filename, index, offset,
+                                                length, opts.buffer_size);
+  if (!base) {
+    if (opts.abort_on_file_not_found)
+      abort();
+    return io_in_empty();
+  }
+  return _io_in_init_advance(_io_in_init_plain(base, &opts), &opts);
+}
+
+/* like split_delimited for the uncompressed data of an indexed gz file */
+static size_t split_gz_delimited(const char *filename,
+                                 const io_gz_index_t *index, size_t pos,
+                                 size_t size, int delim) {
+  if (!pos)
+    return 0;
+  pos--;
+  io_in_base_t *base = io_in_base_init_gz_index(filename, index, pos,
+                                                size - pos, 64 * 1024);
+  if (!base)
+    return size;
+  int32_t len;
+  if (io_in_base_read_delimited(base, &len, delim, true))
+    pos += len + 1;
+  else
+    pos = size;
+  io_in_base_destroy(base);
+  return pos;
+}
+
+/* the first record boundary at or after pos (the byte after a delimiter) */
+static size_t split_delimited(const char *filename, size_t pos, size_t size,
+                              int delim) {
+  if (!pos)
+    return 0;
+  const size_t chunk = 64 * 1024;
+  char *buf = (char *)aml_malloc(chunk);
+  pos--;
+  while (pos < size) {
+    size_t len = size - pos < chunk ? size - pos : chunk;
+    if (!io_read_chunk_into_buffer(buf, NULL, filename, pos, len))
+      break;
+    char *p = io_find_delimiter(buf, buf + len, delim);
+    if (p) {
+      pos += (p - buf) + 1;
+      aml_free(buf);
+      return pos;
+    }
+    pos += len;
+  }
+  aml_free(buf);
+  return size;
+}
+
+static size_t lz4_index_start(const io_lz4_index_t *index, size_t block);
+
+io_in_t **io_in_split(const char *filename, io_format_t format, size_t n,
+                      io_in_options_t *options) {
+  if (!n)
+    return NULL;
+
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+  io_in_options_format(&opts, format);
+
+  io_in_t **res = (io_in_t **)aml_malloc(sizeof(io_in_t *) * n);
+  io_lz4_index_t *index = NULL;
+  if (io_extension(filename, "lz4"))
+    index = io_lz4_index_load(filename);
+  if (index) {
+    for (size_t i = 0; i < n; i++)
+      res[i] = io_in_init_lz4_blocks(filename, index,
+                                     (index->num_blocks * i) / n,
+                                     (index->num_blocks * (i + 1)) / n, &opts);
+    io_lz4_index_destroy(index);
+    return res;
+  }
+
+  /* gz files can be split with an index (but prefix records can't be found
+     without inflating everything before them) */
+  io_gz_index_t *gz_index = NULL;
+  if (io_extension(filename, "gz") && format)
+    gz_index = io_gz_index_load(filename);
+
+  /* prefix files have no marker to resync on, so they are split by the
+     record index (see io_out_options_record_index) */
+  if (!format && !io_extension(filename, "gz") &&
+      !io_extension(filename, "zst"))
+    index = io_lz4_index_load(filename);
+  if (index && index->uncompressed_size != io_file_size(filename)) {
+    io_lz4_index_destroy(index);
+    index = NULL;
+  }
+
+  /* compressed files without an index, prefix files without a record index
+     and csv files (where a delimiter may be quoted) can only be read from
+     the start */
+  bool csv = format < 0 && (-format) - 1 >= 256;
+  if (csv || io_extension(filename, "lz4") || io_extension(filename, "zst") ||
+      (io_extension(filename, "gz") && !gz_index) || (!format && !index)) {
+    io_gz_index_destroy(gz_index);
+    res[0] = io_in_init(filename, &opts);
+    for (size_t i = 1; i < n; i++)
+      res[i] = io_in_empty();
+    return res;
+  }
+
+  size_t size = gz_index ? gz_index->uncompressed_size : io_file_size(filename);
+  size_t *bounds = (size_t *)aml_malloc(sizeof(size_t) * (n + 1));
+  bounds[0] = 0;
+  bounds[n] = size;
+  if (format > 0) {
+    size_t num_records = size / format;
+    for (size_t i = 1; i < n; i++)
+      bounds[i] = ((num_records / n) * i + (num_records % n) * i / n) * format;
+  } else if (format < 0) {
+    for (size_t i = 1; i < n; i++) {
+      size_t pos = (size / n) * i;
+      if (pos < bounds[i - 1])
+        pos = bounds[i - 1];
+      if (gz_index)
+        bounds[i] = split_gz_delimited(filename, gz_index, pos, size,
+                                       (-format) - 1);
+      else
+        bounds[i] = split_delimited(filename, pos, size, (-format) - 1);
+    }
+  } else {
+    /* the first record which starts in the block at each split */
+    for (size_t i = 1; i < n; i++) {
+      size_t b = lz4_index_start(index, (index->num_blocks * i) / n);
+      bounds[i] = b < index->num_blocks &&
+                          index->blocks[b].first_record < index->num_records
+                      ? index->blocks[b].first_record_offset
+                      : size;
+      if (bounds[i] < bounds[i - 1])
+        bounds[i] = bounds[i - 1];
+    }
+    io_lz4_index_destroy(index);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (bounds[i] >= bounds[i + 1])
+      res[i] = io_in_empty();
+    else if (gz_index)
+      res[i] = io_in_init_gz_range(filename, gz_index, bounds[i],
+                                   bounds[i + 1] - bounds[i], &opts);
+    else
+      res[i] = io_in_init_range(filename, bounds[i], bounds[i + 1] - bounds[i],
+                                &opts);
+  }
+  io_gz_index_destroy(gz_index);
+  aml_free(bounds);
+  return res;
+}
+
+io_lz4_index_t *io_lz4_index_load(const char *filename) {
+  char *idx_filename = (char *)aml_malloc(strlen(filename) + 5);
+  strcpy(idx_filename, filename);
+  strcat(idx_filename, ".idx");
+  FILE *in = fopen(idx_filename, "rb");
+  aml_free(idx_filename);
+  if (!in)
+    return NULL;
+
+  io_lz4_index_t *h = NULL;
+  char magic[8];
+  uint64_t header[3];
+  if (fread(magic, 8, 1, in) == 1 && !memcmp(magic, "IOLZ4IDX", 8) &&
+      fread(header, sizeof(header), 1, in) == 1) {
+    h = (io_lz4_index_t *)aml_malloc(sizeof(io_lz4_index_t) +
+                                     header[0] * sizeof(io_lz4_block_t));
+    h->num_blocks = header[0];
+    h->num_records = header[1];
+    h->uncompressed_size = header[2];
+    h->blocks = (io_lz4_block_t *)(h + 1);
+    if (h->num_blocks && fread(h->blocks, sizeof(io_lz4_block_t),
+                               h->num_blocks, in) != h->num_blocks) {
+      aml_free(h);
+      h = NULL;
+    }
+  }
+  fclose(in);
+  return h;
+}
+
+void io_lz4_index_destroy(io_lz4_index_t *h) {
+  if (h)
+    aml_free(h);
+}
+
+/* move past blocks which no record starts in */
+static size_t lz4_index_start(const io_lz4_index_t *index, size_t block) {
+  while (block + 1 < index->num_blocks &&
+         index->blocks[block].first_record_offset >=
+             index->blocks[block + 1].uncompressed_offset)
+    block++;
+  return block;
+}
+
+/* the size of r as it was written (including the prefix or delimiter) */
+static inline size_t lz4_record_size(io_in_t *h, io_record_t *r) {
+  if (h->fixed)
+    return h->fixed;
+  if (h->options.format < 0)
+    return r->length + 1;
+  return r->length + 4;
+}
+
+/* opens an lz4 cursor positioned at the first record of block (without the
+   reducer) or returns NULL */
+static io_in_t *lz4_index_open(const char *filename,
+                               const io_lz4_index_t *index, size_t block,
+                               io_in_options_t *options) {
+  io_lz4_block_t *b = index->blocks + block;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    if (options->abort_on_file_not_found)
+      abort();
+    return NULL;
+  }
+  char header[7];
+  if (pread(fd, header, 7, 0) != 7 ||
+      lseek(fd, b->offset, SEEK_SET) == (off_t)-1) {
+    close(fd);
+    if (options->abort_on_error)
+      abort();
+    return NULL;
+  }
+
+  if (!options->compressed_buffer_size)
+    options->compressed_buffer_size = options->buffer_size;
+  size_t tmp = options->buffer_size;
+  options->buffer_size = options->compressed_buffer_size;
+  options->compressed_buffer_size = tmp;
+
+  io_in_base_t *base;
+  if (options->mmap)
+    base = io_in_base_init_mmap(filename, fd, true, options->buffer_size);
+  else
+    base = io_in_base_init(filename, fd, true, options->buffer_size);
+  if (base && options->read_ahead)
+    io_in_base_read_ahead(base, options->buffer_size);
+  io_in_t *h = base ? _io_in_init_lz4(base, header, options) : NULL;
+  if (!h) {
+    if (options->abort_on_error)
+      abort();
+    return NULL;
+  }
+  size_t skip = b->first_record_offset - b->uncompressed_offset;
+  h->buf.pos = skip < h->buf.used ? skip : h->buf.used;
+  return h;
+}
+
+static inline void cleanup_last_read(io_in_t *h);
+
+/* moves a cursor from lz4_index_open to the first record of block, which
+   fails once read ahead is started */
+static bool lz4_index_seek(io_in_t *h, const io_lz4_index_t *index,
+                           size_t block) {
+  io_lz4_block_t *b = index->blocks + block;
+  if (h->ra || !io_in_base_seek(h->base, b->offset))
+    return false;
+  cleanup_last_read(h);
+  h->buf.used = 0;
+  h->buf.pos = 0;
+  h->buf.eof = false;
+  h->current = NULL;
+  h->num_current = 0;
+  fill_blocks(h, &(h->buf));
+  size_t skip = b->first_record_offset - b->uncompressed_offset;
+  h->buf.pos = skip < h->buf.used ? skip : h->buf.used;
+  return true;
+}
+
+io_in_t *io_in_init_lz4_blocks(const char *filename,
+                               const io_lz4_index_t *index,
+                               size_t first_block, size_t end_block,
+                               io_in_options_t *options) {
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+
+  if (end_block > index->num_blocks)
+    end_block = index->num_blocks;
+  if (first_block >= end_block)
+    return io_in_empty();
+
+  uint64_t first = index->blocks[first_block].first_record;
+  uint64_t end = end_block < index->num_blocks
+                     ? index->blocks[end_block].first_record
+                     : index->num_records;
+  if (first >= end)
+    return io_in_empty();
+
+  io_in_t *h = lz4_index_open(filename, index,
+                              lz4_index_start(index, first_block), &opts);
+  if (!h)
+    return io_in_empty();
+  _io_in_init_advance(h, &opts);
+  io_in_limit(h, end - first);
+  return h;
+}
+
+io_in_t *io_in_init_lz4_at_record(const char *filename,
+                                  const io_lz4_index_t *index,
+                                  uint64_t record, io_in_options_t *options) {
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+
+  if (record >= index->num_records)
+    return io_in_empty();
+
+  /* the last block whose first record is at or before record */
+  size_t lo = 0, hi = index->num_blocks;
+  while (hi - lo > 1) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (index->blocks[mid].first_record <= record)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  lo = lz4_index_start(index, lo);
+  io_in_t *h = lz4_index_open(filename, index, lo, &opts);
+  if (!h)
+    return io_in_empty();
+  for (uint64_t i = index->blocks[lo].first_record; i < record; i++) {
+    if (!h->advance(h))
+      break;
+  }
+  /* the skipped records must not come back after io_in_reset */
+  h->current = NULL;
+  h->num_current = 0;
+  return _io_in_init_advance(h, &opts);
+}
+
+io_in_t *io_in_init_lz4_at_offset(const char *filename,
+                                  const io_lz4_index_t *index,
+                                  uint64_t offset, io_in_options_t *options) {
+  io_in_options_t opts;
+  if (options)
+    opts = *options;
+  else
+    io_in_options_init(&opts);
+
+  if (offset >= index->uncompressed_size || !index->num_blocks)
+    return io_in_empty();
+
+  /* the block which offset is in */
+  size_t lo = 0, hi = index->num_blocks;
+  while (hi - lo > 1) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (index->blocks[mid].uncompressed_offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  lo = lz4_index_start(index, lo);
+  if (index->blocks[lo].first_record >= index->num_records)
+    return io_in_empty();
+  io_in_t *h = lz4_index_open(filename, index, lo, &opts);
+  if (!h)
+    return io_in_empty();
+
+  /* skip the records which start before offset */
+  uint64_t pos = index->blocks[lo].first_record_offset;
+  io_record_t *r;
+  while (pos < offset && (r = h->advance(h)) != NULL)
+    pos += lz4_record_size(h, r);
+  h->current = NULL;
+  h->num_current = 0;
+  return _io_in_init_advance(h, &opts);
+}
+
+/*
+  Range merging.  Every run is sorted by compare and can be opened at a
+  record number, lz4 runs through their block index and fixed runs by
+  offset.  Splitter keys are sampled from the runs and, for each splitter,
+  the number of records less than it is found in every run with a binary
+  search over the run's access points (the first record of each block for
+  lz4, every record for fixed runs) followed by a short scan.  Range i merges
+  the records between splitter i - 1 and splitter i of every run, so equal
+  records always end up in the same range.
+*/
+typedef struct {
+  const char *filename;
+  /* the index of the file in filenames, which is the tag of its records */
+  int tag;
+  io_lz4_index_t *index;
+  uint64_t num_records;
+  /* the record number of each access point (NULL for fixed runs, where
+     every record is one) */
+  uint64_t *points;
+  size_t num_points;
+} io_range_run_t;
+
+typedef struct {
+  io_range_run_t *runs;
+  size_t num_runs;
+  size_t n;
+  io_record_t *splitters; /* n - 1 */
+  uint64_t *bounds;       /* n + 1 per run */
+  io_compare_cb compare;
+  void *compare_arg;
+  io_in_options_t opts;
+  io_in_options_t probe_opts;
+
+  size_t next;
+  pthread_mutex_t mutex;
+} io_range_merge_t;
+
+static io_in_t *range_run_open(io_range_run_t *run, uint64_t record,
+                               io_in_options_t *opts) {
+  if (run->index)
+    return io_in_init_lz4_at_record(run->filename, run->index, record, opts);
+  size_t fixed = opts->format;
+  return io_in_init_range(run->filename, record * fixed,
+                          (run->num_records - record) * fixed, opts);
+}
+
+static inline uint64_t range_run_point(io_range_run_t *run, size_t p) {
+  return run->points ? run->points[p] : p;
+}
+
+/* moves a cursor from range_run_open to record */
+static bool range_run_seek(io_range_run_t *run, io_in_t *in,
+                           uint64_t record) {
+  if (!in->base)
+    return false;
+  if (!run->index) {
+    cleanup_last_read(in);
+    in->current = NULL;
+    in->num_current = 0;
+    return io_in_base_seek(in->base, record * in->fixed);
+  }
+  const io_lz4_index_t *index = run->index;
+  size_t lo = 0, hi = index->num_blocks;
+  while (hi - lo > 1) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (index->blocks[mid].first_record <= record)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  lo = lz4_index_start(index, lo);
+  if (!lz4_index_seek(in, index, lo))
+    return false;
+  for (uint64_t i = index->blocks[lo].first_record; i < record; i++) {
+    if (!in->advance(in))
+      return false;
+  }
+  in->current = NULL;
+  in->num_current = 0;
+  return true;
+}
+
+/* The binary searches and the sampling read one record at a time from all
+   over a run, so each thread keeps one cursor per run (*inp) and moves it
+   rather than opening the run again for every probe. */
+static io_record_t *range_run_probe(io_range_merge_t *m, io_range_run_t *run,
+                                    io_in_t **inp, uint64_t record) {
+  if (*inp && !range_run_seek(run, *inp, record)) {
+    io_in_destroy(*inp);
+    *inp = NULL;
+  }
+  if (!*inp)
+    *inp = range_run_open(run, record, &m->probe_opts);
+  return io_in_advance(*inp);
+}
+
+static bool range_run_init(io_range_run_t *run, const char *filename,
+                           int tag, io_format_t format) {
+  memset(run, 0, sizeof(*run));
+  run->filename = filename;
+  run->tag = tag;
+  if (io_extension(filename, "lz4")) {
+    run->index = io_lz4_index_load(filename);
+    if (!run->index)
+      return false;
+    run->num_records = run->index->num_records;
+    run->points = (uint64_t *)aml_malloc(
+        (run->index->num_blocks + 1) * sizeof(uint64_t));
+    /* blocks which don't start a record share the next block's first
+       record */
+    for (size_t i = 0; i < run->index->num_blocks; i++) {
+      uint64_t r = run->index->blocks[i].first_record;
+      if (r < run->num_records &&
+          (!run->num_points || run->points[run->num_points - 1] != r))
+        run->points[run->num_points++] = r;
+    }
+    return true;
+  }
+  if (format <= 0 || io_extension(filename, "gz") ||
+      io_extension(filename, "zst"))
+    return false;
+  run->num_records = io_file_size(filename) / format;
+  run->num_points = run->num_records;
+  return true;
+}
+
+/* the number of records in run which are less than key */
+static uint64_t range_run_lower_bound(io_range_merge_t *m,
+                                      io_range_run_t *run, io_in_t **inp,
+                                      const io_record_t *key) {
+  /* the number of access points whose record is less than key */
+  size_t lo = 0, hi = run->num_points;
+  while (lo < hi) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    io_record_t *r = range_run_probe(m, run, inp, range_run_point(run, mid));
+    if (r && m->compare(r, key, m->compare_arg) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo)
+    return 0;
+
+  /* scan from the last point before key */
+  uint64_t record = range_run_point(run, lo - 1);
+  io_record_t *r = range_run_probe(m, run, inp, record);
+  while (r && m->compare(r, key, m->compare_arg) < 0) {
+    record++;
+    r = io_in_advance(*inp);
+  }
+  return record;
+}
+
+static void *range_merge_bounds(void *arg) {
+  io_range_merge_t *m = (io_range_merge_t *)arg;
+  io_in_t **probes =
+      (io_in_t **)aml_zalloc(sizeof(io_in_t *) * m->num_runs);
+  while (true) {
+    pthread_mutex_lock(&m->mutex);
+    size_t s = m->next++;
+    pthread_mutex_unlock(&m->mutex);
+    if (s >= m->n - 1)
+      break;
+    for (size_t i = 0; i < m->num_runs; i++)
+      m->bounds[(i * (m->n + 1)) + s + 1] = range_run_lower_bound(
+          m, m->runs + i, probes + i, m->splitters + s);
+  }
+  for (size_t i = 0; i < m->num_runs; i++) {
+    if (probes[i])
+      io_in_destroy(probes[i]);
+  }
+  aml_free(probes);
+  return NULL;
+}
+
+/* weighted quantiles of records sampled evenly from every run */
+static void range_merge_splitters(io_range_merge_t *m, aml_buffer_t *bh) {
+  size_t per_run = m->n * 8;
+  size_t num_samples = 0;
+  for (size_t i = 0; i < m->num_runs; i++)
+    num_samples += m->runs[i].num_records < per_run ? m->runs[i].num_records
+                                                    : per_run;
+  io_record_t *samples =
+      (io_record_t *)aml_malloc((num_samples + 1) * sizeof(io_record_t));
+  double *weights = (double *)aml_malloc((num_samples + 1) * sizeof(double));
+  size_t *offsets = (size_t *)aml_malloc((num_samples + 1) * sizeof(size_t));
+  double total = 0.0;
+  size_t ns = 0;
+  for (size_t i = 0; i < m->num_runs; i++) {
+    io_range_run_t *run = m->runs + i;
+    size_t num = run->num_records < per_run ? run->num_records : per_run;
+    io_in_t *in = NULL;
+    for (size_t j = 0; j < num; j++) {
+      io_record_t *r =
+          range_run_probe(m, run, &in, (run->num_records * j) / num);
+      if (r) {
+        offsets[ns] = aml_buffer_length(bh);
+        aml_buffer_append(bh, r->record, r->length);
+        samples[ns].length = r->length;
+        samples[ns].tag = ns;
+        weights[ns] = (double)run->num_records / num;
+        total += weights[ns];
+        ns++;
+      }
+    }
+    if (in)
+      io_in_destroy(in);
+  }
+  /* the buffer may have moved while the samples were appended */
+  char *base = aml_buffer_data(bh);
+  for (size_t i = 0; i < ns; i++)
+    samples[i].record = base + offsets[i];
+  io_sort_records(samples, ns, m->compare, m->compare_arg);
+
+  double sum = 0.0;
+  size_t s = 0;
+  for (size_t i = 1; i < m->n; i++) {
+    double target = (total * i) / m->n;
+    while (s + 1 < ns && sum + weights[samples[s].tag] < target) {
+      sum += weights[samples[s].tag];
+      s++;
+    }
+    m->splitters[i - 1] = samples[s];
+  }
+  aml_free(offsets);
+  aml_free(weights);
+  aml_free(samples);
+}
+
+io_in_t **io_in_range_merge(char **filenames, size_t num_files, size_t n,
+                            io_compare_cb compare, void *compare_arg,
+                            io_reducer_cb reducer, void *reducer_arg,
+                            io_in_options_t *options) {
+  if (!n)
+    return NULL;
+
+  io_range_merge_t m;
+  memset(&m, 0, sizeof(m));
+  if (options)
+    m.opts = *options;
+  else
+    io_in_options_init(&m.opts);
+  m.compare = compare;
+  m.compare_arg = compare_arg;
+  m.n = n;
+  m.probe_opts = m.opts;
+  /* probe cursors are moved with io_in_base_seek */
+  m.probe_opts.read_ahead = false;
+  m.probe_opts.mmap = false;
+  m.probe_opts.lz4_threads = 0;
+  m.probe_opts.reducer = NULL;
+  if (m.probe_opts.buffer_size > 64 * 1024)
+    m.probe_opts.buffer_size = 64 * 1024;
+
+  io_in_t **res = (io_in_t **)aml_zalloc(sizeof(io_in_t *) * n);
+  m.runs = (io_range_run_t *)aml_zalloc(sizeof(io_range_run_t) *
+                                        (num_files + 1));
+  bool ok = true;
+  for (size_t i = 0; i < num_files; i++) {
+    if (!range_run_init(m.runs + m.num_runs, filenames[i], i,
+                        m.opts.format))
+      ok = false;
+    if (m.runs[m.num_runs].num_records)
+      m.num_runs++;
+    else {
+      io_lz4_index_destroy(m.runs[m.num_runs].index);
+      if (m.runs[m.num_runs].points)
+        aml_free(m.runs[m.num_runs].points);
+    }
+  }
+
+  if (ok && m.num_runs && n > 1) {
+    aml_buffer_t *bh = aml_buffer_init(1024);
+    m.splitters = (io_record_t *)aml_malloc(sizeof(io_record_t) * n);
+    m.bounds = (uint64_t *)aml_zalloc(sizeof(uint64_t) * m.num_runs * (n + 1));
+    range_merge_splitters(&m, bh);
+    for (size_t i = 0; i < m.num_runs; i++)
+      m.bounds[(i * (n + 1)) + n] = m.runs[i].num_records;
+
+    /* the calling thread takes splitters as well, so the bounds are found
+       even if no thread can be started */
+    pthread_mutex_init(&m.mutex, NULL);
+    pthread_t *threads = (pthread_t *)aml_malloc(sizeof(pthread_t) * n);
+    size_t num_threads = 0;
+    while (num_threads + 2 < n &&
+           pthread_create(threads + num_threads, NULL, range_merge_bounds,
+                          &m) == 0)
+      num_threads++;
+    range_merge_bounds(&m);
+    for (size_t i = 0; i < num_threads; i++)
+      pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&m.mutex);
+    aml_free(threads);
+    aml_buffer_destroy(bh);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (!ok && i) {
+      res[i] = io_in_empty();
+      continue;
+    }
+    res[i] = io_in_ext_init(compare, compare_arg, &m.opts);
+    if (reducer)
+      io_in_ext_reducer(res[i], reducer, reducer_arg);
+    if (!ok) {
+      /* the runs can't be split, so the first range merges all of them */
+      for (size_t j = 0; j < num_files; j++) {
+        io_in_t *in = io_in_init(filenames[j], &m.opts);
+        if (in)
+          io_in_ext_add(res[i], in, j);
+      }
+      continue;
+    }
+    for (size_t j = 0; j < m.num_runs; j++) {
+      uint64_t first = m.bounds ? m.bounds[(j * (n + 1)) + i] : 0;
+      uint64_t end = m.bounds ? m.bounds[(j * (n + 1)) + i + 1]
+                              : m.runs[j].num_records;
+      if (end <= first)
+        continue;
+      io_in_t *in = range_run_open(m.runs + j, first, &m.opts);
+      io_in_limit(in, end - first);
+      io_in_ext_add(res[i], in, m.runs[j].tag);
+    }
+  }
+
+  for (size_t i = 0; i < m.num_runs; i++) {
+    io_lz4_index_destroy(m.runs[i].index);
+    if (m.runs[i].points)
+      aml_free(m.runs[i].points);
+  }
+  if (m.bounds)
+    aml_free(m.bounds);
+  if (m.splitters)
+    aml_free(m.splitters);
+  aml_free(m.runs);
+  return res;
+}
+
 static inline char *end_of_block(io_in_t *h, int32_t *rlen, char *p, char *ep,
                                  bool required) {
-  if (required)
+  /* nothing left after the last delimiter is not a record */
+  if (required || p == ep)
     return NULL;
   else {
     h->zerop = ep;
@@ -923,6 +1901,13 @@ static inline void cleanup_last_read(io_in_t *h) {
   }
 }
 
+static inline char *find_delimiter(char *p, char *ep, int delim, bool csv,
+                                   bool *in_quote) {
+  if (csv)
+    return io_find_csv_delimiter(p, ep, delim, in_quote);
+  return io_find_delimiter(p, ep, delim);
+}
+
 char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
                                bool required) {
   bool csv = false;
@@ -943,21 +1928,15 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
   bool in_quote = false;
 
   // 2. search for delimiter between pos/used
-  while (p < ep) {
-    if (csv && *p == '\"') {
-      in_quote = !in_quote;
-      p++;
-    } else if (!in_quote && *p == delim) {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    } else {
-      p++;
-    }
+  if ((p = find_delimiter(p, ep, delim, csv, &in_quote)) != NULL) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    h->zerop = p;
+    h->zero = *p;
+    *p = 0;
+    return sp;
   }
+  p = ep;
 
   // 3. if finished
   if (b->eof) {
@@ -973,21 +1952,15 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
     fill_blocks(h, b);
     char *ep_new = sp + b->used;
 
-    while (p < ep_new) {
-      if (csv && *p == '\"') {
-        in_quote = !in_quote;
-        p++;
-      } else if (!in_quote && *p == delim) {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      } else {
-        p++;
-      }
+    if ((p = find_delimiter(p, ep_new, delim, csv, &in_quote)) != NULL) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      h->zerop = p;
+      h->zero = *p;
+      *p = 0;
+      return sp;
     }
+    p = ep_new;
     if (b->eof) {
       b->pos = b->used;
       return end_of_block(h, rlen, sp, p, required);
@@ -1005,20 +1978,14 @@ char *io_in_lz4_read_delimited(io_in_t *h, int32_t *rlen, int delim,
     sp = p;
     ep = p + b->used;
 
-    while (p < ep) {
-      if (csv && *p == '\"') {
-        in_quote = !in_quote;
-        p++;
-      } else if (!in_quote && *p == delim) {
-        size_t length = (p - sp);
-        b->pos += length + 1;
-        aml_buffer_append(h->bh, b->buffer, length);
-        *rlen = aml_buffer_length(h->bh);
-        return aml_buffer_data(h->bh);
-      } else {
-        p++;
-      }
+    if ((p = find_delimiter(p, ep, delim, csv, &in_quote)) != NULL) {
+      size_t length = (p - sp);
+      b->pos += length + 1;
+      aml_buffer_append(h->bh, b->buffer, length);
+      *rlen = aml_buffer_length(h->bh);
+      return aml_buffer_data(h->bh);
     }
+    p = ep;
     if (b->eof) {
       b->pos = b->used;
       if (required) {
@@ -1163,6 +2130,7 @@ void io_in_options_init(io_in_options_t *h) {
   h->compressed_buffer_size = 0;
 
   h->full_record_required = true;
+  h->loser_tree_threshold = 8;
   h->format = 0;
   h->abort_on_error = false;
   h->abort_on_partial_record = false;
@@ -1170,6 +2138,7 @@ void io_in_options_init(io_in_options_t *h) {
   h->abort_on_file_empty = false;
   h->tag = 0;
   h->gz = false;
+  h->zstd = false;
   h->lz4 = false;
 }
 
@@ -1206,11 +2175,25 @@ void io_in_options_tag(io_in_options_t *h, int tag) { h->tag = tag; }
 
 void io_in_options_gz(io_in_options_t *h, size_t buffer_size) { (void)buffer_size; h->gz = true; }
 
+void io_in_options_zstd(io_in_options_t *h) { h->zstd = true; }
+
 void io_in_options_lz4(io_in_options_t *h, size_t buffer_size) {
   h->lz4 = true;
   h->compressed_buffer_size = buffer_size;
 }
 
+void io_in_options_mmap(io_in_options_t *h) { h->mmap = true; }
+
+void io_in_options_read_ahead(io_in_options_t *h) { h->read_ahead = true; }
+
+void io_in_options_lz4_threads(io_in_options_t *h, size_t num_threads) {
+  h->lz4_threads = num_threads;
+}
+
+void io_in_options_loser_tree(io_in_options_t *h, size_t min_streams) {
+  h->loser_tree_threshold = min_streams;
+}
+
 void io_in_options_compressed_buffer_size(io_in_options_t *h,
                                           size_t buffer_size) {
   h->compressed_buffer_size = buffer_size;
@@ -1235,12 +2218,22 @@ void io_in_options_reducer(io_in_options_t *h, io_compare_cb compare,
 struct in_heap_s;
 typedef struct in_heap_s in_heap_t;
 
+/* The key prefix is cached next to each stream so that most compares are a
+   single integer compare (it is zero for all streams if there isn't a
+   key_prefix callback). */
+typedef struct {
+  uint64_t prefix;
+  io_in_t *in;
+} in_heap_slot_t;
+
 struct in_heap_s {
   ssize_t size;
   ssize_t max_size;
-  io_in_t **heap;
+  in_heap_slot_t *heap;
   io_compare_cb compare;
   void *compare_arg;
+  io_key_prefix_cb key_prefix;
+  void *key_prefix_arg;
 };
 
 static inline void in_heap_init(in_heap_t *h, ssize_t mx,
@@ -1249,9 +2242,11 @@ static inline void in_heap_init(in_heap_t *h, ssize_t mx,
   if (mx < 2)
     mx = 2;
   h->max_size = mx;
-  h->heap = (io_in_t **)aml_malloc((mx + 1) * sizeof(io_in_t *));
+  h->heap = (in_heap_slot_t *)aml_malloc((mx + 1) * sizeof(in_heap_slot_t));
   h->compare = compare;
   h->compare_arg = arg;
+  h->key_prefix = NULL;
+  h->key_prefix_arg = NULL;
 }
 
 // static inline void in_heap_clear(in_heap_t *h) { h->size = 0; }
@@ -1269,18 +2264,27 @@ static inline void in_heap_destroy(in_heap_t *h) {
 
 static inline size_t in_heap_size(in_heap_t *h) { return h->size; }
 
-static inline int in_heap_compare(in_heap_t *h, io_in_t *a, io_in_t *b) {
-  return h->compare(a->current, b->current, h->compare_arg);
+static inline uint64_t in_heap_prefix(in_heap_t *h, io_record_t *r) {
+  return h->key_prefix ? h->key_prefix(r, h->key_prefix_arg) : 0;
+}
+
+static inline int in_heap_compare(in_heap_t *h, in_heap_slot_t *a,
+                                  in_heap_slot_t *b) {
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  return h->compare(a->in->current, b->in->current, h->compare_arg);
 }
 
 static inline int in_heap_compare2(in_heap_t *h, io_record_t *a,
-                                   io_in_t *b) {
-  return h->compare(a, b->current, h->compare_arg);
+                                   uint64_t prefix, in_heap_slot_t *b) {
+  if (prefix != b->prefix)
+    return prefix < b->prefix ? -1 : 1;
+  return h->compare(a, b->in->current, h->compare_arg);
 }
 
 void test_heap(in_heap_t *h) {
   for (ssize_t i = 1; i <= h->size; i++) {
-    if (h->heap[i] == NULL)
+    if (h->heap[i].in == NULL)
       abort();
   }
 }
@@ -1288,23 +2292,22 @@ void test_heap(in_heap_t *h) {
 static inline void in_heap_push(in_heap_t *h, io_in_t *item) {
   if (h->size >= h->max_size) {
     h->max_size = h->size * 2;
-    io_in_t **heap =
-        (io_in_t **)aml_malloc((h->max_size + 1) * sizeof(io_in_t *));
-    memcpy(heap, h->heap, ((h->size + 1) * sizeof(io_in_t *)));
+    in_heap_slot_t *heap = (in_heap_slot_t *)aml_malloc(
+        (h->max_size + 1) * sizeof(in_heap_slot_t));
+    memcpy(heap, h->heap, ((h->size + 1) * sizeof(in_heap_slot_t)));
     aml_free(h->heap);
     h->heap = heap;
   }
   h->size++;
   ssize_t num = h->size;
-  io_in_t **heap = h->heap;
-  // io_in_t *tmp = heap[num];
-  heap[num] = item;
-  // heap[0] = tmp;
+  in_heap_slot_t *heap = h->heap;
+  heap[num].in = item;
+  heap[num].prefix = in_heap_prefix(h, item->current);
   ssize_t i = num;
   ssize_t j = i >> 1;
-  io_in_t *tmp;
+  in_heap_slot_t tmp;
 
-  while (j > 0 && in_heap_compare(h, heap[i], heap[j]) < 0) {
+  while (j > 0 && in_heap_compare(h, heap + i, heap + j) < 0) {
     tmp = heap[i];
     heap[i] = heap[j];
     heap[j] = tmp;
@@ -1313,34 +2316,188 @@ static inline void in_heap_push(in_heap_t *h, io_in_t *item) {
   }
 }
 
-static inline io_in_t *in_heap_pop(in_heap_t *h) {
+static inline io_in_t *in_heap_pop(in_heap_t *h, uint64_t *prefix) {
   h->size--;
   ssize_t num = h->size;
-  io_in_t **heap = h->heap;
-  io_in_t *r = heap[1];
+  in_heap_slot_t *heap = h->heap;
+  io_in_t *r = heap[1].in;
+  if (prefix)
+    *prefix = heap[1].prefix;
   heap[1] = heap[num + 1];
 
   ssize_t i = 1;
   ssize_t j = i << 1;
   ssize_t k = j + 1;
 
-  if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
+  if (k <= num && in_heap_compare(h, heap + k, heap + j) < 0)
     j = k;
 
-  while (j <= num && in_heap_compare(h, heap[j], heap[i]) < 0) {
-    io_in_t *tmp = heap[i];
+  while (j <= num && in_heap_compare(h, heap + j, heap + i) < 0) {
+    in_heap_slot_t tmp = heap[i];
     heap[i] = heap[j];
     heap[j] = tmp;
 
     i = j;
     j = i << 1;
     k = j + 1;
-    if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
+    if (k <= num && in_heap_compare(h, heap + k, heap + j) < 0)
       j = k;
   }
   return r;
 }
 
+/*
+  in_loser_t is a tournament (loser) tree over a fixed set of io_in_t
+  objects.  Each internal node holds the leaf which lost the match at that
+  node and tree[0] holds the overall winner.  Replacing the winner only
+  replays the matches from its leaf to the root, which is log2(k) compares
+  instead of the ~2*log2(k) of a heap pop and push.  Ties are broken by the
+  leaf number.
+
+  A NULL key means the leaf is exhausted (or temporarily removed while
+  collecting equal records) and always loses.
+*/
+typedef struct {
+  size_t k;
+  io_in_t **in;
+  io_record_t **key;
+  uint64_t *prefix;
+  size_t *tree;
+  size_t *pending;
+  size_t num_pending;
+  io_compare_cb compare;
+  void *compare_arg;
+  io_key_prefix_cb key_prefix;
+  void *key_prefix_arg;
+} in_loser_t;
+
+static inline bool in_loser_less(in_loser_t *h, size_t a, size_t b) {
+  io_record_t *ka = h->key[a];
+  io_record_t *kb = h->key[b];
+  if (!ka)
+    return false;
+  if (!kb)
+    return true;
+  if (h->prefix[a] != h->prefix[b])
+    return h->prefix[a] < h->prefix[b];
+  int n = h->compare(ka, kb, h->compare_arg);
+  if (n)
+    return n < 0;
+  return a < b;
+}
+
+static inline void in_loser_set_key(in_loser_t *h, size_t i, io_record_t *r) {
+  h->key[i] = r;
+  if (r && h->key_prefix)
+    h->prefix[i] = h->key_prefix(r, h->key_prefix_arg);
+}
+
+static in_loser_t *in_loser_init(in_heap_slot_t *slots, size_t k,
+                                 in_heap_t *heap) {
+  in_loser_t *h = (in_loser_t *)aml_zalloc(
+      sizeof(in_loser_t) + (k * (sizeof(io_in_t *) + sizeof(io_record_t *) +
+                                 sizeof(uint64_t) + (sizeof(size_t) * 4))));
+  h->k = k;
+  h->prefix = (uint64_t *)(h + 1);
+  h->in = (io_in_t **)(h->prefix + k);
+  h->key = (io_record_t **)(h->in + k);
+  h->tree = (size_t *)(h->key + k);
+  h->pending = h->tree + k;
+  h->num_pending = 0;
+  h->compare = heap->compare;
+  h->compare_arg = heap->compare_arg;
+  h->key_prefix = heap->key_prefix;
+  h->key_prefix_arg = heap->key_prefix_arg;
+  for (size_t i = 0; i < k; i++) {
+    h->in[i] = slots[i].in;
+    h->key[i] = io_in_current(slots[i].in);
+    h->prefix[i] = slots[i].prefix;
+  }
+
+  /* leaf i is node k+i and node n plays the winners of 2n and 2n+1 */
+  size_t *winner = h->pending + k;
+  for (size_t n = k; n < k * 2; n++)
+    winner[n] = n - k;
+  for (size_t n = k - 1; n > 0; n--) {
+    size_t a = winner[n * 2];
+    size_t b = winner[(n * 2) + 1];
+    if (in_loser_less(h, a, b)) {
+      winner[n] = a;
+      h->tree[n] = b;
+    } else {
+      winner[n] = b;
+      h->tree[n] = a;
+    }
+  }
+  h->tree[0] = k > 1 ? winner[1] : 0;
+  return h;
+}
+
+/* The key for leaf i increased (it was advanced or is exhausted).  Below the
+   node where i is stored as a loser (the root for the winner), i won every
+   match, so those nodes hold the winners of the other subtrees and the
+   matches can be replayed.  Whatever now wins i's subtree still loses at
+   that node. */
+static inline void in_loser_update(in_loser_t *h, size_t i) {
+  size_t *tree = h->tree;
+  size_t top = 0;
+  if (tree[0] != i) {
+    top = (h->k + i) >> 1;
+    while (tree[top] != i)
+      top >>= 1;
+  }
+  size_t w = i;
+  for (size_t n = (h->k + i) >> 1; n != top; n >>= 1) {
+    if (in_loser_less(h, tree[n], w)) {
+      size_t tmp = tree[n];
+      tree[n] = w;
+      w = tmp;
+    }
+  }
+  tree[top] = w;
+}
+
+/* advance every leaf returned by the last call and update the tree */
+static inline void in_loser_advance_pending(in_loser_t *h) {
+  for (size_t i = 0; i < h->num_pending; i++) {
+    size_t w = h->pending[i];
+    io_in_t *in = h->in[w];
+    if (io_in_advance(in))
+      in_loser_set_key(h, w, io_in_current(in));
+    else {
+      io_in_destroy(in);
+      h->in[w] = NULL;
+      h->key[w] = NULL;
+    }
+    in_loser_update(h, w);
+  }
+  h->num_pending = 0;
+}
+
+/* Every leaf equal to first is stored (as a loser) on the path of the winner
+   or on the path of another equal leaf below where that leaf is stored. */
+static void in_loser_collect_equal(in_loser_t *h, io_record_t *first,
+                                   uint64_t prefix, size_t leaf, size_t top,
+                                   io_record_t **rp) {
+  size_t *tree = h->tree;
+  for (size_t n = (h->k + leaf) >> 1; n != top; n >>= 1) {
+    size_t e = tree[n];
+    io_record_t *r = h->key[e];
+    if (r && h->prefix[e] == prefix && !h->compare(first, r, h->compare_arg)) {
+      h->pending[h->num_pending++] = e;
+      *(*rp)++ = *r;
+      in_loser_collect_equal(h, first, prefix, e, n, rp);
+    }
+  }
+}
+
+static void in_loser_destroy(in_loser_t *h) {
+  for (size_t i = 0; i < h->k; i++) {
+    if (h->in[i])
+      io_in_destroy(h->in[i]);
+  }
+  aml_free(h);
+}
 /*
   The io_in_ext_t structure needs to share the same members as io_in_s up
   through group_bh.
@@ -1371,6 +2528,8 @@ typedef struct {
   io_record_t *r;
 
   in_heap_t heap;
+  in_loser_t *loser;
+  uint64_t prefix;
 
   aml_buffer_t *reducer_bh;
   io_reducer_cb reducer;
@@ -1410,10 +2569,13 @@ void io_in_ext_destroy(io_in_t *hp) {
   if (h->active)
     aml_free(h->active);
 
+  if (h->loser)
+    in_loser_destroy(h->loser);
+
   in_heap_t *heap = &(h->heap);
 
   while (in_heap_size(heap))
-    io_in_destroy(in_heap_pop(heap));
+    io_in_destroy(in_heap_pop(heap, NULL));
 
   in_heap_destroy(heap);
 
@@ -1447,29 +2609,84 @@ static void move_active_to_heap(io_in_ext_t *h, bool advance) {
   h->num_active = 0;
 }
 
+/* Once there are enough streams, switch from the heap to a loser tree.  The
+   tree is built from whatever is in the heap at the first advance. */
+static void build_loser_tree(io_in_ext_t *h) {
+  move_active_to_heap(h, true);
+  in_heap_t *heap = &(h->heap);
+  if (!in_heap_size(heap))
+    return;
+  h->loser = in_loser_init(heap->heap + 1, in_heap_size(heap), heap);
+  heap->size = 0;
+}
+
+/* Put every stream back on the heap without advancing (see io_in_ext_add) */
+static void loser_tree_to_heap(io_in_ext_t *h) {
+  in_loser_t *t = h->loser;
+  for (size_t i = 0; i < t->k; i++) {
+    if (t->in[i])
+      in_heap_push(&(h->heap), t->in[i]);
+  }
+  aml_free(t);
+  h->loser = NULL;
+}
+
+static inline bool use_loser_tree(io_in_ext_t *h) {
+  if (h->loser)
+    return true;
+  size_t threshold = h->options.loser_tree_threshold;
+  if (threshold && in_heap_size(&(h->heap)) + h->num_active >= threshold) {
+    build_loser_tree(h);
+    return h->loser != NULL;
+  }
+  return false;
+}
+
+static io_record_t *empty_ext_record(io_in_ext_t *h, io_in_t *in) {
+  fprintf(stderr,
+          "[WARN] io_in_ext_advance got empty record from %s (length=%zu)\n",
+          io_in_base_filename(in->base),
+          h->current ? h->current->length : (size_t)-1);
+  h->current = NULL;
+  h->num_active = 0;
+  return NULL;
+}
+
+static io_record_t *io_in_ext_loser_advance(io_in_ext_t *h) {
+  in_loser_t *t = h->loser;
+  in_loser_advance_pending(t);
+  size_t w = t->tree[0];
+  if (t->key[w]) {
+    /* the winner is advanced on the next call */
+    t->pending[t->num_pending++] = w;
+    h->current = t->key[w];
+    if (!h->current->length)
+      return empty_ext_record(h, t->in[w]);
+    return h->current;
+  }
+  _io_in_empty((io_in_t *)h);
+  return NULL;
+}
+
 io_record_t *io_in_ext_advance(io_in_t *hp) {
   if (!hp)
     return NULL;
 
   io_in_ext_t *h = (io_in_ext_t *)hp;
+  if (use_loser_tree(h))
+    return io_in_ext_loser_advance(h);
+
   move_active_to_heap(h, true);
   in_heap_t *heap = &(h->heap);
   if (in_heap_size(heap)) {
-    io_in_t *in = in_heap_pop(heap);
+    io_in_t *in = in_heap_pop(heap, &h->prefix);
     h->active[0] = in;
     h->num_active = 1;
     h->current = io_in_current(in);
 
     /* Defensive guard: reject bogus EOF records */
-    if (!h->current || h->current->length == 0) {
-      fprintf(stderr,
-              "[WARN] io_in_ext_advance got empty record from %s (length=%zu)\n",
-              io_in_base_filename(in->base),
-              h->current ? h->current->length : (size_t)-1);
-      h->current = NULL;
-      h->num_active = 0;
-      return NULL;
-    }
+    if (!h->current || h->current->length == 0)
+      return empty_ext_record(h, in);
 
     return h->current;
   }
@@ -1477,26 +2694,40 @@ io_record_t *io_in_ext_advance(io_in_t *hp) {
   return NULL;
 }
 
+static io_record_t *io_in_ext_loser_advance_unique(io_in_ext_t *h,
+                                                   io_record_t *first,
+                                                   size_t *num_r) {
+  in_loser_t *t = h->loser;
+  io_record_t *rp = h->r;
+  *rp++ = *first;
+  size_t w = t->tree[0];
+  in_loser_collect_equal(t, first, t->prefix[w], w, 0, &rp);
+  h->num_current = rp - h->r;
+  h->current = h->r;
+  *num_r = h->num_current;
+  return h->current;
+}
+
 io_record_t *io_in_ext_advance_unique(io_in_t *hp, size_t *num_r) {
   io_record_t *first = io_in_ext_advance(hp);
   if (!first)
     return NULL;
 
   io_in_ext_t *h = (io_in_ext_t *)hp;
+  if (h->loser)
+    return io_in_ext_loser_advance_unique(h, first, num_r);
+
   in_heap_t *heap = &(h->heap);
   io_in_t **activep = h->active + 1;
   io_record_t *rp = h->r;
   *rp++ = *first;
-  io_in_t *in = NULL;
   while (in_heap_size(heap)) {
-    in = in_heap_pop(heap);
-    if (!in_heap_compare2(heap, first, in)) {
+    if (!in_heap_compare2(heap, first, h->prefix, heap->heap + 1)) {
+      io_in_t *in = in_heap_pop(heap, NULL);
       *activep++ = in;
       *rp++ = *io_in_current(in);
-    } else {
-      in_heap_push(heap, in);
+    } else
       break;
-    }
   }
   h->num_active = activep - h->active;
   h->num_current = h->num_active;
@@ -1536,6 +2767,8 @@ void io_in_ext_add(io_in_t *hp, io_in_t *in, int tag) {
   }
 
   in_heap_t *heap = &(h->heap);
+  if (h->loser)
+    loser_tree_to_heap(h);
   move_active_to_heap(h, false);
   in_heap_push(heap, in);
 
@@ -1558,6 +2791,28 @@ void io_in_ext_add(io_in_t *hp, io_in_t *in, int tag) {
   }
 }
 
+void io_in_ext_key_prefix(io_in_t *hp, io_key_prefix_cb key_prefix,
+                          void *arg) {
+  io_in_ext_t *h = (io_in_ext_t *)hp;
+  if (!h || h->type != IO_IN_EXT_TYPE)
+    return;
+
+  if (h->loser)
+    loser_tree_to_heap(h);
+
+  in_heap_t *heap = &(h->heap);
+  heap->key_prefix = key_prefix;
+  heap->key_prefix_arg = arg;
+
+  /* recompute the prefixes of anything already added */
+  ssize_t num = heap->size;
+  heap->size = 0;
+  for (ssize_t i = 1; i <= num; i++)
+    in_heap_push(heap, heap->heap[i].in);
+  if (h->num_active)
+    h->prefix = in_heap_prefix(heap, io_in_current(h->active[0]));
+}
+
 void io_in_ext_reducer(io_in_t *hp, io_reducer_cb reducer, void *arg) {
   io_in_ext_t *h = (io_in_ext_t *)hp;
   if (!h || h->type != IO_IN_EXT_TYPE)
@@ -1689,6 +2944,150 @@ io_in_t *io_in_records_init(io_record_t *records, size_t num_records,
   return (io_in_t *)h;
 }
 
+/* Batches are parsed directly out of whatever is already buffered.  When
+   the buffer doesn't hold a complete record, a single advance is used to
+   refill it (and to handle the end of the input). */
+static size_t parse_batch(io_in_t *h, char *p, char *ep, io_record_t *out,
+                          size_t max, char **endp) {
+  size_t n = 0;
+  int32_t tag = h->options.tag;
+  if (h->options.format == 0) {
+    while (n < max && ep - p >= 4) {
+      uint32_t length;
+      memcpy(&length, p, sizeof(length));
+      if ((size_t)(ep - p) - 4 < length)
+        break;
+      out[n].record = p + 4;
+      out[n].length = length;
+      out[n].tag = tag;
+      n++;
+      p += length + 4;
+    }
+  } else if (h->fixed) {
+    size_t fixed = h->fixed;
+    while (n < max && (size_t)(ep - p) >= fixed) {
+      out[n].record = p;
+      out[n].length = fixed;
+      out[n].tag = tag;
+      n++;
+      p += fixed;
+    }
+  } else {
+    int delim = h->delimiter;
+    bool csv = false;
+    if (delim >= 256) {
+      csv = true;
+      delim -= 256;
+    }
+    while (n < max) {
+      bool in_quote = false;
+      char *dp = find_delimiter(p, ep, delim, csv, &in_quote);
+      if (!dp)
+        break;
+      out[n].record = p;
+      out[n].length = dp - p;
+      out[n].tag = tag;
+      n++;
+      p = dp + 1;
+    }
+  }
+  *endp = p;
+  return n;
+}
+
+static size_t batch_base(io_in_t *h, io_record_t *out, size_t max) {
+  size_t len;
+  char *p = io_in_base_peek(h->base, &len);
+  char *ep;
+  size_t n = parse_batch(h, p, p + len, out, max, &ep);
+  io_in_base_skip(h->base, ep - p);
+  return n;
+}
+
+static size_t batch_lz4(io_in_t *h, io_record_t *out, size_t max) {
+  cleanup_last_read(h);
+  io_in_buffer_t *b = &(h->buf);
+  char *p = b->buffer + b->pos;
+  char *ep;
+  size_t n = parse_batch(h, p, b->buffer + b->used, out, max, &ep);
+  b->pos += ep - p;
+  return n;
+}
+
+static size_t batch_records(io_in_t *hp, io_record_t *out, size_t max) {
+  io_in_records_t *h = (io_in_records_t *)hp;
+  size_t n = h->ep - h->rp;
+  if (n > max)
+    n = max;
+  memcpy(out, h->rp, n * sizeof(io_record_t));
+  h->rp += n;
+  if (n) {
+    h->current = h->rp - 1;
+    h->num_current = 1;
+  }
+  return n;
+}
+
+static size_t batch_file_list(io_in_t *hp, io_record_t *out, size_t max) {
+  io_in_list_t *h = (io_in_list_t *)hp;
+  if (h->cur_in) {
+    size_t n = io_in_advance_batch(h->cur_in, out, max);
+    if (n) {
+      h->current = io_in_current(h->cur_in);
+      h->num_current = 1;
+      return n;
+    }
+  }
+  return 0;
+}
+
+size_t io_in_advance_batch(io_in_t *h, io_record_t *out, size_t max) {
+  if (!h || !max)
+    return 0;
+
+  io_in_advance_cb advance = h->advance;
+  bool limited = false;
+  if (advance == count_and_advance) {
+    if (h->record_num >= h->limit) {
+      _io_in_empty(h);
+      return 0;
+    }
+    if (max > h->limit - h->record_num)
+      max = h->limit - h->record_num;
+    advance = h->count_advance;
+    limited = true;
+  }
+
+  size_t n = 0;
+  if (advance == _advance_prefix || advance == _advance_fixed ||
+      advance == _advance_delimited)
+    n = batch_base(h, out, max);
+  else if (advance == _advance_prefix_lz4 || advance == _advance_fixed_lz4 ||
+           advance == _advance_delimited_lz4)
+    n = batch_lz4(h, out, max);
+  else if (advance == io_in_records_advance)
+    n = batch_records(h, out, max);
+  else if (advance == advance_file_list)
+    n = batch_file_list(h, out, max);
+
+  if (n) {
+    if (h->type == IO_IN_NORMAL_TYPE) {
+      h->rec = out[n - 1];
+      h->current = &(h->rec);
+      h->num_current = 1;
+    }
+  } else {
+    io_record_t *r = advance(h);
+    if (r) {
+      out[0] = *r;
+      n = 1;
+    }
+  }
+  if (limited)
+    h->record_num += n;
+  return n;
+}
+
 void io_in_destroy_out(io_in_t *in, io_out_t *out,
                        void (*destroy_out)(io_out_t *out)) {
   in->out = out;
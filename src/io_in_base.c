@@ -5,15 +5,59 @@
 // Maintainer: Andy Curtis <contactandyc@gmail.com>
 
 #include "the-io-library/io_in_base.h"
+#include "the-io-library/io.h"
 
 #include "a-memory-library/aml_buffer.h"
 #include "a-memory-library/aml_alloc.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
+#include <zstd.h>
+
+/* zstd state is shared with the read ahead thread (which decompresses once
+   it is started) and is allocated separately so that it survives
+   io_in_base_reinit. */
+typedef struct {
+  ZSTD_DCtx *dctx;
+  int fd;
+  char *in;
+  size_t pos;
+  size_t length;
+  size_t size;
+} io_in_zstd_t;
+
+/* Two chunks are filled by a helper thread while the consumer copies out of
+   the other one.  This is allocated separately from io_in_base_t so that it
+   survives io_in_base_reinit. */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  int fd;
+  gzFile gz;
+  io_in_zstd_t *zstd;
+  size_t chunk_size;
+
+  /* ranges are read with pread (see io_in_base_init_range) */
+  bool range;
+  off_t offset;
+  size_t remaining;
+
+  char *chunk[2];
+  size_t length[2];
+  bool ready[2];
+  bool last[2];
+  size_t pos;
+  int rd;
+  bool stop;
+} io_in_read_ahead_t;
 
 struct io_in_base_s {
   io_in_buffer_t buf;
@@ -24,6 +68,35 @@ struct io_in_base_s {
   aml_buffer_t *bh;
   char *zerop;
   char zero;
+
+  /* set when the file is memory mapped (see io_in_base_init_mmap) */
+  char *map;
+  size_t map_size;
+  size_t advise_size;
+  size_t advised;
+
+  /* set by io_in_base_init_range, the next offset to read and the bytes
+     left in the range */
+  bool range;
+  off_t offset;
+  size_t remaining;
+
+  /* set by io_in_base_init_gz_index, offset is the compressed position */
+  z_stream *zs;
+  unsigned char *zin;
+  size_t skip;
+  size_t trailer;
+  bool raw;
+
+  /* set by io_in_base_init_zstd */
+  io_in_zstd_t *zstd;
+
+  /* set by io_in_base_read_ahead */
+  io_in_read_ahead_t *ra;
+
+  /* the size of buf.buffer for plain files and ranges (buf.size is cut to
+     what was read at the end of the input), used by io_in_base_seek */
+  size_t buffer_size;
 };
 
 static inline void reset_block(io_in_buffer_t *b) {
@@ -32,13 +105,180 @@ static inline void reset_block(io_in_buffer_t *b) {
   b->pos = 0;
 }
 
+/* decompresses up to len bytes into dest, returning less only at the end of
+   the input (or an error) */
+static int read_zstd(io_in_zstd_t *z, char *dest, size_t len) {
+  ZSTD_outBuffer out = {dest, len, 0};
+  while (out.pos < out.size) {
+    if (z->pos == z->length) {
+      ssize_t n = read(z->fd, z->in, z->size);
+      if (n <= 0)
+        break;
+      z->pos = 0;
+      z->length = n;
+    }
+    ZSTD_inBuffer in = {z->in, z->length, z->pos};
+    size_t ret = ZSTD_decompressStream(z->dctx, &out, &in);
+    z->pos = in.pos;
+    if (ZSTD_isError(ret)) {
+      fprintf(stderr, "ERROR: zstd %s\n", ZSTD_getErrorName(ret));
+      break;
+    }
+  }
+  return out.pos;
+}
+
+static void *read_ahead_thread(void *arg) {
+  io_in_read_ahead_t *ra = (io_in_read_ahead_t *)arg;
+  int wr = 0;
+  while (true) {
+    pthread_mutex_lock(&ra->mutex);
+    while (ra->ready[wr] && !ra->stop)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    bool stop = ra->stop;
+    pthread_mutex_unlock(&ra->mutex);
+    if (stop)
+      break;
+
+    int n;
+    if (ra->zstd)
+      n = read_zstd(ra->zstd, ra->chunk[wr], ra->chunk_size);
+    else if (ra->range) {
+      size_t len = ra->chunk_size < ra->remaining ? ra->chunk_size
+                                                  : ra->remaining;
+      n = pread(ra->fd, ra->chunk[wr], len, ra->offset);
+      if (n > 0) {
+        ra->offset += n;
+        ra->remaining -= n;
+      }
+    } else if (ra->fd != -1)
+      n = read(ra->fd, ra->chunk[wr], ra->chunk_size);
+    else
+      n = gzread(ra->gz, ra->chunk[wr], ra->chunk_size);
+
+    bool last = n < (int)ra->chunk_size;
+    pthread_mutex_lock(&ra->mutex);
+    ra->length[wr] = n > 0 ? n : 0;
+    ra->last[wr] = last;
+    ra->ready[wr] = true;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    if (last)
+      break;
+    wr ^= 1;
+  }
+  return NULL;
+}
+
+/* copy from the prefetched chunks until b is full or the input is done */
+static void fill_blocks_from_read_ahead(io_in_read_ahead_t *ra,
+                                        io_in_buffer_t *b) {
+  while (b->used < b->size) {
+    int rd = ra->rd;
+    pthread_mutex_lock(&ra->mutex);
+    while (!ra->ready[rd])
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    pthread_mutex_unlock(&ra->mutex);
+
+    size_t n = ra->length[rd] - ra->pos;
+    if (n > b->size - b->used)
+      n = b->size - b->used;
+    memcpy(b->buffer + b->used, ra->chunk[rd] + ra->pos, n);
+    b->used += n;
+    ra->pos += n;
+    if (ra->pos < ra->length[rd])
+      return;
+
+    if (ra->last[rd]) {
+      b->eof = true;
+      b->size = b->used;
+      return;
+    }
+    ra->pos = 0;
+    ra->rd = rd ^ 1;
+    pthread_mutex_lock(&ra->mutex);
+    ra->ready[rd] = false;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+  }
+}
+
+#define IO_GZ_CHUNK (64 * 1024)
+
+/* inflates up to len bytes into dest after skipping h->skip bytes */
+static int read_gz_index(io_in_base_t *h, char *dest, size_t len) {
+  z_stream *zs = h->zs;
+  if (len > h->remaining)
+    len = h->remaining;
+  size_t total = 0;
+  while (total < len) {
+    if (!zs->avail_in) {
+      ssize_t n = pread(h->fd, h->zin, IO_GZ_CHUNK, h->offset);
+      if (n <= 0)
+        break;
+      h->offset += n;
+      zs->next_in = h->zin;
+      zs->avail_in = n;
+    }
+    if (h->trailer) {
+      /* the member ended while inflating raw deflate data, so skip the
+         gzip trailer and read the next member's header */
+      size_t n = h->trailer < zs->avail_in ? h->trailer : zs->avail_in;
+      zs->next_in += n;
+      zs->avail_in -= n;
+      h->trailer -= n;
+      if (!h->trailer)
+        inflateReset2(zs, 31);
+      continue;
+    }
+    /* skipped bytes are inflated into dest and then overwritten */
+    size_t avail = len - total;
+    if (h->skip && h->skip < avail)
+      avail = h->skip;
+    zs->next_out = (unsigned char *)dest + total;
+    zs->avail_out = avail;
+    int ret = inflate(zs, Z_NO_FLUSH);
+    size_t n = avail - zs->avail_out;
+    if (h->skip)
+      h->skip -= n;
+    else
+      total += n;
+    if (ret == Z_STREAM_END) {
+      if (h->raw) {
+        h->raw = false;
+        h->trailer = 8;
+      } else
+        inflateReset(zs);
+    } else if (ret != Z_OK)
+      break;
+  }
+  h->remaining -= total;
+  return total;
+}
+
 static void fill_blocks(io_in_base_t *h, io_in_buffer_t *b) {
   if (b->eof)
     return;
 
+  if (h->ra) {
+    fill_blocks_from_read_ahead(h->ra, b);
+    return;
+  }
+
   int bytes = b->size - b->used;
   int n;
-  if (h->fd != -1)
+  if (h->zs)
+    n = read_gz_index(h, b->buffer + b->used, bytes);
+  else if (h->zstd)
+    n = read_zstd(h->zstd, b->buffer + b->used, bytes);
+  else if (h->range) {
+    size_t len = (size_t)bytes < h->remaining ? (size_t)bytes : h->remaining;
+    n = pread(h->fd, b->buffer + b->used, len, h->offset);
+    if (n > 0) {
+      h->offset += n;
+      h->remaining -= n;
+    }
+  } else if (h->fd != -1)
     n = read(h->fd, b->buffer + b->used, bytes);
   else if (h->gz)
     n = gzread(h->gz, b->buffer + b->used, bytes);
@@ -53,6 +293,32 @@ static void fill_blocks(io_in_base_t *h, io_in_buffer_t *b) {
   }
 }
 
+/* The mapping is read-only, so records returned from a mapped file are not
+   zero terminated. */
+static inline void zero_terminate(io_in_base_t *h, char *p) {
+  if (h->map)
+    return;
+  h->zerop = p;
+  h->zero = *p;
+  *p = 0;
+}
+
+/* Ask the kernel to fault in the next window of the mapping once the reader
+   is halfway through the previously advised window. */
+static inline void advise_ahead(io_in_base_t *h) {
+  io_in_buffer_t *b = &(h->buf);
+  if (b->pos + (h->advise_size >> 1) < h->advised || h->advised >= b->used)
+    return;
+
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t sp = h->advised & ~(page - 1);
+  size_t ep = h->advised + h->advise_size;
+  if (ep > b->used)
+    ep = b->used;
+  madvise(h->map + sp, ep - sp, MADV_WILLNEED);
+  h->advised = ep;
+}
+
 static inline void cleanup_last_read(io_in_base_t *h) {
   if (h->bh) {
     aml_buffer_destroy(h->bh);
@@ -67,6 +333,28 @@ static inline void cleanup_last_read(io_in_base_t *h) {
 
 const char *io_in_base_filename(io_in_base_t *h) { return h->filename; }
 
+bool io_in_base_seek(io_in_base_t *h, size_t offset) {
+  if (!h->buffer_size || h->ra || h->fd == -1)
+    return false;
+  if (h->range) {
+    /* the end of the range doesn't move */
+    size_t end = h->offset + h->remaining;
+    if (offset > end)
+      return false;
+    h->remaining = end - offset;
+    h->offset = offset;
+  } else if (lseek(h->fd, offset, SEEK_SET) == (off_t)-1)
+    return false;
+
+  cleanup_last_read(h);
+  h->buf.size = h->buffer_size;
+  h->buf.used = 0;
+  h->buf.pos = 0;
+  h->buf.eof = false;
+  fill_blocks(h, &(h->buf));
+  return true;
+}
+
 io_in_base_t *io_in_base_reinit(io_in_base_t *base, size_t buffer_size) {
   if (base->fd == -1 && base->gz == NULL)
     return base;
@@ -77,6 +365,8 @@ io_in_base_t *io_in_base_reinit(io_in_base_t *base, size_t buffer_size) {
   memcpy(h, base, sizeof(*h));
   h->buf.buffer = (char *)(h + 1);
   h->buf.size = buffer_size;
+  if (h->buffer_size)
+    h->buffer_size = buffer_size;
   if (filename_length) {
     h->filename = h->buf.buffer + buffer_size + 1;
     strcpy(h->filename, base->filename);
@@ -120,6 +410,45 @@ io_in_base_t *io_in_base_init_gz(const char *filename, int fd, bool can_close,
   return h;
 }
 
+io_in_base_t *io_in_base_init_zstd(const char *filename, int fd,
+                                   bool can_close, size_t buffer_size) {
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (!dctx)
+    return NULL;
+  if (fd == -1)
+    fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+  }
+
+  if (buffer_size < 32000)
+    buffer_size = 32000;
+
+  size_t in_size = ZSTD_DStreamInSize();
+  io_in_zstd_t *z = (io_in_zstd_t *)aml_zalloc(sizeof(io_in_zstd_t) + in_size);
+  z->dctx = dctx;
+  z->fd = fd;
+  z->in = (char *)(z + 1);
+  z->size = in_size;
+
+  size_t filename_length = filename ? strlen(filename) + 1 : 0;
+  io_in_base_t *h = (io_in_base_t *)aml_malloc(
+      sizeof(io_in_base_t) + buffer_size + 1 + filename_length);
+  memset(h, 0, sizeof(*h));
+  h->buf.buffer = (char *)(h + 1);
+  h->buf.size = buffer_size;
+  if (filename_length) {
+    h->filename = h->buf.buffer + buffer_size + 1;
+    strcpy(h->filename, filename);
+  }
+  h->fd = fd;
+  h->can_close = can_close;
+  h->zstd = z;
+  fill_blocks(h, &(h->buf));
+  return h;
+}
+
 io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
                               size_t buffer_size) {
   if (fd == -1)
@@ -142,10 +471,192 @@ io_in_base_t *io_in_base_init(const char *filename, int fd, bool can_close,
   }
   h->fd = fd;
   h->can_close = can_close;
+  h->buffer_size = buffer_size;
+  fill_blocks(h, &(h->buf));
+  return h;
+}
+
+io_in_base_t *io_in_base_init_range(const char *filename, size_t offset,
+                                    size_t length, size_t buffer_size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  if (buffer_size < 256)
+    buffer_size = 256;
+
+  size_t filename_length = strlen(filename) + 1;
+  io_in_base_t *h = (io_in_base_t *)aml_malloc(
+      sizeof(io_in_base_t) + buffer_size + 1 + filename_length);
+  memset(h, 0, sizeof(*h));
+  h->buf.buffer = (char *)(h + 1);
+  h->buf.size = buffer_size;
+  h->filename = h->buf.buffer + buffer_size + 1;
+  strcpy(h->filename, filename);
+  h->fd = fd;
+  h->can_close = true;
+  h->range = true;
+  h->offset = offset;
+  h->remaining = length;
+  h->buffer_size = buffer_size;
+  fill_blocks(h, &(h->buf));
+  return h;
+}
+
+io_in_base_t *io_in_base_init_gz_index(const char *filename,
+                                       const io_gz_index_t *index,
+                                       size_t offset, size_t length,
+                                       size_t buffer_size) {
+  if (!index->num_points)
+    return NULL;
+
+  /* the last access point at or before offset */
+  size_t lo = 0, hi = index->num_points;
+  while (hi - lo > 1) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (index->points[mid].out <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  const io_gz_point_t *point = index->points + lo;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  z_stream *zs = (z_stream *)aml_zalloc(sizeof(z_stream) + IO_GZ_CHUNK);
+  if (inflateInit2(zs, -15) != Z_OK) {
+    aml_free(zs);
+    close(fd);
+    return NULL;
+  }
+  off_t pos = point->in;
+  if (point->bits) {
+    unsigned char c;
+    if (pread(fd, &c, 1, pos - 1) != 1) {
+      inflateEnd(zs);
+      aml_free(zs);
+      close(fd);
+      return NULL;
+    }
+    inflatePrime(zs, point->bits, c >> (8 - point->bits));
+  }
+  inflateSetDictionary(zs, point->window, sizeof(point->window));
+
+  if (buffer_size < 32000)
+    buffer_size = 32000;
+
+  size_t filename_length = strlen(filename) + 1;
+  io_in_base_t *h = (io_in_base_t *)aml_malloc(
+      sizeof(io_in_base_t) + buffer_size + 1 + filename_length);
+  memset(h, 0, sizeof(*h));
+  h->buf.buffer = (char *)(h + 1);
+  h->buf.size = buffer_size;
+  h->filename = h->buf.buffer + buffer_size + 1;
+  strcpy(h->filename, filename);
+  h->fd = fd;
+  h->can_close = true;
+  h->zs = zs;
+  h->zin = (unsigned char *)(zs + 1);
+  h->raw = true;
+  h->offset = pos;
+  h->skip = offset - point->out;
+  h->remaining = length;
   fill_blocks(h, &(h->buf));
   return h;
 }
 
+io_in_base_t *io_in_base_init_mmap(const char *filename, int fd, bool can_close,
+                                   size_t buffer_size) {
+  if (fd == -1)
+    fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  /* anything which can't be mapped (pipes, empty files, ...) is read
+     through the normal buffered path */
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    return io_in_base_init(filename, fd, can_close, buffer_size);
+
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset == (off_t)-1 || offset > st.st_size)
+    offset = 0;
+
+  char *map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == (char *)MAP_FAILED)
+    return io_in_base_init(filename, fd, can_close, buffer_size);
+
+  if (buffer_size < (1024 * 1024))
+    buffer_size = 1024 * 1024;
+
+  size_t filename_length = filename ? strlen(filename) + 1 : 0;
+  io_in_base_t *h =
+      (io_in_base_t *)aml_zalloc(sizeof(io_in_base_t) + filename_length);
+  if (filename_length) {
+    h->filename = (char *)(h + 1);
+    strcpy(h->filename, filename);
+  }
+  h->map = map;
+  h->map_size = st.st_size;
+  h->advise_size = buffer_size;
+  h->advised = offset;
+  h->buf.buffer = map;
+  h->buf.size = st.st_size;
+  h->buf.used = st.st_size;
+  h->buf.pos = offset;
+  h->buf.eof = true;
+  madvise(map, h->map_size, MADV_SEQUENTIAL);
+  advise_ahead(h);
+
+  /* the mapping remains valid after the descriptor is closed */
+  if (can_close)
+    close(fd);
+  h->fd = -1;
+  return h;
+}
+
+void io_in_base_read_ahead(io_in_base_t *h, size_t chunk_size) {
+  if (h->ra || h->buf.eof || h->zs || (h->fd == -1 && !h->gz))
+    return;
+
+  if (chunk_size < 64 * 1024)
+    chunk_size = 64 * 1024;
+
+  io_in_read_ahead_t *ra =
+      (io_in_read_ahead_t *)aml_zalloc(sizeof(*ra) + (chunk_size * 2));
+  ra->fd = h->fd;
+  ra->gz = h->gz;
+  ra->zstd = h->zstd;
+  ra->chunk_size = chunk_size;
+  ra->range = h->range;
+  ra->offset = h->offset;
+  ra->remaining = h->remaining;
+  ra->chunk[0] = (char *)(ra + 1);
+  ra->chunk[1] = ra->chunk[0] + chunk_size;
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra) != 0) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    aml_free(ra);
+    return;
+  }
+  h->ra = ra;
+}
+
+static void read_ahead_destroy(io_in_read_ahead_t *ra) {
+  pthread_mutex_lock(&ra->mutex);
+  ra->stop = true;
+  pthread_cond_signal(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+  pthread_join(ra->thread, NULL);
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mutex);
+  aml_free(ra);
+}
+
 io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free) {
   io_in_base_t *h = (io_in_base_t *)aml_zalloc(sizeof(io_in_base_t));
@@ -158,14 +669,20 @@ io_in_base_t *io_in_base_init_from_buffer(char *buffer, size_t buffer_size,
   return h;
 }
 
+static inline char *find_delimiter(char *p, char *ep, int delim, bool csv,
+                                   bool *in_quote) {
+  if (csv)
+    return io_find_csv_delimiter(p, ep, delim, in_quote);
+  return io_find_delimiter(p, ep, delim);
+}
+
 static inline char *end_of_block(io_in_base_t *h, int32_t *rlen, char *p,
                                  char *ep, bool required) {
-  if (required)
+  /* nothing left after the last delimiter is not a record */
+  if (required || p == ep)
     return NULL;
   else {
-    h->zerop = ep;
-    h->zero = *ep;
-    *ep = 0;
+    zero_terminate(h, ep);
     *rlen = (ep - p);
     return p;
   }
@@ -206,6 +723,8 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
 
   cleanup_last_read(h);
   *rlen = 0;
+  if (h->map)
+    advise_ahead(h);
 
   io_in_buffer_t *b = &(h->buf);
   char *p = b->buffer + b->pos;
@@ -216,22 +735,14 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
   bool in_quote = false;
 
   // 2. search for delimiter between pos/used
-  while (p < ep) {
-    if (csv && *p == '\"') {
-      in_quote = !in_quote; // Simple parity naturally handles escaped "" quotes
-      p++;
-    } else if (!in_quote && *p == delim) {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      if (b->pos > b->used) abort();
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    } else {
-      p++;
-    }
+  if ((p = find_delimiter(p, ep, delim, csv, &in_quote)) != NULL) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    if (b->pos > b->used) abort();
+    zero_terminate(h, p);
+    return sp;
   }
+  p = ep;
 
   // 3. if finished, there is no more data to read, return what is present
   if (b->eof) {
@@ -248,22 +759,14 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
     ep = sp + b->used; // Update ep after filling
 
     // Resume with persisted in_quote state
-    while (p < ep) {
-      if (csv && *p == '\"') {
-        in_quote = !in_quote;
-        p++;
-      } else if (!in_quote && *p == delim) {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        if (b->pos > b->used) abort();
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      } else {
-        p++;
-      }
+    if ((p = find_delimiter(p, ep, delim, csv, &in_quote)) != NULL) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      if (b->pos > b->used) abort();
+      zero_terminate(h, p);
+      return sp;
     }
+    p = ep;
     if (b->eof) {
       b->pos = b->used;
       return end_of_block(h, rlen, sp, p, required);
@@ -282,27 +785,21 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
     ep = p + b->used;
 
     // Resume with persisted in_quote state
-    while (p < ep) {
-      if (csv && *p == '\"') {
-        in_quote = !in_quote;
-        p++;
-      } else if (!in_quote && *p == delim) {
-        size_t length = (p - sp);
-        b->pos += length + 1;
-        if (b->pos > b->used) abort();
+    if ((p = find_delimiter(p, ep, delim, csv, &in_quote)) != NULL) {
+      size_t length = (p - sp);
+      b->pos += length + 1;
+      if (b->pos > b->used) abort();
 
-        aml_buffer_append(h->bh, b->buffer, length);
+      aml_buffer_append(h->bh, b->buffer, length);
 
-        /* FIX 2: Append a NUL byte so the returned string is valid in C */
-        aml_buffer_appendc(h->bh, 0);
+      /* FIX 2: Append a NUL byte so the returned string is valid in C */
+      aml_buffer_appendc(h->bh, 0);
 
-        /* Return length excluding the NUL byte */
-        *rlen = aml_buffer_length(h->bh) - 1;
-        return aml_buffer_data(h->bh);
-      } else {
-        p++;
-      }
+      /* Return length excluding the NUL byte */
+      *rlen = aml_buffer_length(h->bh) - 1;
+      return aml_buffer_data(h->bh);
     }
+    p = ep;
     if (b->eof) {
       b->pos = b->used;
       if (required) {
@@ -322,6 +819,8 @@ char *io_in_base_read_delimited(io_in_base_t *h, int32_t *rlen, int delim,
 
 char *io_in_base_readz(io_in_base_t *h, int32_t *rlen, int32_t len) {
   cleanup_last_read(h);
+  if (h->map)
+    advise_ahead(h);
 
   io_in_buffer_t *b = &(h->buf);
 
@@ -333,19 +832,13 @@ char *io_in_base_readz(io_in_base_t *h, int32_t *rlen, int32_t len) {
     if (b->pos > b->used)
       abort();
     *rlen = len;
-    char *ep = p + len;
-    h->zero = *ep;
-    h->zerop = ep;
-    *ep = 0;
+    zero_terminate(h, p + len);
     return p;
   } else if ((size_t)len > b->size) {
     if (b->eof) {
       *rlen = b->used - b->pos;
       b->pos = b->used;
-      char *ep = p + (*rlen);
-      h->zero = *ep;
-      h->zerop = ep;
-      *ep = 0;
+      zero_terminate(h, p + (*rlen));
       return p;
     }
 
@@ -373,10 +866,7 @@ char *io_in_base_readz(io_in_base_t *h, int32_t *rlen, int32_t len) {
     if (b->eof) {
       *rlen = b->used - b->pos;
       b->pos = b->used;
-      char *ep = p + (*rlen);
-      h->zero = *ep;
-      h->zerop = ep;
-      *ep = 0;
+      zero_terminate(h, p + (*rlen));
       return p;
     }
     reset_block(b);
@@ -387,10 +877,7 @@ char *io_in_base_readz(io_in_base_t *h, int32_t *rlen, int32_t len) {
     if (b->pos > b->used)
       abort();
     *rlen = len;
-    char *ep = b->buffer + len;
-    h->zero = *ep;
-    h->zerop = ep;
-    *ep = 0;
+    zero_terminate(h, b->buffer + len);
     return b->buffer;
   }
 }
@@ -403,6 +890,9 @@ char *io_in_base_read(io_in_base_t *h, int32_t len) {
     h->zerop = NULL;
   }
 
+  if (h->map)
+    advise_ahead(h);
+
   char *p = b->buffer + b->pos;
   if (b->pos + len <= b->used) {
     b->pos += len;
@@ -430,11 +920,39 @@ char *io_in_base_read(io_in_base_t *h, int32_t len) {
   }
 }
 
+char *io_in_base_peek(io_in_base_t *h, size_t *len) {
+  cleanup_last_read(h);
+  if (h->map)
+    advise_ahead(h);
+  io_in_buffer_t *b = &(h->buf);
+  *len = b->used - b->pos;
+  return b->buffer + b->pos;
+}
+
+void io_in_base_skip(io_in_base_t *h, size_t len) {
+  io_in_buffer_t *b = &(h->buf);
+  b->pos += len;
+  if (b->pos > b->used)
+    abort();
+}
+
 void io_in_base_destroy(io_in_base_t *h) {
+  if (h->ra)
+    read_ahead_destroy(h->ra);
   if (h->bh)
     aml_buffer_destroy(h->bh);
   if (h->buf.can_free)
     aml_free(h->buf.buffer);
+  if (h->map)
+    munmap(h->map, h->map_size);
+  if (h->zs) {
+    inflateEnd(h->zs);
+    aml_free(h->zs);
+  }
+  if (h->zstd) {
+    ZSTD_freeDCtx(h->zstd->dctx);
+    aml_free(h->zstd);
+  }
   if (h->fd != -1 && h->can_close)
     close(h->fd);
   // TODO: Support can_close properly for gz files
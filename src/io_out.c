@@ -12,17 +12,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
-
-/* options for fixed output -- TODO */
-void io_out_ext_options_fixed_compare(io_out_ext_options_t *h,
-                                      io_fixed_compare_cb compare, void *arg);
-void io_out_ext_options_fixed_sort(io_out_ext_options_t *h,
-                                   io_fixed_sort_cb sort, void *arg);
-void io_out_ext_options_fixed_reducer(io_out_ext_options_t *h,
-                                      io_fixed_reducer_cb reducer, void *arg);
+#include <zstd.h>
 
 typedef bool (*io_out_write_cb)(io_out_t *h, const void *d, size_t len);
 
@@ -52,8 +47,12 @@ struct io_out_s {
 
   io_out_write_cb write_d;
   gzFile gz;
+  struct io_out_gz_pool_s *gz_pool;
+  ZSTD_CCtx *zstd;
 
   lz4_t *lz4;
+  struct io_out_lz4_pool_s *pool;
+  struct io_out_lz4_index_s *index;
 
   unsigned char delimiter;
   uint32_t fixed;
@@ -107,7 +106,313 @@ static bool _write_to_fd(int *fd, const char *p, size_t len) {
   return true;
 }
 
+/*
+  The lz4 index has an entry per block.  Entries are added as blocks are
+  handed to the compressor and their offsets are filled in as the compressed
+  blocks are appended to buffer2 (which is always in order).  Record starts
+  are noted by io_out_write_record before each record is written, so the
+  first record of a block is known by the time the block is compressed.
+*/
+#define IO_LZ4_NO_RECORD 0xFFFFFFFFFFFFFFFFULL
+
+typedef struct io_out_lz4_index_s {
+  io_lz4_block_t *blocks;
+  size_t num_blocks;
+  size_t size;
+  size_t num_offsets;  /* blocks which have an offset */
+  size_t num_resolved; /* blocks which have a first record */
+  uint64_t compressed_pos;
+  uint64_t uncompressed_pos;
+  uint64_t num_records;
+  /* the first and last records starting in the unsubmitted data */
+  uint64_t next_record;
+  uint64_t next_offset;
+  uint64_t last_record;
+  uint64_t last_offset;
+} io_out_lz4_index_t;
+
+static io_out_lz4_index_t *lz4_index_init(uint32_t header_size) {
+  io_out_lz4_index_t *idx =
+      (io_out_lz4_index_t *)aml_zalloc(sizeof(io_out_lz4_index_t));
+  idx->compressed_pos = header_size;
+  idx->next_record = IO_LZ4_NO_RECORD;
+  return idx;
+}
+
+static void lz4_index_destroy(io_out_lz4_index_t *idx) {
+  if (idx->blocks)
+    aml_free(idx->blocks);
+  aml_free(idx);
+}
+
+static void lz4_index_record(io_out_lz4_index_t *idx, size_t buffer_pos) {
+  uint64_t offset = idx->uncompressed_pos + buffer_pos;
+  if (idx->next_record == IO_LZ4_NO_RECORD) {
+    idx->next_record = idx->num_records;
+    idx->next_offset = offset;
+  }
+  idx->last_record = idx->num_records;
+  idx->last_offset = offset;
+  idx->num_records++;
+}
+
+static void lz4_index_resolve(io_out_lz4_index_t *idx, uint64_t record,
+                              uint64_t offset) {
+  while (idx->num_resolved < idx->num_blocks) {
+    idx->blocks[idx->num_resolved].first_record = record;
+    idx->blocks[idx->num_resolved].first_record_offset = offset;
+    idx->num_resolved++;
+  }
+}
+
+static void lz4_index_block(io_out_lz4_index_t *idx, size_t len) {
+  if (idx->num_blocks == idx->size) {
+    idx->size = idx->size ? idx->size * 2 : 64;
+    idx->blocks = (io_lz4_block_t *)aml_realloc(
+        idx->blocks, idx->size * sizeof(io_lz4_block_t));
+  }
+  io_lz4_block_t *b = idx->blocks + idx->num_blocks;
+  b->offset = 0;
+  b->uncompressed_offset = idx->uncompressed_pos;
+  idx->num_blocks++;
+  idx->uncompressed_pos += len;
+
+  /* a full buffer can have a record starting just past it (and only one) */
+  if (idx->next_record != IO_LZ4_NO_RECORD &&
+      idx->next_offset < idx->uncompressed_pos) {
+    lz4_index_resolve(idx, idx->next_record, idx->next_offset);
+    idx->next_record = IO_LZ4_NO_RECORD;
+    if (idx->last_offset >= idx->uncompressed_pos) {
+      idx->next_record = idx->last_record;
+      idx->next_offset = idx->last_offset;
+    }
+  }
+}
+
+static void lz4_index_offset(io_out_lz4_index_t *idx, size_t len) {
+  idx->blocks[idx->num_offsets].offset = idx->compressed_pos;
+  idx->num_offsets++;
+  idx->compressed_pos += len;
+}
+
+static bool lz4_index_write(io_out_lz4_index_t *idx, const char *filename) {
+  lz4_index_resolve(idx, idx->num_records, idx->uncompressed_pos);
+  char *idx_filename = (char *)aml_malloc(strlen(filename) + 5);
+  strcpy(idx_filename, filename);
+  strcat(idx_filename, ".idx");
+  FILE *out = fopen(idx_filename, "wb");
+  aml_free(idx_filename);
+  if (!out)
+    return false;
+
+  uint64_t header[3] = {idx->num_blocks, idx->num_records,
+                        idx->uncompressed_pos};
+  bool written =
+      fwrite("IOLZ4IDX", 8, 1, out) == 1 &&
+      fwrite(header, sizeof(header), 1, out) == 1 &&
+      (!idx->num_blocks || fwrite(idx->blocks, sizeof(io_lz4_block_t),
+                                  idx->num_blocks,
+                                  out) == idx->num_blocks);
+  if (fclose(out))
+    written = false;
+  return written;
+}
+
+/*
+  Blocks are compressed by a pool of worker threads (each with its own lz4_t
+  since the lz4 state isn't shared) into a ring of slots.  The writing
+  thread fills slots in order and appends the compressed slots to buffer2 in
+  the same order, so the output is identical to compressing inline.
+*/
+typedef struct {
+  char *in;
+  uint32_t in_len;
+  char *out;
+  uint32_t out_len;
+  bool done;
+} io_out_lz4_slot_t;
+
+typedef struct io_out_lz4_pool_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t done_cond;
+
+  io_out_lz4_slot_t *slots;
+  size_t num_slots;
+
+  /* counters which increase forever (slot is counter % num_slots) */
+  size_t head; /* next slot to fill */
+  size_t next; /* next slot to compress */
+  size_t tail; /* next slot to append to the output */
+
+  bool stop;
+  size_t num_threads;
+  pthread_t *threads;
+  lz4_t **lz4;
+} io_out_lz4_pool_t;
+
+typedef struct {
+  io_out_lz4_pool_t *pool;
+  lz4_t *lz4;
+} io_out_lz4_worker_t;
+
+static void *lz4_pool_thread(void *arg) {
+  io_out_lz4_pool_t *pool = ((io_out_lz4_worker_t *)arg)->pool;
+  lz4_t *lz4 = ((io_out_lz4_worker_t *)arg)->lz4;
+  aml_free(arg);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->stop && pool->next == pool->head)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (pool->next == pool->head)
+      break;
+    io_out_lz4_slot_t *slot = pool->slots + (pool->next % pool->num_slots);
+    pool->next++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    slot->out_len =
+        lz4_compress_block(lz4, slot->in, slot->in_len, slot->out,
+                           lz4_compress_bound(slot->in_len) + 8);
+
+    pthread_mutex_lock(&pool->mutex);
+    slot->done = true;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static io_out_lz4_pool_t *lz4_pool_init(io_out_options_t *options,
+                                        uint32_t block_size) {
+  size_t num_threads = options->lz4_threads;
+  size_t num_slots = num_threads * 2;
+  size_t out_size = lz4_compress_bound(block_size) + 8;
+  io_out_lz4_pool_t *pool = (io_out_lz4_pool_t *)aml_zalloc(
+      sizeof(io_out_lz4_pool_t) +
+      (num_slots * (sizeof(io_out_lz4_slot_t) + block_size + out_size)) +
+      (num_threads * (sizeof(pthread_t) + sizeof(lz4_t *))));
+  pool->slots = (io_out_lz4_slot_t *)(pool + 1);
+  pool->num_slots = num_slots;
+  pool->threads = (pthread_t *)(pool->slots + num_slots);
+  pool->lz4 = (lz4_t **)(pool->threads + num_threads);
+  char *p = (char *)(pool->lz4 + num_threads);
+  for (size_t i = 0; i < num_slots; i++) {
+    pool->slots[i].in = p;
+    p += block_size;
+    pool->slots[i].out = p;
+    p += out_size;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    pool->lz4[i] = lz4_init(options->level, options->size,
+                            options->block_checksum, false);
+    io_out_lz4_worker_t *w =
+        (io_out_lz4_worker_t *)aml_malloc(sizeof(io_out_lz4_worker_t));
+    w->pool = pool;
+    w->lz4 = pool->lz4[i];
+    if (pthread_create(pool->threads + i, NULL, lz4_pool_thread, w) != 0) {
+      aml_free(w);
+      lz4_destroy(pool->lz4[i]);
+      break;
+    }
+    pool->num_threads++;
+  }
+  /* compress inline if no thread could be started */
+  if (!pool->num_threads) {
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    aml_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+static void lz4_pool_destroy(io_out_lz4_pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+    lz4_destroy(pool->lz4[i]);
+  }
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  aml_free(pool);
+}
+
+/* append compressed bytes to buffer2 leaving room for lz4_finish */
+static bool lz4_pool_append(io_out_t *h, const char *p, size_t len) {
+  if (h->buffer_pos2 + len + 8 > h->buffer_size2) {
+    if (!_write_to_fd(&(h->fd), h->buffer2, h->buffer_pos2))
+      return false;
+    h->buffer_pos2 = 0;
+  }
+  memcpy(h->buffer2 + h->buffer_pos2, p, len);
+  h->buffer_pos2 += len;
+  return true;
+}
+
+/* wait for the oldest slot to be compressed and append it */
+static bool lz4_pool_write_oldest(io_out_t *h) {
+  io_out_lz4_pool_t *pool = h->pool;
+  io_out_lz4_slot_t *slot = pool->slots + (pool->tail % pool->num_slots);
+  pthread_mutex_lock(&pool->mutex);
+  while (!slot->done)
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+  pool->tail++;
+  if (h->index)
+    lz4_index_offset(h->index, slot->out_len);
+  return lz4_pool_append(h, slot->out, slot->out_len);
+}
+
+/* queue a block for compression (len == 0 appends every queued block and
+   writes buffer2) */
+static bool lz4_pool_write(io_out_t *h, const char *p, size_t len) {
+  io_out_lz4_pool_t *pool = h->pool;
+  if (!len) {
+    while (pool->tail < pool->head) {
+      if (!lz4_pool_write_oldest(h))
+        return false;
+    }
+    if (!_write_to_fd(&(h->fd), h->buffer2, h->buffer_pos2))
+      return false;
+    h->buffer_pos2 = 0;
+    return true;
+  }
+
+  if (pool->head - pool->tail == pool->num_slots &&
+      !lz4_pool_write_oldest(h))
+    return false;
+
+  io_out_lz4_slot_t *slot = pool->slots + (pool->head % pool->num_slots);
+  memcpy(slot->in, p, len);
+  slot->in_len = len;
+  slot->done = false;
+  pthread_mutex_lock(&pool->mutex);
+  pool->head++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  return true;
+}
+
 static bool _write_to_lz4(io_out_t *h, const char *p, size_t len) {
+  if (len && h->index)
+    lz4_index_block(h->index, len);
+  if (h->pool) {
+    if (lz4_pool_write(h, p, len))
+      return true;
+    if (h->fd_owner)
+      close(h->fd);
+    h->fd = -1;
+    return false;
+  }
 start:;
   bool written = true;
   if (len) {
@@ -117,6 +422,8 @@ start:;
     written = false;
     if (mp <= ep) {
       uint32_t n = lz4_compress_block(h->lz4, p, len, wp, mp - wp);
+      if (h->index)
+        lz4_index_offset(h->index, n);
       wp += n;
       h->buffer_pos2 += n;
       if (wp < ep)
@@ -137,6 +444,22 @@ start:;
   return true;
 }
 
+/* each write of uncompressed output is a block of the record index, which
+   starts where the previous one ended */
+static bool _write_plain(io_out_t *h, const char *p, size_t len) {
+  if (!_write_to_fd(&(h->fd), p, len)) {
+    if (h->fd_owner)
+      close(h->fd);
+    h->fd = -1;
+    return false;
+  }
+  if (h->index && len) {
+    lz4_index_block(h->index, len);
+    lz4_index_offset(h->index, len);
+  }
+  return true;
+}
+
 static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
   if (h->buffer_pos + len < h->buffer_size) {
     if (len) {
@@ -146,12 +469,8 @@ static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
     if (len)
       return true;
     else {
-      if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
-        if (h->fd_owner)
-          close(h->fd);
-        h->fd = -1;
+      if (!_write_plain(h, h->buffer, h->buffer_pos))
         return false;
-      }
       h->buffer_pos = 0;
       return true;
     }
@@ -159,24 +478,15 @@ static bool _io_out_write(io_out_t *h, const void *d, size_t len) {
   size_t diff = h->buffer_size - h->buffer_pos;
   memcpy(h->buffer + h->buffer_pos, d, diff);
   h->buffer_pos += diff;
-  if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
-    if (h->fd_owner)
-      close(h->fd);
-    h->fd = -1;
+  if (!_write_plain(h, h->buffer, h->buffer_pos))
     return false;
-  }
   char *p = (char *)d;
   p += diff;
   len -= diff;
   h->buffer_pos = 0;
   if (len >= h->buffer_size) {
-    if (!_write_to_fd(&(h->fd), p, len)) {
-      if (h->fd_owner)
-        close(h->fd);
-      h->fd = -1;
-
+    if (!_write_plain(h, p, len))
       return false;
-    }
   } else {
     memcpy(h->buffer, p, len);
     h->buffer_pos = len;
@@ -196,6 +506,8 @@ static bool _io_out_write_lz4(io_out_t *h, const void *d, size_t len) {
       if (!_write_to_lz4(h, h->buffer, h->buffer_pos))
         return false;
       h->buffer_pos = 0;
+      if (h->pool && !_write_to_lz4(h, NULL, 0))
+        return false;
       char *wp = h->buffer2 + h->buffer_pos2;
       uint32_t n = lz4_finish(h->lz4, wp);
       h->buffer_pos2 += n;
@@ -333,20 +645,239 @@ static io_out_t *_io_out_init_lz4(const char *filename, int fd, bool fd_owner,
 
   memcpy(h->buffer2, header, header_size);
   h->buffer_pos2 = header_size;
+  /* the content checksum is computed over every block in order */
+  if (options->lz4_threads && !options->content_checksum)
+    h->pool = lz4_pool_init(options, block_size);
+  if (options->lz4_index && h->filename)
+    h->index = lz4_index_init(header_size);
   h->options = *options;
   h->write_d = _io_out_write_lz4;
   h->fd_owner = fd_owner;
   return h;
 }
 
+/*
+  With gz threads, the buffer is compressed by a pool of worker threads as
+  independent gzip members, one per buffer, which are written in order.
+  gzread (and gunzip) read concatenated members as a single stream.  The
+  slots work the same way as the lz4 pool.
+*/
+typedef struct {
+  char *in;
+  size_t in_len;
+  char *out;
+  size_t out_len;
+  bool done;
+} io_out_gz_slot_t;
+
+typedef struct io_out_gz_pool_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t done_cond;
+
+  io_out_gz_slot_t *slots;
+  size_t num_slots;
+  size_t out_size;
+  int level;
+
+  size_t head;
+  size_t next;
+  size_t tail;
+
+  bool stop;
+  size_t num_threads;
+  pthread_t *threads;
+} io_out_gz_pool_t;
+
+static void *gz_pool_thread(void *arg) {
+  io_out_gz_pool_t *pool = (io_out_gz_pool_t *)arg;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  /* 31 is a 32KB window with a gzip header and trailer */
+  bool ok = deflateInit2(&zs, pool->level, Z_DEFLATED, 31, 8,
+                         Z_DEFAULT_STRATEGY) == Z_OK;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->stop && pool->next == pool->head)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (pool->next == pool->head)
+      break;
+    io_out_gz_slot_t *slot = pool->slots + (pool->next % pool->num_slots);
+    pool->next++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    slot->out_len = 0;
+    if (ok) {
+      deflateReset(&zs);
+      zs.next_in = (unsigned char *)slot->in;
+      zs.avail_in = slot->in_len;
+      zs.next_out = (unsigned char *)slot->out;
+      zs.avail_out = pool->out_size;
+      if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+        slot->out_len = pool->out_size - zs.avail_out;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    slot->done = true;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (ok)
+    deflateEnd(&zs);
+  return NULL;
+}
+
+static io_out_gz_pool_t *gz_pool_init(io_out_options_t *options,
+                                      size_t block_size) {
+  size_t num_threads = options->gz_threads;
+  size_t num_slots = num_threads * 2;
+  /* the bound for deflate plus the gzip header and trailer */
+  size_t out_size = compressBound(block_size) + 64;
+  io_out_gz_pool_t *pool = (io_out_gz_pool_t *)aml_zalloc(
+      sizeof(io_out_gz_pool_t) +
+      (num_slots * (sizeof(io_out_gz_slot_t) + block_size + out_size)) +
+      (num_threads * sizeof(pthread_t)));
+  pool->slots = (io_out_gz_slot_t *)(pool + 1);
+  pool->num_slots = num_slots;
+  pool->out_size = out_size;
+  pool->level = options->level;
+  pool->threads = (pthread_t *)(pool->slots + num_slots);
+  char *p = (char *)(pool->threads + num_threads);
+  for (size_t i = 0; i < num_slots; i++) {
+    pool->slots[i].in = p;
+    p += block_size;
+    pool->slots[i].out = p;
+    p += out_size;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    if (pthread_create(pool->threads + i, NULL, gz_pool_thread, pool) != 0)
+      break;
+    pool->num_threads++;
+  }
+  /* compress with gzwrite if no thread could be started */
+  if (!pool->num_threads) {
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    aml_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+static void gz_pool_destroy(io_out_gz_pool_t *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 0; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  aml_free(pool);
+}
+
+/* wait for the oldest slot to be compressed and write it */
+static bool gz_pool_write_oldest(io_out_t *h) {
+  io_out_gz_pool_t *pool = h->gz_pool;
+  io_out_gz_slot_t *slot = pool->slots + (pool->tail % pool->num_slots);
+  pthread_mutex_lock(&pool->mutex);
+  while (!slot->done)
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+  pool->tail++;
+  if (!slot->out_len)
+    return false;
+  return _write_to_fd(&(h->fd), slot->out, slot->out_len);
+}
+
+/* queue a block to become a gzip member (len == 0 writes every queued
+   member, an empty output still gets one member) */
+static bool gz_pool_write(io_out_t *h, const char *p, size_t len) {
+  io_out_gz_pool_t *pool = h->gz_pool;
+  if (len || !pool->head) {
+    if (pool->head - pool->tail == pool->num_slots &&
+        !gz_pool_write_oldest(h))
+      return false;
+
+    io_out_gz_slot_t *slot = pool->slots + (pool->head % pool->num_slots);
+    if (len)
+      memcpy(slot->in, p, len);
+    slot->in_len = len;
+    slot->done = false;
+    pthread_mutex_lock(&pool->mutex);
+    pool->head++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    if (len)
+      return true;
+  }
+  while (pool->tail < pool->head) {
+    if (!gz_pool_write_oldest(h))
+      return false;
+  }
+  return true;
+}
+
+static bool _write_to_gz_pool(io_out_t *h, const char *p, size_t len) {
+  if (gz_pool_write(h, p, len))
+    return true;
+  if (h->fd_owner)
+    close(h->fd);
+  h->fd = -1;
+  return false;
+}
+
+static bool _io_out_write_gz_pool(io_out_t *h, const void *d, size_t len) {
+  if (h->buffer_pos + len <= h->buffer_size) {
+    if (len)
+      memcpy(h->buffer + h->buffer_pos, d, len);
+    h->buffer_pos += len;
+    if (len)
+      return true;
+    if (h->buffer_pos && !_write_to_gz_pool(h, h->buffer, h->buffer_pos))
+      return false;
+    h->buffer_pos = 0;
+    return _write_to_gz_pool(h, NULL, 0);
+  }
+  size_t diff = h->buffer_size - h->buffer_pos;
+  memcpy(h->buffer + h->buffer_pos, d, diff);
+  h->buffer_pos += diff;
+  if (!_write_to_gz_pool(h, h->buffer, h->buffer_pos))
+    return false;
+  char *p = (char *)d;
+  p += diff;
+  len -= diff;
+  h->buffer_pos = 0;
+  while (len >= h->buffer_size) {
+    if (!_write_to_gz_pool(h, p, h->buffer_size))
+      return false;
+    len -= h->buffer_size;
+    p += h->buffer_size;
+  }
+  if (len) {
+    memcpy(h->buffer, p, len);
+    h->buffer_pos = len;
+  }
+  return true;
+}
+
 static io_out_t *_io_out_init_gz(const char *filename, int fd, bool fd_owner,
                                  io_out_options_t *options) {
-  (void)fd_owner;
   size_t buffer_size = options->buffer_size;
   bool append_mode = options->append_mode;
 
   if (buffer_size < (64 * 1024))
     buffer_size = 64 * 1024;
+  /* each buffer is a gzip member, so keep them large enough to compress
+     well */
+  if (options->gz_threads && buffer_size < (1024 * 1024))
+    buffer_size = 1024 * 1024;
 
   int filename_length = filename ? strlen(filename) + 1 : 0;
 
@@ -377,6 +908,24 @@ static io_out_t *_io_out_init_gz(const char *filename, int fd, bool fd_owner,
     strcat(tmp, "-safe.gz");
   }
 
+  if (options->gz_threads)
+    h->gz_pool = gz_pool_init(options, buffer_size);
+  if (h->gz_pool) {
+    if (fd != -1)
+      h->fd = fd;
+    else
+      h->fd = open(tmp, O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC),
+                   0777);
+    if (h->fd == -1) {
+      gz_pool_destroy(h->gz_pool);
+      aml_free(h);
+      return NULL;
+    }
+    h->fd_owner = fd_owner;
+    h->write_d = _io_out_write_gz_pool;
+    return h;
+  }
+
   char mode[3];
   mode[0] = append_mode ? 'a' : 'w';
   mode[1] = options->level + '0';
@@ -390,20 +939,87 @@ static io_out_t *_io_out_init_gz(const char *filename, int fd, bool fd_owner,
   return h;
 }
 
-static io_out_t *_io_out_init(const char *filename, int fd, bool fd_owner,
-                              io_out_options_t *options) {
+/*
+  zstd output is staged in buffer and compressed into buffer2 with
+  ZSTD_compressStream2 (which also buffers internally).  With zstd threads,
+  libzstd compresses jobs on its own worker threads and the frame is the
+  same format as the single threaded one.  The frame is ended when the
+  output is flushed at destroy.
+*/
+static bool _write_to_zstd(io_out_t *h, const char *p, size_t len, bool end) {
+  ZSTD_inBuffer in = {p, len, 0};
+  ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+  while (true) {
+    ZSTD_outBuffer out = {h->buffer2, h->buffer_size2, 0};
+    size_t remaining = ZSTD_compressStream2(h->zstd, &out, &in, mode);
+    if (ZSTD_isError(remaining)) {
+      fprintf(stderr, "%s ERROR zstd %s\n", aml_file_line(),
+              ZSTD_getErrorName(remaining));
+      return false;
+    }
+    if (out.pos && !_write_to_fd(&h->fd, h->buffer2, out.pos))
+      return false;
+    if (end ? remaining == 0 : in.pos == in.size)
+      return true;
+  }
+}
+
+static bool _io_out_write_zstd(io_out_t *h, const void *d, size_t len) {
+  if (h->buffer_pos + len < h->buffer_size) {
+    memcpy(h->buffer + h->buffer_pos, d, len);
+    h->buffer_pos += len;
+    if (len)
+      return true;
+    else {
+      if (!_write_to_zstd(h, h->buffer, h->buffer_pos, true))
+        return false;
+      h->buffer_pos = 0;
+      return true;
+    }
+  }
+  size_t diff = h->buffer_size - h->buffer_pos;
+  memcpy(h->buffer + h->buffer_pos, d, diff);
+  h->buffer_pos += diff;
+  if (!_write_to_zstd(h, h->buffer, h->buffer_pos, false))
+    return false;
+  char *p = (char *)d;
+  p += diff;
+  len -= diff;
+  h->buffer_pos = 0;
+  while (len >= h->buffer_size) {
+    if (!_write_to_zstd(h, p, h->buffer_size, false))
+      return false;
+    len -= h->buffer_size;
+    p += h->buffer_size;
+  }
+  if (len) {
+    memcpy(h->buffer, p, len);
+    h->buffer_pos = len;
+  }
+  return true;
+}
+
+static io_out_t *_io_out_init_zstd(const char *filename, int fd, bool fd_owner,
+                                   io_out_options_t *options) {
   size_t buffer_size = options->buffer_size;
   bool append_mode = options->append_mode;
 
+  if (buffer_size < (64 * 1024))
+    buffer_size = 64 * 1024;
+  size_t out_size = ZSTD_CStreamOutSize();
+
   int filename_length = filename ? strlen(filename) + 1 : 0;
 
   int extra = options->safe_mode ? (filename_length * 2) + 20 : 0;
   extra += options->write_ack_file ? 5 : 0;
+
   io_out_t *h = (io_out_t *)aml_malloc(sizeof(io_out_t) + buffer_size +
-                                      filename_length + extra);
+                                      out_size + filename_length + extra);
   memset(h, 0, sizeof(*h));
   h->buffer = (char *)(h + 1);
-  h->filename = filename_length ? h->buffer + buffer_size : NULL;
+  h->buffer2 = h->buffer + buffer_size;
+
+  h->filename = filename_length ? h->buffer2 + out_size : NULL;
   if (h->filename) {
     strcpy(h->filename, filename);
     if (!io_make_path_valid(h->filename)) {
@@ -411,45 +1027,112 @@ static io_out_t *_io_out_init(const char *filename, int fd, bool fd_owner,
       return NULL;
     }
   }
-  h->options = *options;
   h->buffer_size = buffer_size;
+  h->buffer_size2 = out_size;
+  h->options = *options;
   char *tmp = h->filename;
   if (options->safe_mode) {
     tmp = tmp + strlen(h->filename) + 1;
     strcpy(tmp, h->filename);
-    strcat(tmp, "-safe");
+    tmp[strlen(tmp) - 4] = 0;
+    strcat(tmp, "-safe.zst");
   }
 
+  h->zstd = ZSTD_createCCtx();
+  if (!h->zstd) {
+    aml_free(h);
+    return NULL;
+  }
+  /* zstd frames can be concatenated, so append mode adds a frame */
   if (fd != -1)
     h->fd = fd;
-  else if (append_mode)
-    h->fd = open(tmp, O_WRONLY | O_CREAT | O_APPEND, 0777);
-  else {
-    h->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-    if (h->fd == -1) {
-      perror("Unable to open file\n");
-    }
+  else
+    h->fd = open(tmp, O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC),
+                 0777);
+  if (h->fd == -1) {
+    ZSTD_freeCCtx(h->zstd);
+    aml_free(h);
+    return NULL;
   }
-  h->write_d = _io_out_write;
+  ZSTD_CCtx_setParameter(h->zstd, ZSTD_c_compressionLevel, options->level);
+  ZSTD_CCtx_setParameter(h->zstd, ZSTD_c_checksumFlag, 1);
+  /* this fails if libzstd was built without threads and is then ignored */
+  if (options->zstd_threads)
+    ZSTD_CCtx_setParameter(h->zstd, ZSTD_c_nbWorkers,
+                           (int)options->zstd_threads);
+  h->write_d = _io_out_write_zstd;
   h->fd_owner = fd_owner;
   return h;
 }
 
-void io_out_options_init(io_out_options_t *h) {
-  memset(h, 0, sizeof(*h));
+static io_out_t *_io_out_init(const char *filename, int fd, bool fd_owner,
+                              io_out_options_t *options) {
+  size_t buffer_size = options->buffer_size;
+  bool append_mode = options->append_mode;
 
-  h->buffer_size = 64 * 1024;
-  h->append_mode = false;
-  h->safe_mode = false;
-  h->write_ack_file = false;
-  h->level = 1;
-  h->size = s64kb;
+  int filename_length = filename ? strlen(filename) + 1 : 0;
+
+  int extra = options->safe_mode ? (filename_length * 2) + 20 : 0;
+  extra += options->write_ack_file ? 5 : 0;
+  io_out_t *h = (io_out_t *)aml_malloc(sizeof(io_out_t) + buffer_size +
+                                      filename_length + extra);
+  memset(h, 0, sizeof(*h));
+  h->buffer = (char *)(h + 1);
+  h->filename = filename_length ? h->buffer + buffer_size : NULL;
+  if (h->filename) {
+    strcpy(h->filename, filename);
+    if (!io_make_path_valid(h->filename)) {
+      aml_free(h);
+      return NULL;
+    }
+  }
+  h->options = *options;
+  h->buffer_size = buffer_size;
+  char *tmp = h->filename;
+  if (options->safe_mode) {
+    tmp = tmp + strlen(h->filename) + 1;
+    strcpy(tmp, h->filename);
+    strcat(tmp, "-safe");
+  }
+
+  if (fd != -1)
+    h->fd = fd;
+  else if (append_mode)
+    h->fd = open(tmp, O_WRONLY | O_CREAT | O_APPEND, 0777);
+  else {
+    h->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (h->fd == -1) {
+      perror("Unable to open file\n");
+    }
+  }
+  if (options->record_index && h->filename && !append_mode)
+    h->index = lz4_index_init(0);
+  h->write_d = _io_out_write;
+  h->fd_owner = fd_owner;
+  return h;
+}
+
+void io_out_options_init(io_out_options_t *h) {
+  memset(h, 0, sizeof(*h));
+
+  h->buffer_size = 64 * 1024;
+  h->append_mode = false;
+  h->safe_mode = false;
+  h->write_ack_file = false;
+  h->level = 1;
+  h->size = s64kb;
   h->block_checksum = false;
   h->content_checksum = false;
   h->abort_on_error = false;
   h->format = 0;
   h->lz4 = false;
+  h->lz4_threads = 0;
+  h->lz4_index = false;
+  h->record_index = false;
   h->gz = false;
+  h->gz_threads = 0;
+  h->zstd = false;
+  h->zstd_threads = 0;
 }
 
 void io_out_options_buffer_size(io_out_options_t *h, size_t buffer_size) {
@@ -477,6 +1160,13 @@ void io_out_options_gz(io_out_options_t *h, int level) {
   h->level = level;
 }
 
+void io_out_options_zstd(io_out_options_t *h, int level,
+                         size_t num_threads) {
+  h->zstd = true;
+  h->level = level;
+  h->zstd_threads = num_threads;
+}
+
 void io_out_options_lz4(io_out_options_t *h, int level,
                         lz4_block_size_t size, bool block_checksum,
                         bool content_checksum) {
@@ -487,6 +1177,20 @@ void io_out_options_lz4(io_out_options_t *h, int level,
   h->content_checksum = content_checksum;
 }
 
+void io_out_options_gz_threads(io_out_options_t *h, size_t num_threads) {
+  h->gz_threads = num_threads;
+}
+
+void io_out_options_lz4_threads(io_out_options_t *h, size_t num_threads) {
+  h->lz4_threads = num_threads;
+}
+
+void io_out_options_lz4_index(io_out_options_t *h) { h->lz4_index = true; }
+
+void io_out_options_record_index(io_out_options_t *h) {
+  h->record_index = true;
+}
+
 void io_out_ext_options_init(io_out_ext_options_t *h) {
   memset(h, 0, sizeof(*h));
   // h->lz4_tmp = false;
@@ -497,11 +1201,51 @@ void io_out_ext_options_sort_while_partitioning(io_out_ext_options_t *h) {
   h->sort_while_partitioning = true;
 }
 
+void io_out_ext_options_concurrent(io_out_ext_options_t *h) {
+  h->concurrent = true;
+}
+
+void io_out_ext_options_shared_partition_buffer(io_out_ext_options_t *h) {
+  h->shared_partition_buffer = true;
+}
+
 void io_out_ext_options_num_sort_threads(io_out_ext_options_t *h,
                                          size_t num_sort_threads) {
   h->num_sort_threads = num_sort_threads;
 }
 
+void io_out_ext_options_replacement_selection(io_out_ext_options_t *h) {
+  h->replacement_selection = true;
+}
+
+void io_out_ext_options_limit(io_out_ext_options_t *h, size_t limit) {
+  h->limit = limit;
+}
+
+void io_out_ext_options_merge_fan_in(io_out_ext_options_t *h, size_t fan_in) {
+  h->merge_fan_in = fan_in;
+}
+
+void io_out_ext_options_num_merge_threads(io_out_ext_options_t *h,
+                                          size_t num_threads) {
+  h->num_merge_threads = num_threads;
+}
+
+void io_out_ext_options_num_buffer_sort_threads(io_out_ext_options_t *h,
+                                                size_t num_threads) {
+  h->num_buffer_sort_threads = num_threads;
+}
+
+void io_out_ext_options_radix_key(io_out_ext_options_t *h, size_t offset,
+                                  size_t width) {
+  if (width != 0 && width != 4 && width != 8) {
+    fprintf(stderr, "ERROR: io_out_ext_options_radix_key width must be 4 or 8\n");
+    abort();
+  }
+  h->radix_key_offset = offset;
+  h->radix_key_width = width;
+}
+
 void io_out_ext_options_sort_before_partitioning(io_out_ext_options_t *h) {
   h->sort_before_partitioning = true;
 }
@@ -510,8 +1254,20 @@ void io_out_ext_options_use_extra_thread(io_out_ext_options_t *h) {
   h->use_extra_thread = true;
 }
 
+void io_out_ext_options_spill_threads(io_out_ext_options_t *h,
+                                      size_t num_buffers, size_t num_threads) {
+  h->num_spill_buffers = num_buffers;
+  h->num_spill_threads = num_threads;
+}
+
+void io_out_ext_options_zstd_tmp(io_out_ext_options_t *h, int level) {
+  h->zstd_tmp = true;
+  h->zstd_tmp_level = level;
+}
+
 void io_out_ext_options_dont_compress_tmp(io_out_ext_options_t *h) {
   h->lz4_tmp = false;
+  h->zstd_tmp = false;
 }
 
 /* options for creating a partitioned output */
@@ -559,6 +1315,12 @@ void io_out_ext_options_intermediate_reducer(io_out_ext_options_t *h,
   h->int_reducer_arg = arg;
 }
 
+void io_out_ext_options_combiner(io_out_ext_options_t *h, io_hash_cb hash,
+                                 void *arg) {
+  h->combine_hash = hash;
+  h->combine_hash_arg = arg;
+}
+
 /* options for fixed output */
 void io_out_ext_options_fixed_reducer(io_out_ext_options_t *h,
                                       io_fixed_reducer_cb reducer,
@@ -590,6 +1352,8 @@ bool _io_out_write_prefix(io_out_t *h, const void *d, size_t len) {
 bool io_out_write_prefix(io_out_t *h, const void *d, size_t len) {
   if (h->type)
     return false;
+  if (h->index)
+    lz4_index_record(h->index, h->buffer_pos);
   return _io_out_write_prefix(h, d, len);
 }
 
@@ -610,6 +1374,8 @@ bool io_out_write_delimiter(io_out_t *h, const void *d, size_t len,
                             char delim) {
   if (h->type)
     return false;
+  if (h->index)
+    lz4_index_record(h->index, h->buffer_pos);
   if (!io_out_write(h, d, len) || !io_out_write(h, &delim, sizeof(delim)))
     return false;
   return true;
@@ -637,6 +1403,8 @@ io_out_t *_io_out_init_(const char *filename, int fd, bool fd_owner,
     h = _io_out_init_lz4(filename, fd, fd_owner, options);
   else if ((!filename && options->gz) || io_extension(filename, "gz"))
     h = _io_out_init_gz(filename, fd, fd_owner, options);
+  else if ((!filename && options->zstd) || io_extension(filename, "zst"))
+    h = _io_out_init_zstd(filename, fd, fd_owner, options);
   else
     h = _io_out_init(filename, fd, fd_owner, options);
 
@@ -667,6 +1435,8 @@ io_out_t *io_out_init_with_fd(int fd, bool fd_owner,
 }
 
 bool io_out_write_record(io_out_t *h, const void *d, size_t len) {
+  if (h->type == IO_OUT_NORMAL_TYPE && h->index)
+    lz4_index_record(h->index, h->buffer_pos);
   return h->write_record(h, d, len);
 }
 
@@ -713,6 +1483,14 @@ void _io_out_destroy(io_out_t *h) {
     h->fd = -1;
   }
 
+  if (h->pool) {
+    lz4_pool_destroy(h->pool);
+    h->pool = NULL;
+  }
+  if (h->gz_pool) {
+    gz_pool_destroy(h->gz_pool);
+    h->gz_pool = NULL;
+  }
   if (h->lz4) {
     lz4_destroy(h->lz4);
     h->lz4 = NULL;
@@ -721,9 +1499,15 @@ void _io_out_destroy(io_out_t *h) {
     gzclose(h->gz);
     h->gz = NULL;
   }
+  if (h->zstd) {
+    ZSTD_freeCCtx(h->zstd);
+    h->zstd = NULL;
+  }
 }
 
 void remove_out(io_out_t *h) {
+  if (h->index)
+    lz4_index_destroy(h->index);
   if (h->options.safe_mode)
     remove(h->filename + strlen(h->filename) + 1);
   else
@@ -762,6 +1546,13 @@ void io_out_destroy(io_out_t *h) {
   if (h->options.safe_mode)
     rename(h->filename + strlen(h->filename) + 1, h->filename);
 
+  if (h->index) {
+    /* only index output which was completely written */
+    if (h->write_d)
+      lz4_index_write(h->index, h->filename);
+    lz4_index_destroy(h->index);
+  }
+
   if (h->options.write_ack_file) {
     strcat(h->filename, ".ack");
     FILE *out = fopen(h->filename, "wb");
@@ -781,6 +1572,9 @@ static void suffix_filename_with_id(char *dest, size_t dest_len, const char *fil
   if (io_extension(filename, "lz4"))
     snprintf(dest - 4, dest_len + 4, "%s%s_%lu.lz4", extra ? "_" : "",
             extra ? extra : "", id);
+  else if (io_extension(filename, "zst"))
+    snprintf(dest - 4, dest_len + 4, "%s%s_%lu.zst", extra ? "_" : "",
+            extra ? extra : "", id);
   else if (io_extension(filename, "gz")) {
     if (use_lz4)
       snprintf(dest - 3, dest_len + 3, "%s%s_%lu.lz4", extra ? "_" : "",
@@ -827,6 +1621,23 @@ typedef struct {
   size_t *taskp;
   size_t *taskep;
   pthread_mutex_t mutex;
+
+  /* set by io_out_partitioned_in, the cursor for each sorted partition */
+  io_in_t **ins;
+
+  /* concurrent mode (see io_out_ext_options_concurrent) */
+  pthread_key_t stage_key;
+  pthread_mutex_t stage_mutex;
+  struct io_out_stage_s *stages;
+  pthread_mutex_t *partition_mutexes;
+
+  /* shared partition buffer (see io_out_ext_options_shared_partition_buffer) */
+  char *arena;
+  struct io_out_block_s *free_blocks;
+  struct io_out_block_list_s *lists;
+
+  /* the partitions have been destroyed */
+  bool finished;
 } io_out_partitioned_t;
 
 bool write_partitioned_record(io_out_t *hp, const void *d, size_t len) {
@@ -845,6 +1656,346 @@ bool write_partitioned_record(io_out_t *hp, const void *d, size_t len) {
   return o->write_record(o, d, len);
 }
 
+/*
+  With a shared partition buffer, records are appended to the last block of
+  their partition's list as a 4 byte length followed by the record.  Blocks
+  come from a free list over one arena.  When it is empty, the partition with
+  the most bytes is written to its output in order and its blocks are freed.
+  The blocks already hold prefix formatted records, so a plain output gets
+  the chain with writev instead of a copy of each record into its own small
+  buffer.  Compressed and indexed outputs are given the records one at a time.
+*/
+#define IO_OUT_ARENA_BLOCK (64 * 1024)
+
+typedef struct io_out_block_s {
+  struct io_out_block_s *next;
+  size_t used;
+} io_out_block_t;
+
+typedef struct io_out_block_list_s {
+  io_out_block_t *head;
+  io_out_block_t *tail;
+  size_t bytes;
+} io_out_block_list_t;
+
+#define IO_OUT_BLOCK_DATA (IO_OUT_ARENA_BLOCK - sizeof(io_out_block_t))
+
+/* blocks per writev, well under IOV_MAX on the platforms which are built */
+#define IO_OUT_WRITEV_BLOCKS 64
+
+static bool write_partition_blocks(io_out_t *o, io_out_block_t *b) {
+  if (o->buffer_pos) {
+    if (!_write_plain(o, o->buffer, o->buffer_pos))
+      return false;
+    o->buffer_pos = 0;
+  }
+  struct iovec iov[IO_OUT_WRITEV_BLOCKS];
+  while (b) {
+    int n = 0;
+    for (; b && n < IO_OUT_WRITEV_BLOCKS; b = b->next) {
+      iov[n].iov_base = b + 1;
+      iov[n].iov_len = b->used;
+      n++;
+    }
+    struct iovec *v = iov;
+    while (n) {
+      ssize_t w = writev(o->fd, v, n);
+      if (w <= 0) {
+        if (w == -1 && errno == ENOSPC) {
+          time_t cur_time = time(NULL);
+          fprintf(stderr, "%s ERROR DISK FULL %s\n", aml_file_line(),
+                  ctime(&cur_time));
+        }
+        if (o->fd_owner)
+          close(o->fd);
+        o->fd = -1;
+        return false;
+      }
+      while (n && (size_t)w >= v->iov_len) {
+        w -= v->iov_len;
+        v++;
+        n--;
+      }
+      if (n) {
+        v->iov_base = (char *)v->iov_base + w;
+        v->iov_len -= w;
+      }
+    }
+  }
+  return true;
+}
+
+static bool flush_partition_blocks(io_out_partitioned_t *h, size_t partition) {
+  io_out_block_list_t *l = h->lists + partition;
+  io_out_t *o = h->partitions[partition];
+  bool written = true;
+  io_out_block_t *b = l->head;
+  if (b && o->type == IO_OUT_NORMAL_TYPE && o->write_d == _io_out_write &&
+      o->write_record == _io_out_write_prefix && !o->index && o->fd != -1) {
+    written = write_partition_blocks(o, b);
+    io_out_block_t *tail = l->tail;
+    tail->next = h->free_blocks;
+    h->free_blocks = b;
+    b = NULL;
+  }
+  while (b) {
+    char *p = (char *)(b + 1);
+    char *ep = p + b->used;
+    while (p < ep) {
+      uint32_t len;
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      if (!o->write_record(o, p, len))
+        written = false;
+      p += len;
+    }
+    io_out_block_t *next = b->next;
+    b->next = h->free_blocks;
+    h->free_blocks = b;
+    b = next;
+  }
+  l->head = l->tail = NULL;
+  l->bytes = 0;
+  return written;
+}
+
+static bool write_partitioned_record_arena(io_out_t *hp, const void *d,
+                                           size_t len) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+
+  io_record_t r;
+  r.length = len;
+  r.record = (char *)d;
+  r.tag = 0;
+
+  size_t partition = h->partition(&r, h->num_partitions, h->partition_arg);
+  if (partition >= h->num_partitions)
+    return false;
+
+  io_out_block_list_t *l = h->lists + partition;
+  size_t size = sizeof(uint32_t) + len;
+  if (size > IO_OUT_BLOCK_DATA) {
+    /* too large for a block, keep the order and write it directly */
+    io_out_t *o = h->partitions[partition];
+    bool written = flush_partition_blocks(h, partition);
+    return o->write_record(o, d, len) && written;
+  }
+
+  bool written = true;
+  io_out_block_t *b = l->tail;
+  if (!b || b->used + size > IO_OUT_BLOCK_DATA) {
+    if (!h->free_blocks) {
+      size_t largest = 0;
+      for (size_t i = 1; i < h->num_partitions; i++) {
+        if (h->lists[i].bytes > h->lists[largest].bytes)
+          largest = i;
+      }
+      written = flush_partition_blocks(h, largest);
+      b = l->tail;
+    }
+    if (!b || b->used + size > IO_OUT_BLOCK_DATA) {
+      b = h->free_blocks;
+      h->free_blocks = b->next;
+      b->next = NULL;
+      b->used = 0;
+      if (l->tail)
+        l->tail->next = b;
+      else
+        l->head = b;
+      l->tail = b;
+    }
+  }
+  uint32_t len32 = len;
+  char *p = (char *)(b + 1) + b->used;
+  memcpy(p, &len32, sizeof(len32));
+  if (len)
+    memcpy(p + sizeof(len32), d, len);
+  b->used += size;
+  l->bytes += size;
+  return written;
+}
+
+static void finish_arena_writes(io_out_partitioned_t *h) {
+  if (!h->arena)
+    return;
+  for (size_t i = 0; i < h->num_partitions; i++)
+    flush_partition_blocks(h, i);
+  aml_free(h->arena);
+  aml_free(h->lists);
+  h->arena = NULL;
+  h->lists = NULL;
+  h->free_blocks = NULL;
+}
+
+/*
+  In concurrent mode, each producer thread appends its records to its own
+  stage (found through a pthread key) as a partition, a length and the
+  record.  When the stage fills, the records are counting sorted by partition
+  and each run of records is written while holding that partition's lock.
+  The lock is taken once per partition per flush instead of once per record,
+  and a partition whose lock is held by another producer is skipped and
+  written after the others, so producers flushing at the same time don't
+  queue behind each other partition by partition.
+*/
+#define IO_OUT_STAGE_SIZE (1024 * 1024)
+
+typedef struct {
+  uint32_t partition;
+  uint32_t length;
+} io_out_staged_t;
+
+typedef struct io_out_stage_s {
+  struct io_out_stage_s *next;
+  char *buffer;
+  size_t used;
+  size_t num_records;
+  io_out_staged_t **order;
+  size_t order_size;
+  size_t *counts;
+  size_t *busy;
+  bool failed;
+} io_out_stage_t;
+
+/* the caller holds the partition's lock */
+static void write_to_partition(io_out_partitioned_t *h, io_out_stage_t *s,
+                               size_t partition, io_out_staged_t **rp,
+                               io_out_staged_t **ep) {
+  io_out_t *o = h->partitions[partition];
+  while (rp < ep) {
+    io_out_staged_t *r = *rp++;
+    if (!o->write_record(o, r + 1, r->length))
+      s->failed = true;
+  }
+}
+
+static void flush_stage(io_out_partitioned_t *h, io_out_stage_t *s) {
+  if (!s->num_records)
+    return;
+
+  if (s->num_records > s->order_size) {
+    s->order_size = s->num_records + (s->num_records / 2);
+    if (s->order)
+      aml_free(s->order);
+    s->order = (io_out_staged_t **)aml_malloc(sizeof(io_out_staged_t *) *
+                                              s->order_size);
+  }
+
+  size_t *counts = s->counts;
+  memset(counts, 0, sizeof(size_t) * (h->num_partitions + 1));
+  char *p = s->buffer;
+  char *ep = p + s->used;
+  while (p < ep) {
+    io_out_staged_t *r = (io_out_staged_t *)p;
+    counts[r->partition + 1]++;
+    p += sizeof(*r) + ((r->length + 7) & ~7);
+  }
+  for (size_t i = 1; i <= h->num_partitions; i++)
+    counts[i] += counts[i - 1];
+
+  p = s->buffer;
+  while (p < ep) {
+    io_out_staged_t *r = (io_out_staged_t *)p;
+    s->order[counts[r->partition]++] = r;
+    p += sizeof(*r) + ((r->length + 7) & ~7);
+  }
+
+  /* counts[i] is now the end of partition i */
+  size_t num_busy = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < h->num_partitions; i++) {
+    if (counts[i] > start) {
+      if (!pthread_mutex_trylock(h->partition_mutexes + i)) {
+        write_to_partition(h, s, i, s->order + start, s->order + counts[i]);
+        pthread_mutex_unlock(h->partition_mutexes + i);
+      } else
+        s->busy[num_busy++] = i;
+    }
+    start = counts[i];
+  }
+  for (size_t j = 0; j < num_busy; j++) {
+    size_t i = s->busy[j];
+    start = i ? counts[i - 1] : 0;
+    pthread_mutex_lock(h->partition_mutexes + i);
+    write_to_partition(h, s, i, s->order + start, s->order + counts[i]);
+    pthread_mutex_unlock(h->partition_mutexes + i);
+  }
+  s->used = 0;
+  s->num_records = 0;
+}
+
+static bool write_partitioned_record_concurrent(io_out_t *hp, const void *d,
+                                                size_t len) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+
+  io_record_t r;
+  r.length = len;
+  r.record = (char *)d;
+  r.tag = 0;
+
+  size_t partition = h->partition(&r, h->num_partitions, h->partition_arg);
+  if (partition >= h->num_partitions)
+    return false;
+
+  io_out_stage_t *s = (io_out_stage_t *)pthread_getspecific(h->stage_key);
+  if (!s) {
+    s = (io_out_stage_t *)aml_zalloc(
+        sizeof(io_out_stage_t) +
+        (sizeof(size_t) * ((h->num_partitions * 2) + 1)) + IO_OUT_STAGE_SIZE);
+    s->counts = (size_t *)(s + 1);
+    s->busy = s->counts + h->num_partitions + 1;
+    s->buffer = (char *)(s->busy + h->num_partitions);
+    pthread_mutex_lock(&h->stage_mutex);
+    s->next = h->stages;
+    h->stages = s;
+    pthread_mutex_unlock(&h->stage_mutex);
+    pthread_setspecific(h->stage_key, s);
+  }
+
+  size_t size = sizeof(io_out_staged_t) + ((len + 7) & ~7);
+  if (s->used + size > IO_OUT_STAGE_SIZE) {
+    flush_stage(h, s);
+    if (size > IO_OUT_STAGE_SIZE) {
+      /* too large to stage, so write it directly */
+      io_out_t *o = h->partitions[partition];
+      pthread_mutex_lock(h->partition_mutexes + partition);
+      bool written = o->write_record(o, d, len);
+      pthread_mutex_unlock(h->partition_mutexes + partition);
+      return written && !s->failed;
+    }
+  }
+  io_out_staged_t *sr = (io_out_staged_t *)(s->buffer + s->used);
+  sr->partition = partition;
+  sr->length = len;
+  if (len)
+    memcpy(sr + 1, d, len);
+  s->used += size;
+  s->num_records++;
+  return !s->failed;
+}
+
+/* flush and free the stages of every producer, all producers must be done */
+static void finish_concurrent_writes(io_out_partitioned_t *h) {
+  if (!h->partition_mutexes)
+    return;
+
+  io_out_stage_t *s = h->stages;
+  while (s) {
+    io_out_stage_t *next = s->next;
+    flush_stage(h, s);
+    if (s->order)
+      aml_free(s->order);
+    aml_free(s);
+    s = next;
+  }
+  h->stages = NULL;
+  pthread_key_delete(h->stage_key);
+  pthread_mutex_destroy(&h->stage_mutex);
+  for (size_t i = 0; i < h->num_partitions; i++)
+    pthread_mutex_destroy(h->partition_mutexes + i);
+  aml_free(h->partition_mutexes);
+  h->partition_mutexes = NULL;
+}
+
 io_out_t *io_out_partitioned_init(const char *filename,
                                   io_out_options_t *options,
                                   io_out_ext_options_t *ext_options) {
@@ -854,7 +2005,7 @@ io_out_t *io_out_partitioned_init(const char *filename,
     io_out_t *r = io_out_ext_init(filename, options, ext_options);
     ext_options->partition = partition;
     return r;
-  } else if (ext_options->num_partitions == 1) {
+  } else if (ext_options->num_partitions == 1 && !ext_options->concurrent) {
     if (!filename)
       abort();
     // give suffix to filename
@@ -889,6 +2040,23 @@ io_out_t *io_out_partitioned_init(const char *filename,
     h->part_options.buffer_size = options->buffer_size / h->num_partitions;
     h->ext_part_options.partition = NULL;
 
+    bool arena = h->ext_options.shared_partition_buffer &&
+                 !h->ext_options.sort_while_partitioning &&
+                 !h->ext_options.concurrent;
+    size_t num_blocks = 0;
+    if (arena) {
+      /* the partitions keep a small buffer and the rest is shared */
+      h->part_options.buffer_size =
+          options->buffer_size / (h->num_partitions * 2);
+      if (h->part_options.buffer_size > IO_OUT_ARENA_BLOCK)
+        h->part_options.buffer_size = IO_OUT_ARENA_BLOCK;
+      num_blocks = (options->buffer_size -
+                    (h->part_options.buffer_size * h->num_partitions)) /
+                   IO_OUT_ARENA_BLOCK;
+      if (num_blocks < 1)
+        num_blocks = 1;
+    }
+
     if (!h->ext_options.sort_while_partitioning && h->ext_options.compare) {
       io_out_options_format(&(h->part_options), io_prefix());
       h->part_options.write_ack_file = false;
@@ -910,12 +2078,38 @@ io_out_t *io_out_partitioned_init(const char *filename,
         h->partitions[i] = io_out_ext_init(tmp_name, &(h->part_options),
                                            &(h->ext_part_options));
       } else {
+        /* the unsorted partitions are removed once they are sorted, so they
+           don't need an index */
+        io_out_options_t unsorted_options = h->part_options;
+        unsorted_options.lz4_index = false;
+        unsorted_options.record_index = false;
         suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, "unsorted",
                                 h->ext_options.lz4_tmp);
-        h->partitions[i] = io_out_init(tmp_name, &(h->part_options));
+        h->partitions[i] = io_out_init(tmp_name, &unsorted_options);
       }
     }
     h->write_record = write_partitioned_record;
+    if (arena) {
+      h->arena = (char *)aml_malloc(num_blocks * IO_OUT_ARENA_BLOCK);
+      for (size_t i = num_blocks; i > 0; i--) {
+        io_out_block_t *b =
+            (io_out_block_t *)(h->arena + ((i - 1) * IO_OUT_ARENA_BLOCK));
+        b->next = h->free_blocks;
+        h->free_blocks = b;
+      }
+      h->lists = (io_out_block_list_t *)aml_zalloc(
+          sizeof(io_out_block_list_t) * h->num_partitions);
+      h->write_record = write_partitioned_record_arena;
+    }
+    if (h->ext_options.concurrent) {
+      pthread_key_create(&h->stage_key, NULL);
+      pthread_mutex_init(&h->stage_mutex, NULL);
+      h->partition_mutexes = (pthread_mutex_t *)aml_malloc(
+          sizeof(pthread_mutex_t) * h->num_partitions);
+      for (size_t i = 0; i < h->num_partitions; i++)
+        pthread_mutex_init(h->partition_mutexes + i, NULL);
+      h->write_record = write_partitioned_record_concurrent;
+    }
     aml_free(tmp_name);
     h->type = IO_OUT_PARTITIONED_TYPE;
     return (io_out_t *)h;
@@ -938,7 +2132,9 @@ void *sort_partitions(void *arg) {
 
     suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, "unsorted",
                             h->ext_options.lz4_tmp);
-    io_in_t *in = io_in_init(tmp_name, &(h->in_options));
+    /* io_in_init adjusts the lz4 buffer sizes in the options it is given */
+    io_in_options_t in_options = h->in_options;
+    io_in_t *in = io_in_init(tmp_name, &in_options);
     suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, NULL, false);
     io_out_t *out =
         io_out_ext_init(tmp_name, &(h->part_options), &(h->ext_part_options));
@@ -952,56 +2148,102 @@ void *sort_partitions(void *arg) {
   return NULL;
 }
 
+/* like sort_partitions, except that the sorted partition is handed off as a
+   cursor instead of being written (it stays in memory if it fits) */
+static void *sort_partitions_in(void *arg) {
+  io_out_partitioned_t *h = (io_out_partitioned_t *)arg;
+  char *filename = h->filename;
+  size_t tmp_name_len = strlen(filename) + 40;
+  char *tmp_name = (char *)aml_malloc(tmp_name_len);
+
+  while (true) {
+    pthread_mutex_lock(&h->mutex);
+    size_t *tp = h->taskp;
+    h->taskp++;
+    pthread_mutex_unlock(&h->mutex);
+    if (tp >= h->taskep)
+      break;
+
+    suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, "unsorted",
+                            h->ext_options.lz4_tmp);
+    /* io_in_init adjusts the lz4 buffer sizes in the options it is given */
+    io_in_options_t in_options = h->in_options;
+    io_in_t *in = io_in_init(tmp_name, &in_options);
+    suffix_filename_with_id(tmp_name, tmp_name_len, filename, *tp, NULL, false);
+    io_out_t *out =
+        io_out_ext_init(tmp_name, &(h->part_options), &(h->ext_part_options));
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL)
+      io_out_write_record(out, r->record, r->length);
+    io_in_destroy(in);
+    h->ins[*tp] = io_out_in(out);
+  }
+  aml_free(tmp_name);
+  return NULL;
+}
+
+/* sort the unsorted partitions with sort (sort_partitions or
+   sort_partitions_in) on num_sort_threads threads and remove them */
+static void sort_unsorted_partitions(io_out_partitioned_t *h,
+                                     void *(*sort)(void *)) {
+  /*  buffer_size memory, num_threads, input, output - prefer input
+     because OS will buffer output.
+    */
+  size_t num_threads = h->ext_options.num_sort_threads;
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > h->num_partitions)
+    num_threads = h->num_partitions;
+
+  size_t buffer_size = h->options.buffer_size / (num_threads * 2);
+
+  io_out_options_buffer_size(&(h->part_options), buffer_size);
+  io_out_options_format(&(h->part_options), h->options.format);
+  h->ext_part_options.use_extra_thread = false;
+  io_in_options_init(&(h->in_options));
+  io_in_options_buffer_size(&(h->in_options), buffer_size);
+  io_in_options_format(&(h->in_options), io_prefix());
+
+  h->tasks = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
+  h->taskp = h->tasks;
+  h->taskep = h->tasks + h->num_partitions;
+  for (size_t i = 0; i < h->num_partitions; i++)
+    h->tasks[i] = i;
+
+  pthread_mutex_init(&h->mutex, NULL);
+  pthread_t *threads =
+      (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_create(threads + i, NULL, sort, h);
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&h->mutex);
+  aml_free(h->tasks);
+  aml_free(threads);
+  char *filename = h->filename;
+  size_t tmp_name_len = strlen(h->filename) + 40;
+  char *tmp_name = (char *)aml_malloc(tmp_name_len);
+  for (size_t i = 0; i < h->num_partitions; i++) {
+    suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, "unsorted",
+                            h->ext_options.lz4_tmp);
+    remove(tmp_name);
+  }
+  aml_free(tmp_name);
+}
+
 void _io_out_partitioned_destroy(io_out_t *hp) {
   io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  /* io_out_in finishes the partitions before the cursor is destroyed */
+  if (h->finished)
+    return;
+  h->finished = true;
+  finish_concurrent_writes(h);
+  finish_arena_writes(h);
   for (size_t i = 0; i < h->num_partitions; i++) {
     io_out_destroy(h->partitions[i]);
   }
-  if (!h->ext_options.sort_while_partitioning && h->ext_options.compare) {
-    /*  buffer_size memory, num_threads, input, output - prefer input
-       because OS will buffer output.
-      */
-    size_t num_threads = h->ext_options.num_sort_threads;
-    if (num_threads < 1)
-      num_threads = 1;
-    if (num_threads > h->num_partitions)
-      num_threads = h->num_partitions;
-
-    size_t buffer_size = h->options.buffer_size / (num_threads * 2);
-
-    io_out_options_buffer_size(&(h->part_options), buffer_size);
-    io_out_options_format(&(h->part_options), h->options.format);
-    h->ext_part_options.use_extra_thread = false;
-    io_in_options_init(&(h->in_options));
-    io_in_options_buffer_size(&(h->in_options), buffer_size);
-    io_in_options_format(&(h->in_options), io_prefix());
-
-    h->tasks = (size_t *)aml_malloc(sizeof(size_t) * h->num_partitions);
-    h->taskp = h->tasks;
-    h->taskep = h->tasks + h->num_partitions;
-    for (size_t i = 0; i < h->num_partitions; i++)
-      h->tasks[i] = i;
-
-    pthread_mutex_init(&h->mutex, NULL);
-    pthread_t *threads =
-        (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
-    for (size_t i = 0; i < num_threads; i++)
-      pthread_create(threads + i, NULL, sort_partitions, h);
-    for (size_t i = 0; i < num_threads; i++)
-      pthread_join(threads[i], NULL);
-    pthread_mutex_destroy(&h->mutex);
-    aml_free(h->tasks);
-    aml_free(threads);
-    char *filename = h->filename;
-    size_t tmp_name_len = strlen(h->filename) + 40;
-    char *tmp_name = (char *)aml_malloc(tmp_name_len);
-    for (size_t i = 0; i < h->num_partitions; i++) {
-      suffix_filename_with_id(tmp_name, tmp_name_len, filename, i, "unsorted",
-                              h->ext_options.lz4_tmp);
-      remove(tmp_name);
-    }
-    aml_free(tmp_name);
-  }
+  if (!h->ext_options.sort_while_partitioning && h->ext_options.compare)
+    sort_unsorted_partitions(h, sort_partitions);
 }
 
 /* ============================================================
@@ -1084,26 +2326,94 @@ static io_in_t *io_out_partitioned_sequential_in(io_out_partitioned_t *h) {
   return in;
 }
 
-io_in_t *io_out_partitioned_in(io_out_t *hp) {
-  _io_out_partitioned_destroy(hp);
-  /*  TODO:
-      1. either a list of files or a compared set with heap */
-  // for now return NULL as this would be unusual case
-  aml_free(hp);
-  return NULL;
-}
-
-void io_out_partitioned_destroy(io_out_t *hp) {
-  _io_out_partitioned_destroy(hp);
-  aml_free(hp);
-}
+io_in_t **io_out_partitioned_in(io_out_t *hp) {
+  if (hp->type != IO_OUT_PARTITIONED_TYPE) {
+    /* zero or one partitions are written as a single output */
+    io_in_t **res = (io_in_t **)aml_malloc(sizeof(io_in_t *));
+    res[0] = io_out_in(hp);
+    if (!res[0])
+      res[0] = io_in_empty();
+    return res;
+  }
 
-typedef struct {
-  char *buffer;
-  char *bp;
-  char *ep;
-  size_t num_records;
-  size_t size;
+  io_out_partitioned_t *h = (io_out_partitioned_t *)hp;
+  finish_concurrent_writes(h);
+  finish_arena_writes(h);
+  io_in_t **res =
+      (io_in_t **)aml_zalloc(sizeof(io_in_t *) * h->num_partitions);
+  if (h->ext_options.sort_while_partitioning || !h->ext_options.compare) {
+    /* sorted partitions which fit in their buffer are returned from memory
+       and the others are merged from their tmp files */
+    for (size_t i = 0; i < h->num_partitions; i++)
+      res[i] = io_out_in(h->partitions[i]);
+  } else {
+    for (size_t i = 0; i < h->num_partitions; i++)
+      io_out_destroy(h->partitions[i]);
+    h->ins = res;
+    sort_unsorted_partitions(h, sort_partitions_in);
+  }
+  for (size_t i = 0; i < h->num_partitions; i++) {
+    if (!res[i])
+      res[i] = io_in_empty();
+  }
+  if (h->ext_options.compare) {
+    /* the sorted partitions were never written, so remove the empty files
+       which io_out_partitioned_init created */
+    size_t tmp_name_len = strlen(h->filename) + 40;
+    char *tmp_name = (char *)aml_malloc(tmp_name_len);
+    for (size_t i = 0; i < h->num_partitions; i++) {
+      suffix_filename_with_id(tmp_name, tmp_name_len, h->filename, i, NULL,
+                              false);
+      remove(tmp_name);
+    }
+    aml_free(tmp_name);
+  }
+  aml_free(hp);
+  return res;
+}
+
+/* merge the sorted partitions as n key ranges (see io_in_range_merge) */
+static io_in_t **io_out_partitioned_ranges(io_out_partitioned_t *h,
+                                           size_t n) {
+  _io_out_partitioned_destroy((io_out_t *)h);
+
+  io_in_options_t in_opts;
+  io_in_options_init(&in_opts);
+  io_in_options_buffer_size(&in_opts, h->options.buffer_size / 2);
+  io_in_options_format(&in_opts, h->options.format);
+
+  size_t tmp_len = strlen(h->filename) + 40;
+  char **filenames = (char **)aml_malloc(
+      (sizeof(char *) + tmp_len) * h->num_partitions);
+  char *tmp = (char *)(filenames + h->num_partitions);
+  for (size_t i = 0; i < h->num_partitions; i++) {
+    filenames[i] = tmp + (i * tmp_len);
+    suffix_filename_with_id(filenames[i], tmp_len, h->filename, i, NULL,
+                            false);
+  }
+  io_in_t **res = io_in_range_merge(
+      filenames, h->num_partitions, n, h->ext_part_options.compare,
+      h->ext_part_options.compare_arg, h->ext_part_options.reducer,
+      h->ext_part_options.reducer_arg, &in_opts);
+  aml_free(filenames);
+  return res;
+}
+
+void io_out_partitioned_destroy(io_out_t *hp) {
+  _io_out_partitioned_destroy(hp);
+  aml_free(hp);
+}
+
+typedef struct {
+  char *buffer;
+  char *bp;
+  char *ep;
+  size_t num_records;
+  size_t size;
+  /* the last record written when a limit cut the run written from this
+     buffer, picked up by the writer once the buffer is handed back */
+  aml_buffer_t *cut;
+  bool has_cut;
 } io_out_buffer_t;
 
 const int EXTRA_IN = 0;
@@ -1132,9 +2442,48 @@ typedef struct {
   io_out_buffer_t buf1, buf2;
   io_out_buffer_t *b, *b2;
 
+  /* record size when fixed records are sorted in place (0 otherwise) */
+  size_t fixed;
+
   size_t num_written;
   size_t num_group_written;
 
+  /* combiner, index + 1 of the record in each slot (0 is empty) */
+  struct io_out_slot_s *slots;
+  size_t slot_mask;
+  size_t max_combined;
+  aml_buffer_t *combine_bh;
+
+  /* spill pool, full buffers wait in queue (a ring of num_spill_buffers)
+     for the spill threads and come back through free_buffers */
+  io_out_buffer_t *spill_buffers;
+  size_t num_spill_buffers;
+  io_out_buffer_t **free_buffers;
+  size_t num_free;
+  struct io_out_spill_s *queue;
+  size_t queue_head;
+  size_t queue_len;
+  pthread_t *spill_threads;
+  size_t num_spill_threads;
+  pthread_mutex_t spill_mutex;
+  pthread_cond_t spill_cond;
+  bool spill_done;
+
+  /* limit, a copy of the last record kept once limit records are kept */
+  aml_buffer_t *limit_record;
+
+  /* replacement selection (see write_replacement_record), the open run, a
+     copy of the last record written to it, the tag of the records in the
+     heap which belong to the open run and the bytes of written records not
+     yet reclaimed */
+  io_out_t *run;
+  aml_buffer_t *last;
+  aml_buffer_t *group;
+  aml_buffer_t *reduce_bh;
+  int run_tag;
+  bool has_last;
+  size_t freed;
+
   bool thread_started;
   pthread_t thread;
   bool out_in_called;
@@ -1168,6 +2517,25 @@ static bool write_stp_record(io_out_t *hp, const void *d, size_t len);
 static io_in_t *io_out_sorted_then_partitioned_in(io_out_t *hp);
 
 bool write_sorted_record(io_out_t *hp, const void *d, size_t len);
+bool write_fixed_sorted_record(io_out_t *hp, const void *d, size_t len);
+static bool write_combined_record(io_out_t *hp, const void *d, size_t len);
+static bool write_replacement_record(io_out_t *hp, const void *d,
+                                     size_t len);
+bool write_one_record(io_out_sorted_t *h, const void *d, size_t len);
+
+static void *spill_thread(void *arg);
+
+typedef struct io_out_spill_s {
+  io_out_buffer_t *b;
+  size_t id;
+} io_out_spill_t;
+
+typedef struct io_out_slot_s {
+  uint32_t hash;
+  uint32_t index;
+} io_out_slot_t;
+
+#define IO_OUT_MIN_COMBINE_SLOTS 64
 
 static void _extra_add(io_out_t *hp, void *p, int type) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
@@ -1223,6 +2591,13 @@ static void group_tmp_filename(char *dest, const char *filename, uint32_t n,
   snprintf(dest, strlen(filename) + strlen(suffix) + 30, "%s_%u_gtmp%s", filename, n, suffix);
 }
 
+/* the extension selects how io_out compresses and io_in reads tmp files */
+static const char *tmp_suffix(io_out_ext_options_t *o) {
+  if (o->zstd_tmp)
+    return ".zst";
+  return o->lz4_tmp ? ".lz4" : "";
+}
+
 static inline void clear_buffer(io_out_buffer_t *b) {
   b->bp = b->buffer;
   b->ep = b->bp + b->size;
@@ -1235,14 +2610,369 @@ static inline void init_buffer(io_out_buffer_t *b, size_t buffer_size) {
   clear_buffer(b);
 }
 
+static inline int compare_fixed(io_out_sorted_t *h, char *a, char *b) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  if (o->fixed_compare)
+    return o->fixed_compare(a, b, o->fixed_compare_arg);
+  io_record_t ra = {a, (uint32_t)h->fixed, h->tag};
+  io_record_t rb = {b, (uint32_t)h->fixed, h->tag};
+  return o->int_compare(&ra, &rb, o->int_compare_arg);
+}
+
+static inline uint64_t radix_key(io_out_ext_options_t *o, const char *p) {
+  p += o->radix_key_offset;
+  if (o->radix_key_width == 4) {
+    uint32_t k;
+    memcpy(&k, p, sizeof(k));
+    return k;
+  }
+  uint64_t k;
+  memcpy(&k, p, sizeof(k));
+  return k;
+}
+
+/* merges of the sorted runs compare the radix key before calling compare */
+static uint64_t radix_key_prefix(const io_record_t *r, void *arg) {
+  return radix_key((io_out_ext_options_t *)arg, r->record);
+}
+
+static void radix_key_merge(io_out_sorted_t *h, io_in_t *in) {
+  if (h->ext_options.radix_key_width)
+    io_in_ext_key_prefix(in, radix_key_prefix, &(h->ext_options));
+}
+
+/* American flag (in place MSD) radix sort of the records by the radix key, a
+   byte per level starting with the most significant.  Each level counts the
+   records per byte and swaps them into their buckets, so the only scratch is
+   the counts on the stack.  Small buckets are insertion sorted by the key and
+   compare, and records which share the whole key are sorted with compare. */
+#define IO_OUT_RADIX_SMALL 16
+
+static inline size_t radix_byte(io_out_ext_options_t *o, const char *p,
+                                int d) {
+  return (radix_key(o, p) >> (d << 3)) & 0xFF;
+}
+
+static inline int compare_radix(io_out_ext_options_t *o, const io_record_t *a,
+                                const io_record_t *b) {
+  uint64_t ka = radix_key(o, a->record);
+  uint64_t kb = radix_key(o, b->record);
+  if (ka != kb)
+    return ka < kb ? -1 : 1;
+  return o->int_compare(a, b, o->int_compare_arg);
+}
+
+static void radix_sort_records_msd(io_out_ext_options_t *o, io_record_t *r,
+                                   size_t num_r, int d) {
+  if (num_r <= IO_OUT_RADIX_SMALL) {
+    for (size_t i = 1; i < num_r; i++) {
+      io_record_t t = r[i];
+      size_t j = i;
+      for (; j > 0 && compare_radix(o, &t, r + j - 1) < 0; j--)
+        r[j] = r[j - 1];
+      r[j] = t;
+    }
+    return;
+  }
+  size_t counts[256];
+  while (true) {
+    if (d < 0) {
+      io_sort_records(r, num_r, o->int_compare, o->int_compare_arg);
+      return;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < num_r; i++)
+      counts[radix_byte(o, r[i].record, d)]++;
+    if (counts[radix_byte(o, r[0].record, d)] != num_r)
+      break;
+    d--;
+  }
+
+  size_t next[256];
+  size_t offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    next[i] = offs;
+    offs += counts[i];
+  }
+  offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    size_t end = offs + counts[i];
+    while (next[i] < end) {
+      size_t k = radix_byte(o, r[next[i]].record, d);
+      if (k == i)
+        next[i]++;
+      else {
+        io_record_t t = r[next[i]];
+        r[next[i]] = r[next[k]];
+        r[next[k]++] = t;
+      }
+    }
+    offs = end;
+  }
+
+  offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    if (counts[i] > 1)
+      radix_sort_records_msd(o, r + offs, counts[i], d - 1);
+    offs += counts[i];
+  }
+}
+
+static void radix_sort_records(io_out_sorted_t *h, io_record_t *r,
+                               size_t num_r) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  radix_sort_records_msd(o, r, num_r, (int)o->radix_key_width - 1);
+}
+
+static inline void sort_records(io_out_sorted_t *h, io_record_t *r,
+                                size_t num_r) {
+  if (h->ext_options.radix_key_width && num_r)
+    radix_sort_records(h, r, num_r);
+  else
+    io_sort_records(r, num_r, h->ext_options.int_compare,
+                    h->ext_options.int_compare_arg);
+}
+
+/* The fixed records are radix sorted the same way, swapping the records
+   themselves, so no record index is needed.  Records which share the whole
+   key are heap sorted with compare_fixed. */
+static inline void swap_fixed(char *a, char *b, size_t fixed) {
+  char t[64];
+  while (fixed) {
+    size_t n = fixed < sizeof(t) ? fixed : sizeof(t);
+    memcpy(t, a, n);
+    memcpy(a, b, n);
+    memcpy(b, t, n);
+    a += n;
+    b += n;
+    fixed -= n;
+  }
+}
+
+static inline int compare_radix_fixed(io_out_sorted_t *h, char *a, char *b) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  uint64_t ka = radix_key(o, a);
+  uint64_t kb = radix_key(o, b);
+  if (ka != kb)
+    return ka < kb ? -1 : 1;
+  return compare_fixed(h, a, b);
+}
+
+static void sift_fixed(io_out_sorted_t *h, char *p, size_t i, size_t num_r) {
+  size_t fixed = h->fixed;
+  while (true) {
+    size_t c = (i << 1) + 1;
+    if (c >= num_r)
+      return;
+    if (c + 1 < num_r &&
+        compare_fixed(h, p + (c * fixed), p + ((c + 1) * fixed)) < 0)
+      c++;
+    if (compare_fixed(h, p + (i * fixed), p + (c * fixed)) >= 0)
+      return;
+    swap_fixed(p + (i * fixed), p + (c * fixed), fixed);
+    i = c;
+  }
+}
+
+static void heap_sort_fixed(io_out_sorted_t *h, char *p, size_t num_r) {
+  size_t fixed = h->fixed;
+  for (size_t i = num_r >> 1; i > 0; i--)
+    sift_fixed(h, p, i - 1, num_r);
+  for (size_t n = num_r - 1; n > 0; n--) {
+    swap_fixed(p, p + (n * fixed), fixed);
+    sift_fixed(h, p, 0, n);
+  }
+}
+
+static void radix_sort_fixed_msd(io_out_sorted_t *h, char *p, size_t num_r,
+                                 int d) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  size_t fixed = h->fixed;
+  if (num_r <= IO_OUT_RADIX_SMALL) {
+    for (size_t i = 1; i < num_r; i++) {
+      for (size_t j = i;
+           j > 0 && compare_radix_fixed(h, p + (j * fixed),
+                                        p + ((j - 1) * fixed)) < 0;
+           j--)
+        swap_fixed(p + (j * fixed), p + ((j - 1) * fixed), fixed);
+    }
+    return;
+  }
+  size_t counts[256];
+  while (true) {
+    if (d < 0) {
+      heap_sort_fixed(h, p, num_r);
+      return;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < num_r; i++)
+      counts[radix_byte(o, p + (i * fixed), d)]++;
+    if (counts[radix_byte(o, p, d)] != num_r)
+      break;
+    d--;
+  }
+
+  size_t next[256];
+  size_t offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    next[i] = offs;
+    offs += counts[i];
+  }
+  offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    size_t end = offs + counts[i];
+    while (next[i] < end) {
+      char *rp = p + (next[i] * fixed);
+      size_t k = radix_byte(o, rp, d);
+      if (k == i)
+        next[i]++;
+      else
+        swap_fixed(rp, p + (next[k]++ * fixed), fixed);
+    }
+    offs = end;
+  }
+
+  offs = 0;
+  for (size_t i = 0; i < 256; i++) {
+    if (counts[i] > 1)
+      radix_sort_fixed_msd(h, p + (offs * fixed), counts[i], d - 1);
+    offs += counts[i];
+  }
+}
+
+static void radix_sort_fixed(io_out_sorted_t *h, char *p, size_t num_r) {
+  radix_sort_fixed_msd(h, p, num_r, (int)h->ext_options.radix_key_width - 1);
+}
+
+/* Sort the fixed records in place and reduce equal records with the fixed
+   reducer.  Returns the number of records left in the buffer. */
+static size_t sort_fixed_buffer(io_out_sorted_t *h, io_out_buffer_t *b) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  size_t fixed = h->fixed;
+  size_t num_r = b->num_records;
+  if (o->radix_key_width)
+    radix_sort_fixed(h, b->buffer, num_r);
+  else
+    o->fixed_sort(b->buffer, num_r);
+  if (!o->fixed_reducer)
+    return num_r;
+
+  char *p = b->buffer;
+  char *ep = p + (num_r * fixed);
+  char *wp = p;
+  while (p < ep) {
+    char *np = p + fixed;
+    while (np < ep && !compare_fixed(h, p, np))
+      np += fixed;
+    if (o->fixed_reducer(p, (np - p) / fixed, o->fixed_reducer_arg)) {
+      if (wp != p)
+        memcpy(wp, p, fixed);
+      wp += fixed;
+    }
+    p = np;
+  }
+  return (wp - b->buffer) / fixed;
+}
+
+/* The merge of tmp files uses these when only the fixed compare and reducer
+   are supplied.  arg is the io_out_sorted_t's ext_options. */
+static int compare_fixed_records(const io_record_t *a, const io_record_t *b,
+                                 void *arg) {
+  io_out_ext_options_t *o = (io_out_ext_options_t *)arg;
+  return o->fixed_compare(a->record, b->record, o->fixed_compare_arg);
+}
+
+static bool reduce_fixed_records(io_record_t *res, const io_record_t *r,
+                                 size_t num_r, aml_buffer_t *bh, void *arg) {
+  io_out_ext_options_t *o = (io_out_ext_options_t *)arg;
+  aml_buffer_clear(bh);
+  for (size_t i = 0; i < num_r; i++)
+    aml_buffer_append(bh, r[i].record, r[i].length);
+  char *d = aml_buffer_data(bh);
+  if (!o->fixed_reducer(d, num_r, o->fixed_reducer_arg))
+    return false;
+  res->record = d;
+  res->length = r->length;
+  res->tag = r->tag;
+  return true;
+}
+
+/* smallest number of records worth handing to a sort thread */
+#define IO_OUT_MIN_SORT_CHUNK 65536
+
+typedef struct {
+  io_out_sorted_t *h;
+  io_record_t *r;
+  size_t num_r;
+} sort_chunk_t;
+
+static void *sort_chunk(void *arg) {
+  sort_chunk_t *c = (sort_chunk_t *)arg;
+  sort_records(c->h, c->r, c->num_r);
+  return NULL;
+}
+
+/* sort num_threads chunks of the buffer in parallel and merge them */
+static io_in_t *_in_from_buffer_parallel(io_out_sorted_t *h, io_record_t *r,
+                                         size_t num_r, size_t num_threads) {
+  sort_chunk_t *chunks =
+      (sort_chunk_t *)aml_malloc(sizeof(sort_chunk_t) * num_threads);
+  pthread_t *threads =
+      (pthread_t *)aml_malloc(sizeof(pthread_t) * num_threads);
+  size_t per = num_r / num_threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    chunks[i].r = r + (i * per);
+    chunks[i].num_r = (i + 1 == num_threads) ? num_r - (i * per) : per;
+    chunks[i].h = h;
+    if (i)
+      pthread_create(threads + i, NULL, sort_chunk, chunks + i);
+  }
+  sort_chunk(chunks);
+  for (size_t i = 1; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  io_in_t *in = io_in_ext_init(h->ext_options.int_compare,
+                               h->ext_options.int_compare_arg,
+                               &(h->file_options));
+  radix_key_merge(h, in);
+  if (h->ext_options.int_reducer)
+    io_in_ext_reducer(in, h->ext_options.int_reducer,
+                      h->ext_options.int_reducer_arg);
+  for (size_t i = 0; i < num_threads; i++)
+    io_in_ext_add(in,
+                  io_in_records_init(chunks[i].r, chunks[i].num_r,
+                                     &(h->file_options)),
+                  0);
+  aml_free(threads);
+  aml_free(chunks);
+  return in;
+}
+
 static io_in_t *_in_from_buffer(io_out_sorted_t *h, io_out_buffer_t *b) {
   if (!b->num_records)
     return NULL;
 
+  if (h->fixed) {
+    size_t num_r = sort_fixed_buffer(h, b);
+    clear_buffer(b);
+    if (!num_r)
+      return NULL;
+    io_in_options_t opts;
+    io_in_options_init(&opts);
+    io_in_options_format(&opts, io_fixed(h->fixed));
+    return io_in_init_with_buffer(b->buffer, num_r * h->fixed, false, &opts);
+  }
+
   io_record_t *r = (io_record_t *)b->buffer;
   uint32_t num_r = b->num_records;
-  io_sort_records(r, num_r, h->ext_options.int_compare,
-                     h->ext_options.int_compare_arg);
+  size_t num_threads = h->ext_options.num_buffer_sort_threads;
+  if (num_threads > num_r / IO_OUT_MIN_SORT_CHUNK)
+    num_threads = num_r / IO_OUT_MIN_SORT_CHUNK;
+  if (num_threads > 1) {
+    clear_buffer(b);
+    return _in_from_buffer_parallel(h, r, num_r, num_threads);
+  }
+  sort_records(h, r, num_r);
 
   clear_buffer(b);
   return io_in_records_init(r, num_r, &(h->file_options));
@@ -1250,7 +2980,7 @@ static io_in_t *_in_from_buffer(io_out_sorted_t *h, io_out_buffer_t *b) {
 
 io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
                              io_out_ext_options_t *ext_options) {
-  if (!ext_options->compare) {
+  if (!ext_options->compare && !ext_options->fixed_compare) {
       fprintf(stderr, "ERROR: io_out_sorted_init requires a compare function\n");
       abort();  // or return NULL
   }
@@ -1276,6 +3006,9 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
   } else if (io_extension(filename, "gz")) {
     h->suffix = (char *)".gz";
     h->filename[strlen(filename) - 3] = 0;
+  } else if (io_extension(filename, "zst")) {
+    h->suffix = (char *)".zst";
+    h->filename[strlen(filename) - 4] = 0;
   }
 
   h->thread_started = false;
@@ -1283,9 +3016,37 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
   h->ext_options = *ext_options;
   h->partition_options = *ext_options;
   h->partition_options.compare = NULL;
+  h->partition_options.fixed_compare = NULL;
   h->partition_options.sort_before_partitioning = false;
   h->options = *options;
 
+  /* Fixed records are sorted in place with fixed_sort (or the radix key)
+     unless only a variable length reducer is supplied. */
+  if (options->format > 0 &&
+      (ext_options->fixed_sort || ext_options->radix_key_width) &&
+      (ext_options->fixed_reducer || !ext_options->int_reducer))
+    h->fixed = options->format;
+  if (h->fixed || ext_options->limit)
+    h->ext_options.replacement_selection = false;
+
+  ext_options = &(h->ext_options);
+  if (!ext_options->compare) {
+    ext_options->compare = compare_fixed_records;
+    ext_options->compare_arg = ext_options;
+  }
+  if (!ext_options->int_compare) {
+    ext_options->int_compare = ext_options->compare;
+    ext_options->int_compare_arg = ext_options->compare_arg;
+  }
+  if (!ext_options->reducer && ext_options->fixed_reducer) {
+    ext_options->reducer = reduce_fixed_records;
+    ext_options->reducer_arg = ext_options;
+  }
+  if (!ext_options->int_reducer) {
+    ext_options->int_reducer = ext_options->reducer;
+    ext_options->int_reducer_arg = ext_options->reducer_arg;
+  }
+
   io_in_options_init(&(h->file_options));
   if (ext_options->int_reducer)
     io_in_options_reducer(&(h->file_options), ext_options->int_compare,
@@ -1293,7 +3054,55 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
                           ext_options->int_reducer,
                           ext_options->int_reducer_arg);
 
-  if (ext_options->use_extra_thread) {
+  /* a quarter of the buffer goes to the table (a power of 2 slots), the
+     combiner is skipped if that can't hold IO_OUT_MIN_COMBINE_SLOTS */
+  if (ext_options->combine_hash && ext_options->int_reducer && !h->fixed &&
+      !ext_options->replacement_selection &&
+      buffer_size / 4 >= IO_OUT_MIN_COMBINE_SLOTS * sizeof(io_out_slot_t)) {
+    size_t num_slots = IO_OUT_MIN_COMBINE_SLOTS;
+    while (num_slots * 2 * sizeof(io_out_slot_t) <= buffer_size / 4)
+      num_slots *= 2;
+    h->slots = (io_out_slot_t *)aml_zalloc(sizeof(io_out_slot_t) * num_slots);
+    h->slot_mask = num_slots - 1;
+    h->max_combined = (num_slots * 7) / 10;
+    h->combine_bh = aml_buffer_init(256);
+    buffer_size -= sizeof(io_out_slot_t) * num_slots;
+  }
+
+  size_t num_spill_threads = ext_options->num_spill_threads;
+  size_t num_spill_buffers = ext_options->num_spill_buffers;
+  if (num_spill_buffers < 2)
+    num_spill_buffers = 2;
+  if (num_spill_threads >= num_spill_buffers)
+    num_spill_threads = num_spill_buffers - 1;
+  if (ext_options->replacement_selection || ext_options->num_per_group)
+    num_spill_threads = 0;
+
+  if (num_spill_threads) {
+    buffer_size /= num_spill_buffers;
+    h->spill_buffers = (io_out_buffer_t *)aml_zalloc(
+        sizeof(io_out_buffer_t) * num_spill_buffers);
+    h->free_buffers = (io_out_buffer_t **)aml_malloc(
+        sizeof(io_out_buffer_t *) * num_spill_buffers);
+    h->queue = (io_out_spill_t *)aml_malloc(sizeof(io_out_spill_t) *
+                                            num_spill_buffers);
+    h->num_spill_buffers = num_spill_buffers;
+    for (size_t i = 0; i < num_spill_buffers; i++) {
+      init_buffer(h->spill_buffers + i, buffer_size);
+      if (i)
+        h->free_buffers[h->num_free++] = h->spill_buffers + i;
+    }
+    h->b = h->spill_buffers;
+    h->b2 = h->b;
+    pthread_mutex_init(&h->spill_mutex, NULL);
+    pthread_cond_init(&h->spill_cond, NULL);
+    h->spill_threads =
+        (pthread_t *)aml_malloc(sizeof(pthread_t) * num_spill_threads);
+    h->num_spill_threads = num_spill_threads;
+    for (size_t i = 0; i < num_spill_threads; i++)
+      pthread_create(h->spill_threads + i, NULL, spill_thread, h);
+  } else if (ext_options->use_extra_thread &&
+             !ext_options->replacement_selection) {
     buffer_size /= 2;
     init_buffer(&h->buf1, buffer_size);
     init_buffer(&h->buf2, buffer_size);
@@ -1304,7 +3113,11 @@ io_out_t *io_out_sorted_init(const char *filename, io_out_options_t *options,
     h->b = &(h->buf1);
     h->b2 = &(h->buf1);
   }
-  h->write_record = write_sorted_record;
+  h->write_record = h->fixed ? write_fixed_sorted_record : write_sorted_record;
+  if (h->slots)
+    h->write_record = write_combined_record;
+  else if (ext_options->replacement_selection)
+    h->write_record = write_replacement_record;
   return (io_out_t *)h;
 }
 
@@ -1315,8 +3128,24 @@ static inline void wait_on_thread(io_out_sorted_t *h) {
   }
 }
 
+/* open a sorted tmp file for writing */
+static io_out_t *tmp_out(io_out_sorted_t *h, const char *filename) {
+  // allow output buffer to be supplied to io_out_options...
+  // allow input buffer to be supplied as well
+  io_out_options_t options;
+  io_out_options_init(&options);
+  io_out_options_format(&options, h->fixed ? io_fixed(h->fixed) : io_prefix());
+  io_out_options_lz4_threads(&options, h->options.lz4_threads);
+  if (h->ext_options.zstd_tmp)
+    io_out_options_zstd(&options, h->ext_options.zstd_tmp_level,
+                        h->options.zstd_threads);
+  /* reuse the same buffer? */
+  io_out_options_buffer_size(&options, 10 * 1024 * 1024);
+  return io_out_init(filename, &options);
+}
+
 io_out_t *get_next_tmp(io_out_sorted_t *h, bool tmp_only) {
-  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  const char *suffix = tmp_suffix(&h->ext_options);
   if (!tmp_only && h->ext_options.num_per_group) {
     group_tmp_filename(h->tmp_filename, h->filename, h->num_group_written,
                        suffix);
@@ -1325,18 +3154,12 @@ io_out_t *get_next_tmp(io_out_sorted_t *h, bool tmp_only) {
     tmp_filename(h->tmp_filename, h->filename, h->num_written, suffix);
     h->num_written++;
   }
-  // allow output buffer to be supplied to io_out_options...
-  // allow input buffer to be supplied as well
-  io_out_options_t options;
-  io_out_options_init(&options);
-  io_out_options_format(&options, io_prefix());
-  /* reuse the same buffer? */
-  io_out_options_buffer_size(&options, 10 * 1024 * 1024);
-  return io_out_init(h->tmp_filename, &options);
+  return tmp_out(h, h->tmp_filename);
 }
 
 void check_for_merge(io_out_sorted_t *h) {
-  if (!h->ext_options.num_per_group ||
+  /* the open replacement selection run is one of the group files */
+  if (h->run || !h->ext_options.num_per_group ||
       h->num_group_written < h->ext_options.num_per_group)
     return;
 
@@ -1344,17 +3167,20 @@ void check_for_merge(io_out_sorted_t *h) {
 
   io_in_options_t opts;
   io_in_options_init(&opts);
-  io_in_options_format(&opts, io_prefix());
+  io_in_options_format(&opts, h->fixed ? io_fixed(h->fixed) : io_prefix());
   io_in_t *in =
       io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
+  radix_key_merge(h, in);
   if (h->ext_options.reducer)
     io_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
 
-  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  const char *suffix = tmp_suffix(&h->ext_options);
   for (size_t i = 0; i < h->num_group_written; i++) {
     group_tmp_filename(h->tmp_filename, h->filename, i, suffix);
     io_in_ext_add(in, io_in_init(h->tmp_filename, &opts), 0);
   }
+  if (h->ext_options.limit)
+    io_in_limit(in, h->ext_options.limit);
   io_record_t *r;
   while ((r = io_in_advance(in)) != NULL)
     io_out_write_record(out, r->record, r->length);
@@ -1364,14 +3190,77 @@ void check_for_merge(io_out_sorted_t *h) {
   h->num_group_written = 0;
 }
 
+/* the spill thread keeps the last record of a cut run with its buffer */
+static void keep_cut(io_out_buffer_t *b, const char *d, size_t len) {
+  if (!b->cut)
+    b->cut = aml_buffer_init(256);
+  aml_buffer_set(b->cut, d, len);
+  b->has_cut = true;
+}
+
+/* sort the buffer and write it to out, cut to the first limit records */
+static void write_buffer(io_out_sorted_t *h, io_out_buffer_t *b,
+                         io_out_t *out) {
+  size_t limit = h->ext_options.limit;
+  if (h->fixed) {
+    /* the sorted records are already in the fixed format */
+    size_t num_r = sort_fixed_buffer(h, b);
+    if (limit && num_r >= limit) {
+      num_r = limit;
+      keep_cut(b, b->buffer + ((num_r - 1) * h->fixed), h->fixed);
+    }
+    io_out_write(out, b->buffer, num_r * h->fixed);
+    clear_buffer(b);
+  } else {
+    io_in_t *in = _in_from_buffer(h, b);
+    io_record_t *r = NULL;
+    size_t num_r = 0;
+    while ((!limit || num_r < limit) && (r = io_in_advance(in)) != NULL) {
+      io_out_write_record(out, r->record, r->length);
+      num_r++;
+    }
+    if (limit && num_r == limit)
+      keep_cut(b, r->record, r->length);
+    io_in_destroy(in);
+  }
+}
+
+static void set_limit_record(io_out_sorted_t *h, const char *d, size_t len) {
+  if (!h->limit_record)
+    h->limit_record = aml_buffer_init(256);
+  aml_buffer_clear(h->limit_record);
+  aml_buffer_append(h->limit_record, d, len);
+}
+
+/* true if the record sorts after the last of the limit records kept */
+static inline bool past_limit(io_out_sorted_t *h, const void *d, size_t len) {
+  char *last = aml_buffer_data(h->limit_record);
+  if (h->fixed)
+    return compare_fixed(h, (char *)d, last) > 0;
+  io_record_t a = {(char *)d, (uint32_t)len, h->tag};
+  io_record_t b = {last, (uint32_t)aml_buffer_length(h->limit_record),
+                   h->tag};
+  return h->ext_options.int_compare(&a, &b, h->ext_options.int_compare_arg) >
+         0;
+}
+
+/* A run cut to limit records ends with a record that no more than limit
+   records sort before, so it becomes the limit record if it sorts before the
+   one already kept.  The spill threads leave it with the buffer. */
+static void adopt_cut(io_out_sorted_t *h, io_out_buffer_t *b) {
+  if (!b->has_cut)
+    return;
+  b->has_cut = false;
+  const char *d = aml_buffer_data(b->cut);
+  size_t len = aml_buffer_length(b->cut);
+  if (!h->limit_record || !past_limit(h, d, len))
+    set_limit_record(h, d, len);
+}
+
 void *write_sorted_thread(void *arg) {
   io_out_sorted_t *h = (io_out_sorted_t *)arg;
-  io_in_t *in = _in_from_buffer(h, h->b2);
   io_out_t *out = get_next_tmp(h, false);
-  io_record_t *r;
-  while ((r = io_in_advance(in)) != NULL)
-    io_out_write_record(out, r->record, r->length);
-  io_in_destroy(in);
+  write_buffer(h, h->b2, out);
   io_out_destroy(out);
 
   if (h->ext_options.num_per_group)
@@ -1379,10 +3268,420 @@ void *write_sorted_thread(void *arg) {
   return NULL;
 }
 
+/* The tmp file number is assigned when a buffer is queued, so the spill
+   threads only need the queue and free_buffers which are guarded by
+   spill_mutex.  Both directions wait on spill_cond. */
+static void *spill_thread(void *arg) {
+  io_out_sorted_t *h = (io_out_sorted_t *)arg;
+  const char *suffix = tmp_suffix(&h->ext_options);
+  char *name = (char *)aml_malloc(strlen(h->filename) + strlen(suffix) + 30);
+  pthread_mutex_lock(&h->spill_mutex);
+  while (true) {
+    while (!h->queue_len && !h->spill_done)
+      pthread_cond_wait(&h->spill_cond, &h->spill_mutex);
+    if (!h->queue_len)
+      break;
+    io_out_spill_t s = h->queue[h->queue_head];
+    h->queue_head = (h->queue_head + 1) % h->num_spill_buffers;
+    h->queue_len--;
+    pthread_mutex_unlock(&h->spill_mutex);
+
+    tmp_filename(name, h->filename, s.id, suffix);
+    io_out_t *out = tmp_out(h, name);
+    write_buffer(h, s.b, out);
+    io_out_destroy(out);
+
+    pthread_mutex_lock(&h->spill_mutex);
+    h->free_buffers[h->num_free++] = s.b;
+    pthread_cond_broadcast(&h->spill_cond);
+  }
+  pthread_mutex_unlock(&h->spill_mutex);
+  aml_free(name);
+  return NULL;
+}
+
+/* queue the current buffer and continue with a free one */
+static void spill_to_pool(io_out_sorted_t *h) {
+  pthread_mutex_lock(&h->spill_mutex);
+  size_t tail = (h->queue_head + h->queue_len) % h->num_spill_buffers;
+  h->queue[tail].b = h->b;
+  h->queue[tail].id = h->num_written++;
+  h->queue_len++;
+  pthread_cond_broadcast(&h->spill_cond);
+  while (!h->num_free)
+    pthread_cond_wait(&h->spill_cond, &h->spill_mutex);
+  h->b = h->free_buffers[--h->num_free];
+  h->b2 = h->b;
+  pthread_mutex_unlock(&h->spill_mutex);
+  adopt_cut(h, h->b);
+}
+
+/* wait for the queued buffers to be written and free every buffer except
+   h->b (which may still be read by a cursor) */
+static void stop_spill_pool(io_out_sorted_t *h) {
+  if (!h->spill_threads)
+    return;
+  pthread_mutex_lock(&h->spill_mutex);
+  h->spill_done = true;
+  pthread_cond_broadcast(&h->spill_cond);
+  pthread_mutex_unlock(&h->spill_mutex);
+  for (size_t i = 0; i < h->num_spill_threads; i++)
+    pthread_join(h->spill_threads[i], NULL);
+  aml_free(h->spill_threads);
+  h->spill_threads = NULL;
+  pthread_mutex_destroy(&h->spill_mutex);
+  pthread_cond_destroy(&h->spill_cond);
+
+  for (size_t i = 0; i < h->num_spill_buffers; i++) {
+    io_out_buffer_t *b = h->spill_buffers + i;
+    if (b != h->b && b->buffer) {
+      aml_free(b->buffer);
+      b->buffer = NULL;
+    }
+  }
+}
+
+/*
+  Replacement selection keeps the buffered records in a binary heap (the
+  io_record_t array at the front of the buffer) ordered by run and then by
+  record.  The tag of a record in the heap says which run it belongs to (tags
+  aren't written to tmp files) - records which can follow the last record
+  written to the open run carry run_tag and the others wait for the next run.
+  Each record which doesn't fit pushes the smallest record of the open run out
+  to it, so a run keeps growing until every buffered record belongs to the
+  next one.
+
+  Each record's data is stored in a chunk which ends with a 4 byte trailer.
+  The trailer of a free chunk holds its size with IO_OUT_RS_FREE set, and a
+  chunk in use is always rs_chunk_size(length) bytes.  The chunk of a written
+  record is reused by the incoming record when it is large enough (the rest
+  of it becomes a free chunk).  Otherwise the free chunks are reclaimed once
+  an eighth of the buffer is free by sliding the chunks in use to the end of
+  the buffer.  The trailers let that walk the chunks from the end down
+  without sorting them by address.
+*/
+#define IO_OUT_RS_FREE 0x80000000U
+
+/* the data, its zero terminator and the trailer rounded up to 4 bytes */
+static inline size_t rs_chunk_size(size_t len) {
+  return (len + 1 + sizeof(uint32_t) + 3) & ~(size_t)3;
+}
+
+static inline void rs_set_trailer(char *chunk, size_t size, uint32_t v) {
+  memcpy(chunk + size - sizeof(v), &v, sizeof(v));
+}
+
+static inline bool rs_less(io_out_sorted_t *h, const io_record_t *a,
+                           const io_record_t *b) {
+  if (a->tag != b->tag)
+    return a->tag == h->run_tag;
+  io_out_ext_options_t *o = &(h->ext_options);
+  return o->int_compare(a, b, o->int_compare_arg) < 0;
+}
+
+static void rs_sift_down(io_out_sorted_t *h, io_record_t *r, size_t num_r,
+                         size_t i) {
+  io_record_t tmp = r[i];
+  while (true) {
+    size_t c = (i << 1) + 1;
+    if (c >= num_r)
+      break;
+    if (c + 1 < num_r && rs_less(h, r + c + 1, r + c))
+      c++;
+    if (!rs_less(h, r + c, &tmp))
+      break;
+    r[i] = r[c];
+    i = c;
+  }
+  r[i] = tmp;
+}
+
+static void rs_sift_up(io_out_sorted_t *h, io_record_t *r, size_t i) {
+  io_record_t tmp = r[i];
+  while (i) {
+    size_t p = (i - 1) >> 1;
+    if (!rs_less(h, &tmp, r + p))
+      break;
+    r[i] = r[p];
+    i = p;
+  }
+  r[i] = tmp;
+}
+
+static void close_run(io_out_sorted_t *h) {
+  io_out_destroy(h->run);
+  h->run = NULL;
+  if (h->ext_options.num_per_group)
+    check_for_merge(h);
+}
+
+static void open_run(io_out_sorted_t *h) {
+  h->run = get_next_tmp(h, false);
+  h->run_tag = !h->run_tag;
+  h->has_last = false;
+}
+
+/* The buffer is full for the first time, so every buffered record starts
+   the first run. */
+static void start_replacement_selection(io_out_sorted_t *h) {
+  if (!h->last) {
+    h->last = aml_buffer_init(256);
+    h->group = aml_buffer_init(16 * sizeof(io_record_t));
+    h->reduce_bh = aml_buffer_init(256);
+  }
+  open_run(h);
+  io_record_t *r = (io_record_t *)h->b->buffer;
+  size_t num_r = h->b->num_records;
+  for (size_t i = 0; i < num_r; i++)
+    r[i].tag = h->run_tag;
+  for (size_t i = num_r >> 1; i-- > 0;)
+    rs_sift_down(h, r, num_r, i);
+}
+
+/* remove the smallest record from the heap and free its chunk */
+static io_record_t rs_pop_record(io_out_sorted_t *h) {
+  io_out_buffer_t *b = h->b;
+  io_record_t *r = (io_record_t *)b->buffer;
+  io_record_t top = r[0];
+  b->num_records--;
+  b->bp -= sizeof(io_record_t);
+  if (b->num_records) {
+    r[0] = r[b->num_records];
+    rs_sift_down(h, r, b->num_records, 0);
+  }
+  size_t size = rs_chunk_size(top.length);
+  rs_set_trailer(top.record, size, size | IO_OUT_RS_FREE);
+  h->freed += size;
+  return top;
+}
+
+/* Write the smallest record (reduced with the records equal to it) to the
+   open run, starting the next run first if the open one can't be extended.
+   The written record is returned so that its chunk can be reused. */
+static io_record_t rs_write_smallest(io_out_sorted_t *h) {
+  io_record_t *r = (io_record_t *)h->b->buffer;
+  if (r[0].tag != h->run_tag) {
+    close_run(h);
+    open_run(h);
+  }
+
+  io_out_ext_options_t *o = &(h->ext_options);
+  io_record_t top = rs_pop_record(h);
+  if (o->int_reducer) {
+    aml_buffer_set(h->group, &top, sizeof(top));
+    while (h->b->num_records && r[0].tag == h->run_tag &&
+           !o->int_compare(r, &top, o->int_compare_arg)) {
+      io_record_t eq = rs_pop_record(h);
+      aml_buffer_append(h->group, &eq, sizeof(eq));
+    }
+    io_record_t res;
+    aml_buffer_clear(h->reduce_bh);
+    if (o->int_reducer(&res, (io_record_t *)aml_buffer_data(h->group),
+                       aml_buffer_length(h->group) / sizeof(io_record_t),
+                       h->reduce_bh, o->int_reducer_arg))
+      io_out_write_record(h->run, res.record, res.length);
+  } else
+    io_out_write_record(h->run, top.record, top.length);
+
+  /* records equal to the last one must go to the next run when reducing */
+  aml_buffer_set(h->last, top.record, top.length);
+  h->has_last = true;
+  return top;
+}
+
+/* slide the chunks in use to the end of the buffer */
+static void rs_pack(io_out_sorted_t *h) {
+  io_out_buffer_t *b = h->b;
+  io_record_t *r = (io_record_t *)b->buffer;
+  for (size_t i = 0; i < b->num_records; i++)
+    rs_set_trailer(r[i].record, rs_chunk_size(r[i].length), i);
+
+  char *top = b->buffer + b->size;
+  char *wp = top;
+  while (top > b->ep) {
+    uint32_t v;
+    memcpy(&v, top - sizeof(v), sizeof(v));
+    if (v & IO_OUT_RS_FREE) {
+      top -= v & ~IO_OUT_RS_FREE;
+      continue;
+    }
+    size_t size = rs_chunk_size(r[v].length);
+    top -= size;
+    wp -= size;
+    if (wp != top)
+      memmove(wp, top, size);
+    r[v].record = wp;
+  }
+  b->ep = wp;
+  h->freed = 0;
+}
+
+static bool write_replacement_record(io_out_t *hp, const void *d,
+                                     size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  io_out_buffer_t *b = h->b;
+  size_t size = rs_chunk_size(len);
+  if (sizeof(io_record_t) + size > b->size / 2)
+    return write_one_record(h, d, len);
+
+  char *dest = NULL;
+  while (b->bp + sizeof(io_record_t) + size > b->ep) {
+    if (!h->run)
+      start_replacement_selection(h);
+    else if (h->freed >= b->size / 8 || !b->num_records)
+      rs_pack(h);
+    else {
+      io_record_t w = rs_write_smallest(h);
+      size_t wsize = rs_chunk_size(w.length);
+      if (wsize >= size) {
+        /* the record takes the end of the chunk */
+        dest = w.record + (wsize - size);
+        if (wsize > size)
+          rs_set_trailer(w.record, wsize - size,
+                         (wsize - size) | IO_OUT_RS_FREE);
+        h->freed -= size;
+        break;
+      }
+    }
+  }
+  if (!dest) {
+    b->ep -= size;
+    dest = b->ep;
+  }
+  memcpy(dest, d, len);
+  dest[len] = 0;
+  rs_set_trailer(dest, size, 0);
+
+  io_record_t *r = (io_record_t *)b->buffer;
+  size_t i = b->num_records++;
+  b->bp += sizeof(io_record_t);
+  r[i].record = dest;
+  r[i].length = len;
+  r[i].tag = h->tag;
+  if (!h->run)
+    return true;
+
+  r[i].tag = h->run_tag;
+  if (h->has_last) {
+    io_out_ext_options_t *o = &(h->ext_options);
+    io_record_t last = {aml_buffer_data(h->last),
+                        (uint32_t)aml_buffer_length(h->last), h->run_tag};
+    if (o->int_compare(r + i, &last, o->int_compare_arg) <
+        (o->int_reducer ? 1 : 0))
+      r[i].tag = !h->run_tag;
+  }
+  rs_sift_up(h, r, i);
+  return true;
+}
+
+/* write everything that is buffered once the last record is written */
+static void finish_replacement_selection(io_out_sorted_t *h) {
+  while (h->b->num_records)
+    rs_write_smallest(h);
+  clear_buffer(h->b);
+  h->freed = 0;
+  if (h->ext_options.num_per_group)
+    h->ext_options.num_per_group =
+        h->num_group_written ? h->num_group_written : 1;
+  close_run(h);
+}
+
+/* When limit records are expected to fit in half of the buffer (by the
+   average record size), the buffer is sorted, reduced and cut to them before
+   it is written so the records which sort after the last of them can be
+   discarded as they are written.  If the records kept still take more than
+   half of the buffer, they are written as the next tmp file without sorting
+   them again.  Otherwise the cut is left to write_buffer.  Returns true if
+   the buffer doesn't need to be written. */
+static bool limit_buffer(io_out_sorted_t *h) {
+  io_out_buffer_t *b = h->b;
+  size_t limit = h->ext_options.limit;
+  size_t used = (b->bp - b->buffer) + ((b->buffer + b->size) - b->ep);
+  size_t avg = used / b->num_records;
+  if (limit >= b->num_records || limit > (b->size / 2) / (avg ? avg : 1) ||
+      (h->slots && limit > h->max_combined / 2))
+    return false;
+
+  if (h->fixed) {
+    /* every record is the same size, so limit records fit */
+    size_t num_r = sort_fixed_buffer(h, b);
+    if (num_r > limit)
+      num_r = limit;
+    b->bp = b->buffer + (num_r * h->fixed);
+    b->num_records = num_r;
+    if (num_r == limit)
+      set_limit_record(h, b->bp - h->fixed, h->fixed);
+    return true;
+  }
+
+  io_record_t *r = (io_record_t *)b->buffer;
+  sort_records(h, r, b->num_records);
+  io_in_t *in = io_in_records_init(r, b->num_records, &(h->file_options));
+  aml_buffer_t *bh = aml_buffer_init(4096);
+  io_record_t *rr = NULL;
+  size_t num_r = 0;
+  size_t kept = 0;
+  while (num_r < limit && (rr = io_in_advance(in)) != NULL) {
+    aml_buffer_append(bh, &(rr->length), sizeof(rr->length));
+    aml_buffer_append(bh, rr->record, rr->length);
+    kept += sizeof(io_record_t) + rr->length + 1;
+    num_r++;
+  }
+  if (num_r == limit)
+    set_limit_record(h, rr->record, rr->length);
+  io_in_destroy(in);
+
+  clear_buffer(b);
+  char *p = aml_buffer_data(bh);
+  if (kept > b->size / 2) {
+    wait_on_thread(h);
+    io_out_t *out = get_next_tmp(h, false);
+    for (size_t i = 0; i < num_r; i++) {
+      uint32_t len;
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      io_out_write_record(out, p, len);
+      p += len;
+    }
+    io_out_destroy(out);
+    aml_buffer_destroy(bh);
+    if (h->ext_options.num_per_group)
+      check_for_merge(h);
+    return true;
+  }
+
+  /* copy the records back in the same layout as write_sorted_record */
+  for (size_t i = 0; i < num_r; i++) {
+    uint32_t len;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    b->ep -= len + 1;
+    memcpy(b->ep, p, len);
+    b->ep[len] = 0;
+    r[i].record = b->ep;
+    r[i].length = len;
+    r[i].tag = h->tag;
+    p += len;
+  }
+  b->bp = (char *)(r + num_r);
+  b->num_records = num_r;
+  aml_buffer_destroy(bh);
+  return true;
+}
+
 void write_sorted(io_out_sorted_t *h) {
   if (h->b->bp == h->b->buffer)
     return;
+  if (h->ext_options.limit && limit_buffer(h))
+    return;
+  if (h->spill_threads) {
+    spill_to_pool(h);
+    return;
+  }
   wait_on_thread(h);
+  adopt_cut(h, h->b2);
   if (h->ext_options.use_extra_thread) {
     io_out_buffer_t *tmp = h->b;
     h->b = h->b2;
@@ -1390,8 +3689,10 @@ void write_sorted(io_out_sorted_t *h) {
 
     h->thread_started = true;
     pthread_create(&h->thread, NULL, write_sorted_thread, h);
-  } else
+  } else {
     write_sorted_thread(h);
+    adopt_cut(h, h->b2);
+  }
 }
 
 void io_out_tag(io_out_t *hp, int tag) {
@@ -1403,6 +3704,199 @@ void io_out_tag(io_out_t *hp, int tag) {
   }
 }
 
+/* smallest input buffer worth giving to a merge */
+#define IO_OUT_MIN_MERGE_BUFFER (64 * 1024)
+
+/* the most tmp files to merge at once with num_threads merges running */
+static size_t merge_fan_in(io_out_sorted_t *h, size_t num_threads) {
+  if (h->ext_options.merge_fan_in)
+    return h->ext_options.merge_fan_in < 2 ? 2 : h->ext_options.merge_fan_in;
+
+  size_t fan_in = h->options.buffer_size / IO_OUT_MIN_MERGE_BUFFER;
+  if (fan_in < 64)
+    fan_in = 64;
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY) {
+    /* leave room for the caller's files and an output per merge */
+    size_t fds = rl.rlim_cur > 64 ? rl.rlim_cur - 32 : rl.rlim_cur / 2;
+    fds /= num_threads;
+    if (fan_in + 1 > fds)
+      fan_in = fds > 1 ? fds - 1 : 2;
+  }
+  return fan_in < 2 ? 2 : fan_in;
+}
+
+typedef struct {
+  size_t id;
+  size_t size;
+} io_out_run_t;
+
+typedef struct {
+  io_out_sorted_t *h;
+  io_out_run_t *runs;
+  size_t num_runs;
+  size_t id;
+  size_t buffer_size;
+} io_out_merge_task_t;
+
+typedef struct {
+  io_out_merge_task_t *tasks;
+  size_t num_tasks;
+  size_t next;
+  pthread_mutex_t mutex;
+} io_out_merge_pass_t;
+
+static int compare_run_size(const void *a, const void *b) {
+  const io_out_run_t *ra = (const io_out_run_t *)a;
+  const io_out_run_t *rb = (const io_out_run_t *)b;
+  if (ra->size != rb->size)
+    return ra->size < rb->size ? -1 : 1;
+  return ra->id < rb->id ? -1 : 1;
+}
+
+/* merge the runs of a task into a new tmp file and remove them */
+static void merge_runs(io_out_merge_task_t *t) {
+  io_out_sorted_t *h = t->h;
+  const char *suffix = tmp_suffix(&h->ext_options);
+  size_t len = strlen(h->filename) + strlen(suffix) + 30;
+  char *name = (char *)aml_malloc(len);
+
+  io_in_options_t opts;
+  io_in_options_init(&opts);
+  io_in_options_buffer_size(&opts, t->buffer_size);
+  io_in_options_format(&opts, h->fixed ? io_fixed(h->fixed) : io_prefix());
+  io_in_t *in =
+      io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
+  radix_key_merge(h, in);
+  if (h->ext_options.reducer)
+    io_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
+  for (size_t i = 0; i < t->num_runs; i++) {
+    tmp_filename(name, h->filename, t->runs[i].id, suffix);
+    io_in_ext_add(in, io_in_init(name, &opts), i);
+  }
+
+  if (h->ext_options.limit)
+    io_in_limit(in, h->ext_options.limit);
+
+  tmp_filename(name, h->filename, t->id, suffix);
+  io_out_t *out = tmp_out(h, name);
+  io_record_t *r;
+  while ((r = io_in_advance(in)) != NULL)
+    io_out_write_record(out, r->record, r->length);
+  io_out_destroy(out);
+  io_in_destroy(in);
+
+  for (size_t i = 0; i < t->num_runs; i++) {
+    tmp_filename(name, h->filename, t->runs[i].id, suffix);
+    remove(name);
+  }
+  aml_free(name);
+}
+
+static void *merge_runs_thread(void *arg) {
+  io_out_merge_pass_t *p = (io_out_merge_pass_t *)arg;
+  while (true) {
+    pthread_mutex_lock(&p->mutex);
+    size_t i = p->next++;
+    pthread_mutex_unlock(&p->mutex);
+    if (i >= p->num_tasks)
+      break;
+    merge_runs(p->tasks + i);
+  }
+  return NULL;
+}
+
+/*
+  Merge the smallest tmp files first until at most fan_in are left for the
+  final merge.  Each pass sorts the runs by size and groups the smallest
+  into merges of up to fan_in runs.  As with a Huffman code of degree fan_in,
+  the first (smallest) group is only as large as it needs to be for the
+  final merge to have exactly fan_in inputs.  The merges of a pass only read
+  runs which existed before the pass, so they run on the merge threads at
+  the same time.  Returns the runs which are left (num_runs is updated).
+*/
+static io_out_run_t *plan_merges(io_out_sorted_t *h, size_t *num_runsp) {
+  size_t num_threads = h->ext_options.num_merge_threads;
+  if (num_threads < 1)
+    num_threads = 1;
+  size_t fan_in = merge_fan_in(h, num_threads);
+  size_t num_runs = h->num_written;
+  const char *suffix = tmp_suffix(&h->ext_options);
+  io_out_run_t *runs =
+      (io_out_run_t *)aml_malloc(sizeof(io_out_run_t) * (num_runs + 1));
+  for (size_t i = 0; i < num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, i, suffix);
+    runs[i].id = i;
+    runs[i].size = io_file_size(h->tmp_filename);
+  }
+
+  io_out_merge_task_t *tasks = (io_out_merge_task_t *)aml_malloc(
+      sizeof(io_out_merge_task_t) * (num_runs / 2 + 1));
+  while (num_runs > fan_in) {
+    qsort(runs, num_runs, sizeof(io_out_run_t), compare_run_size);
+    size_t num_tasks = 0, i = 0, n = num_runs;
+    while (n > fan_in && num_runs - i >= 2) {
+      size_t m = n - fan_in + 1;
+      if (m > fan_in)
+        m = num_tasks ? fan_in : ((n - 2) % (fan_in - 1)) + 2;
+      if (m > num_runs - i)
+        m = num_runs - i;
+      io_out_merge_task_t *t = tasks + num_tasks++;
+      t->h = h;
+      t->runs = runs + i;
+      t->num_runs = m;
+      t->id = h->num_written++;
+      i += m;
+      n -= m - 1;
+    }
+    size_t threads = num_threads < num_tasks ? num_threads : num_tasks;
+    size_t per_merge = h->options.buffer_size / threads;
+    for (size_t j = 0; j < num_tasks; j++) {
+      tasks[j].buffer_size = per_merge / tasks[j].num_runs;
+      if (tasks[j].buffer_size < IO_OUT_MIN_MERGE_BUFFER)
+        tasks[j].buffer_size = IO_OUT_MIN_MERGE_BUFFER;
+    }
+
+    io_out_merge_pass_t pass;
+    pass.tasks = tasks;
+    pass.num_tasks = num_tasks;
+    pass.next = 0;
+    pthread_mutex_init(&pass.mutex, NULL);
+    /* the calling thread takes tasks too, so it does the merges of any
+       thread which can't be started */
+    pthread_t *tids = (pthread_t *)aml_malloc(sizeof(pthread_t) * threads);
+    size_t num_started = 0;
+    while (num_started + 1 < threads &&
+           pthread_create(tids + num_started, NULL, merge_runs_thread,
+                          &pass) == 0)
+      num_started++;
+    merge_runs_thread(&pass);
+    for (size_t j = 0; j < num_started; j++)
+      pthread_join(tids[j], NULL);
+    aml_free(tids);
+    pthread_mutex_destroy(&pass.mutex);
+
+    /* the merged runs are replaced by the runs they were merged into */
+    io_out_run_t *wp = runs;
+    for (size_t j = 0; j < num_tasks; j++) {
+      tmp_filename(h->tmp_filename, h->filename, tasks[j].id, suffix);
+      wp->size = io_file_size(h->tmp_filename);
+      wp->id = tasks[j].id;
+      wp++;
+    }
+    memmove(wp, runs + i, (num_runs - i) * sizeof(io_out_run_t));
+    num_runs = (wp - runs) + (num_runs - i);
+  }
+  aml_free(tasks);
+
+  /* keep the order that the runs were written in for the final merge */
+  for (size_t i = 0; i < num_runs; i++)
+    runs[i].size = runs[i].id;
+  qsort(runs, num_runs, sizeof(io_out_run_t), compare_run_size);
+  *num_runsp = num_runs;
+  return runs;
+}
+
 io_in_t *_io_out_sorted_in(io_out_t *hp) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
   if (h->type != IO_OUT_SORTED_TYPE)
@@ -1413,6 +3907,19 @@ io_in_t *_io_out_sorted_in(io_out_t *hp) {
 
   h->out_in_called = true;
 
+  /* the extra thread may still be writing the first tmp file */
+  wait_on_thread(h);
+  if (h->spill_threads) {
+    bool spilled = h->num_written;
+    if (spilled && h->b->num_records)
+      spill_to_pool(h);
+    stop_spill_pool(h);
+    if (spilled) {
+      aml_free(h->b->buffer);
+      h->b->buffer = NULL;
+    }
+  }
+
   if (!h->num_written && !h->num_group_written) {
     if (&(h->buf1) == h->b) {
       if (h->buf2.buffer) {
@@ -1425,10 +3932,15 @@ io_in_t *_io_out_sorted_in(io_out_t *hp) {
         h->buf1.buffer = NULL;
       }
     }
-    return _in_from_buffer(h, h->b);
+    io_in_t *in = _in_from_buffer(h, h->b);
+    if (in && h->ext_options.limit)
+      io_in_limit(in, h->ext_options.limit);
+    return in;
   }
 
-  if (h->b->num_records) {
+  if (h->run)
+    finish_replacement_selection(h);
+  else if (h->b->num_records) {
     wait_on_thread(h);
     if (h->ext_options.use_extra_thread) {
       io_out_buffer_t *tmp = h->b;
@@ -1450,24 +3962,53 @@ io_in_t *_io_out_sorted_in(io_out_t *hp) {
     h->buf2.buffer = NULL;
   }
 
+  size_t num_runs;
+  io_out_run_t *runs = plan_merges(h, &num_runs);
+
+  /* split the buffer across the runs once there are more than 10 */
   io_in_options_t opts;
   io_in_options_init(&opts);
-  io_in_options_buffer_size(&opts, h->buf1.size / 10);
-  io_in_options_format(&opts, io_prefix());
+  io_in_options_buffer_size(&opts,
+                            h->b->size / (num_runs > 10 ? num_runs : 10));
+  io_in_options_format(&opts, h->fixed ? io_fixed(h->fixed) : io_prefix());
   io_in_t *in =
       io_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
+  radix_key_merge(h, in);
   if (h->ext_options.reducer)
     io_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
 
-  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  const char *suffix = tmp_suffix(&h->ext_options);
   // printf("%s num_written: %lu\n", h->filename, h->num_written);
-  for (size_t i = 0; i < h->num_written; i++) {
-    tmp_filename(h->tmp_filename, h->filename, i, suffix);
+  for (size_t i = 0; i < num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, runs[i].id, suffix);
     io_in_ext_add(in, io_in_init(h->tmp_filename, &opts), i);
   }
+  aml_free(runs);
+  if (h->ext_options.limit)
+    io_in_limit(in, h->ext_options.limit);
   return in;
 }
 
+io_in_t **io_out_in_ranges(io_out_t *hp, size_t n) {
+  if (!n)
+    return NULL;
+
+  if (hp->type == IO_OUT_PARTITIONED_TYPE &&
+      ((io_out_partitioned_t *)hp)->ext_options.compare) {
+    io_in_t **res = io_out_partitioned_ranges((io_out_partitioned_t *)hp, n);
+    aml_free(hp);
+    return res;
+  }
+
+  io_in_t **res = (io_in_t **)aml_malloc(sizeof(io_in_t *) * n);
+  res[0] = io_out_in(hp);
+  if (!res[0])
+    res[0] = io_in_empty();
+  for (size_t i = 1; i < n; i++)
+    res[i] = io_in_empty();
+  return res;
+}
+
 io_in_t *io_out_in(io_out_t *hp) {
   io_in_t *in = NULL;
 
@@ -1514,19 +4055,32 @@ io_in_t *io_out_in(io_out_t *hp) {
   return in;
 }
 
-/*
-TODO: Add support for fixed length records.  These records don't need the
-io_record_t record array and can simply be sorted in place.
+bool write_one_record(io_out_sorted_t *h, const void *d, size_t len) {
+   wait_on_thread(h);
+   io_out_t *out = get_next_tmp(h, false);
+   io_out_write_record(out, d, len);
+   io_out_destroy(out);
+   if (h->ext_options.num_per_group)
+     check_for_merge(h);
+   return true;
+}
 
+/* Fixed length records don't need the io_record_t array and are sorted in
+   place. */
 bool write_fixed_sorted_record(io_out_t *hp, const void *d, size_t len) {
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
   if (len != h->fixed)
     abort();
+  if (h->limit_record && past_limit(h, d, len))
+    return true;
 
+  /* one byte is kept free so readers can zero terminate the last record */
   char *bp = h->b->bp;
-  if (bp + len > h->b->ep) {
+  if (bp + len >= h->b->ep) {
     write_sorted(h);
     bp = h->b->bp;
+    if (bp + len >= h->b->ep)
+      return write_one_record(h, d, len);
   }
 
   memcpy(bp, d, len);
@@ -1535,22 +4089,13 @@ bool write_fixed_sorted_record(io_out_t *hp, const void *d, size_t len) {
   h->b->num_records++;
   return true;
 }
-*/
-
-bool write_one_record(io_out_sorted_t *h, const void *d, size_t len) {
-   wait_on_thread(h);
-   io_out_t *out = get_next_tmp(h, false);
-   io_out_write_record(out, d, len);
-   io_out_destroy(out);
-   if (h->ext_options.num_per_group)
-     check_for_merge(h);
-   return true;
-}
 
 bool write_sorted_record(io_out_t *hp, const void *d, size_t len) {
   if (len > 0xffffffffU)
     return false;
   io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  if (h->limit_record && past_limit(h, d, len))
+    return true;
 
   size_t length = len + sizeof(io_record_t) + 5;
   char *bp = h->b->bp;
@@ -1586,9 +4131,149 @@ bool write_sorted_record(io_out_t *hp, const void *d, size_t len) {
   return true;
 }
 
+/*
+  The combiner's table is linear probing over slots which hold the low 32
+  bits of the hash and the index of the record in the buffer.  Every record
+  in the buffer is in the table, so the table is rebuilt from the records
+  left in the buffer whenever it is written (a limit cut keeps some).
+*/
+static uint32_t combine_hash(io_out_sorted_t *h, const io_record_t *r) {
+  return (uint32_t)h->ext_options.combine_hash(r,
+                                               h->ext_options.combine_hash_arg);
+}
+
+static void reset_combined(io_out_sorted_t *h) {
+  io_out_slot_t *slots = h->slots;
+  size_t mask = h->slot_mask;
+  memset(slots, 0, sizeof(io_out_slot_t) * (mask + 1));
+
+  /* the records kept by a limit cut are sorted and reduced, so unique */
+  io_record_t *records = (io_record_t *)h->b->buffer;
+  for (size_t j = 0; j < h->b->num_records; j++) {
+    uint32_t hash = combine_hash(h, records + j);
+    size_t i = hash & mask;
+    while (slots[i].index)
+      i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].index = j + 1;
+  }
+}
+
+/* the reducer dropped the record in slot, so remove it from the table and
+   move the last record into its place in the buffer */
+static void remove_combined(io_out_sorted_t *h, size_t slot) {
+  io_out_slot_t *slots = h->slots;
+  size_t mask = h->slot_mask;
+  size_t index = slots[slot].index - 1;
+
+  /* backward shift deletion keeps the probe sequences unbroken */
+  size_t i = slot, j = slot;
+  while (true) {
+    j = (j + 1) & mask;
+    if (!slots[j].index)
+      break;
+    size_t k = slots[j].hash & mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    slots[i] = slots[j];
+    i = j;
+  }
+  slots[i].index = 0;
+
+  io_record_t *records = (io_record_t *)h->b->buffer;
+  size_t last = h->b->num_records - 1;
+  if (index != last) {
+    records[index] = records[last];
+    i = combine_hash(h, records + index) & mask;
+    while (slots[i].index != last + 1)
+      i = (i + 1) & mask;
+    slots[i].index = index + 1;
+  }
+  h->b->num_records--;
+  h->b->bp -= sizeof(io_record_t);
+}
+
+/* reduce nr into the buffered record r, returns false if there isn't room
+   for the larger result */
+static bool combine_record(io_out_sorted_t *h, size_t slot, io_record_t *r,
+                           const io_record_t *nr) {
+  io_out_ext_options_t *o = &(h->ext_options);
+  io_record_t pair[2] = {*r, *nr};
+  io_record_t res;
+  if (!o->int_reducer(&res, pair, 2, h->combine_bh, o->int_reducer_arg)) {
+    remove_combined(h, slot);
+    return true;
+  }
+  char *dest = r->record;
+  if (res.length > r->length) {
+    if (h->b->bp + res.length + 1 > h->b->ep)
+      return false;
+    h->b->ep -= res.length + 1;
+    dest = h->b->ep;
+  }
+  memmove(dest, res.record, res.length);
+  dest[res.length] = 0;
+  r->record = dest;
+  r->length = res.length;
+  return true;
+}
+
+static bool write_combined_record(io_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  io_out_sorted_t *h = (io_out_sorted_t *)hp;
+  if (h->limit_record && past_limit(h, d, len))
+    return true;
+  io_out_ext_options_t *o = &(h->ext_options);
+  io_record_t nr = {(char *)d, (uint32_t)len, h->tag};
+  uint32_t hash = combine_hash(h, &nr);
+  io_out_slot_t *slots = h->slots;
+  size_t mask = h->slot_mask;
+  size_t length = len + sizeof(io_record_t) + 5;
+  bool written = false;
+  size_t i;
+  while (true) {
+    i = hash & mask;
+    io_record_t *records = (io_record_t *)h->b->buffer;
+    while (slots[i].index) {
+      io_record_t *r = records + slots[i].index - 1;
+      if (slots[i].hash == hash &&
+          !o->int_compare(r, &nr, o->int_compare_arg)) {
+        if (combine_record(h, i, r, &nr))
+          return true;
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+    if (!slots[i].index && h->b->num_records < h->max_combined &&
+        h->b->bp + length <= h->b->ep)
+      break;
+    if (written)
+      return write_one_record(h, d, len);
+
+    /* the records kept in the buffer may include this key */
+    write_sorted(h);
+    reset_combined(h);
+    written = true;
+  }
+
+  char *ep = h->b->ep - (len + 1);
+  memcpy(ep, d, len);
+  ep[len] = 0;
+  io_record_t *r = (io_record_t *)h->b->bp;
+  r->record = ep;
+  r->length = len;
+  r->tag = h->tag;
+  h->b->bp += sizeof(*r);
+  h->b->ep = ep;
+  h->b->num_records++;
+  slots[i].hash = hash;
+  slots[i].index = h->b->num_records;
+  return true;
+}
+
 void io_out_ext_remove_tmp_files(char *tmp, const char *filename,
-                                 bool lz4_tmp) {
-  const char *suffix = lz4_tmp ? ".lz4" : "";
+                                 const char *suffix) {
   uint32_t skipped = 0;
   for (uint32_t i = 0; skipped < 4; i++) {
     tmp_filename(tmp, filename, i, suffix);
@@ -1664,8 +4349,40 @@ void io_out_sorted_destroy(io_out_t *hp) {
     aml_free(h->buf2.buffer);
     h->buf2.buffer = NULL;
   }
+  if (h->buf1.cut)
+    aml_buffer_destroy(h->buf1.cut);
+  if (h->buf2.cut)
+    aml_buffer_destroy(h->buf2.cut);
+  if (h->last) {
+    aml_buffer_destroy(h->last);
+    aml_buffer_destroy(h->group);
+    aml_buffer_destroy(h->reduce_bh);
+  }
+  if (h->limit_record)
+    aml_buffer_destroy(h->limit_record);
+  if (h->slots) {
+    aml_free(h->slots);
+    aml_buffer_destroy(h->combine_bh);
+  }
+  if (h->spill_buffers) {
+    for (size_t i = 0; i < h->num_spill_buffers; i++) {
+      if (h->spill_buffers[i].buffer)
+        aml_free(h->spill_buffers[i].buffer);
+      if (h->spill_buffers[i].cut)
+        aml_buffer_destroy(h->spill_buffers[i].cut);
+    }
+    aml_free(h->spill_buffers);
+    aml_free(h->free_buffers);
+    aml_free(h->queue);
+  }
+  /* merged runs leave gaps in the numbering which can stop the scan below */
+  const char *suffix = tmp_suffix(&h->ext_options);
+  for (size_t i = 0; i < h->num_written; i++) {
+    tmp_filename(h->tmp_filename, h->filename, i, suffix);
+    remove(h->tmp_filename);
+  }
   io_out_ext_remove_tmp_files(h->tmp_filename, h->filename,
-                              h->ext_options.lz4_tmp);
+                              tmp_suffix(&h->ext_options));
   destroy_extra_ins(h);
   remove_extras(h);
   touch_extras(h);
@@ -1722,6 +4439,7 @@ static void io_out_sorted_then_partitioned_destroy(io_out_t *hp) {
     io_out_ext_options_t pext = h->ext_options;
     pext.sort_before_partitioning = false;
     pext.sort_while_partitioning = false;
+    pext.concurrent = false;
     /* Disable per-part sorting path in io_out_partitioned_init */
     pext.compare = NULL;
     pext.int_compare = NULL;
@@ -1822,7 +4540,7 @@ io_out_t *io_out_ext_init(const char *filename, io_out_options_t *options,
   }
 
   // No partitioner: plain sort if compare set
-  if (ext_options->compare)
+  if (ext_options->compare || ext_options->fixed_compare)
     return io_out_sorted_init(filename, options, ext_options);
 
   // Otherwise: just a single unsorted output file
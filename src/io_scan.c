@@ -0,0 +1,170 @@
+// SPDX-FileCopyrightText: 2019–2026 Andy Curtis <contactandyc@gmail.com>
+// SPDX-FileCopyrightText: 2024–2025 Knode.ai
+// SPDX-License-Identifier: Apache-2.0
+//
+// Maintainer: Andy Curtis <contactandyc@gmail.com>
+
+#include "the-io-library/io.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IO_SCAN_X86
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define IO_SCAN_NEON
+#endif
+
+typedef char *(*io_scan_cb)(const char *p, const char *ep, int a);
+typedef char *(*io_scan2_cb)(const char *p, const char *ep, int a, int b);
+
+static char *scan_scalar(const char *p, const char *ep, int a) {
+  return (char *)memchr(p, a, ep - p);
+}
+
+static char *scan2_scalar(const char *p, const char *ep, int a, int b) {
+  while (p < ep) {
+    if (*p == (char)a || *p == (char)b)
+      return (char *)p;
+    p++;
+  }
+  return NULL;
+}
+
+#if defined(IO_SCAN_X86)
+__attribute__((target("sse2")))
+static char *scan_sse2(const char *p, const char *ep, int a) {
+  __m128i va = _mm_set1_epi8((char)a);
+  while (ep - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, va));
+    if (m)
+      return (char *)p + __builtin_ctz(m);
+    p += 16;
+  }
+  return scan2_scalar(p, ep, a, a);
+}
+
+__attribute__((target("sse2")))
+static char *scan2_sse2(const char *p, const char *ep, int a, int b) {
+  __m128i va = _mm_set1_epi8((char)a);
+  __m128i vb = _mm_set1_epi8((char)b);
+  while (ep - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+    uint32_t m = (uint32_t)_mm_movemask_epi8(eq);
+    if (m)
+      return (char *)p + __builtin_ctz(m);
+    p += 16;
+  }
+  return scan2_scalar(p, ep, a, b);
+}
+
+__attribute__((target("avx2")))
+static char *scan_avx2(const char *p, const char *ep, int a) {
+  __m256i va = _mm256_set1_epi8((char)a);
+  while (ep - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, va));
+    if (m)
+      return (char *)p + __builtin_ctz(m);
+    p += 32;
+  }
+  return scan_sse2(p, ep, a);
+}
+
+__attribute__((target("avx2")))
+static char *scan2_avx2(const char *p, const char *ep, int a, int b) {
+  __m256i va = _mm256_set1_epi8((char)a);
+  __m256i vb = _mm256_set1_epi8((char)b);
+  while (ep - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i eq =
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(eq);
+    if (m)
+      return (char *)p + __builtin_ctz(m);
+    p += 32;
+  }
+  return scan2_sse2(p, ep, a, b);
+}
+#elif defined(IO_SCAN_NEON)
+/* NEON has no movemask, so narrow the 16 byte compare to a 64 bit mask with
+   4 bits per byte. */
+static inline uint64_t neon_mask(uint8x16_t eq) {
+  uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+static char *scan_neon(const char *p, const char *ep, int a) {
+  uint8x16_t va = vdupq_n_u8((uint8_t)a);
+  while (ep - p >= 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint64_t m = neon_mask(vceqq_u8(v, va));
+    if (m)
+      return (char *)p + (__builtin_ctzll(m) >> 2);
+    p += 16;
+  }
+  return scan2_scalar(p, ep, a, a);
+}
+
+static char *scan2_neon(const char *p, const char *ep, int a, int b) {
+  uint8x16_t va = vdupq_n_u8((uint8_t)a);
+  uint8x16_t vb = vdupq_n_u8((uint8_t)b);
+  while (ep - p >= 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint64_t m = neon_mask(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)));
+    if (m)
+      return (char *)p + (__builtin_ctzll(m) >> 2);
+    p += 16;
+  }
+  return scan2_scalar(p, ep, a, b);
+}
+#endif
+
+static io_scan_cb scan = scan_scalar;
+static io_scan2_cb scan2 = scan2_scalar;
+
+/* pick the widest implementation the cpu supports once at load time */
+__attribute__((constructor)) static void io_scan_select(void) {
+#if defined(IO_SCAN_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+    scan2 = scan2_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    scan = scan_sse2;
+    scan2 = scan2_sse2;
+  }
+#elif defined(IO_SCAN_NEON)
+  scan = scan_neon;
+  scan2 = scan2_neon;
+#endif
+}
+
+char *io_find_delimiter(const char *p, const char *ep, int delim) {
+  return scan(p, ep, delim);
+}
+
+char *io_find_delimiter2(const char *p, const char *ep, int delim,
+                         int delim2) {
+  return scan2(p, ep, delim, delim2);
+}
+
+char *io_find_csv_delimiter(const char *p, const char *ep, int delim,
+                            bool *in_quote) {
+  while (p < ep) {
+    if (*in_quote)
+      p = scan(p, ep, '\"');
+    else
+      p = scan2(p, ep, delim, '\"');
+    if (!p)
+      return NULL;
+    if (*p != '\"')
+      return (char *)p;
+    *in_quote = !(*in_quote); // parity naturally handles escaped "" quotes
+    p++;
+  }
+  return NULL;
+}
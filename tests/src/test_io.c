@@ -230,6 +230,32 @@ MACRO_TEST(io_sort_records_and_hash_partition) {
     MACRO_ASSERT_TRUE(part < 7);
 }
 
+MACRO_TEST(io_find_delimiter_scalar_and_vector_paths) {
+    /* every position and length so that both the vector and tail paths run */
+    char buf[200];
+    for (size_t len = 0; len < 100; len++) {
+        for (size_t pos = 0; pos <= len; pos++) {
+            memset(buf, 'x', sizeof(buf));
+            if (pos < len) buf[pos] = '\n';
+            char *p = io_find_delimiter(buf, buf + len, '\n');
+            MACRO_ASSERT_TRUE(pos < len ? p == buf + pos : p == NULL);
+            p = io_find_delimiter2(buf, buf + len, '\t', '\n');
+            MACRO_ASSERT_TRUE(pos < len ? p == buf + pos : p == NULL);
+        }
+    }
+
+    /* delimiters inside quotes are skipped and the state carries over */
+    const char csv[] = "a,\"b,\"\"c\",d\n";
+    bool in_quote = false;
+    const char *ep = csv + sizeof(csv) - 1;
+    char *p = io_find_csv_delimiter(csv, ep, '\n', &in_quote);
+    MACRO_ASSERT_TRUE(p == ep - 1 && !in_quote);
+    p = io_find_csv_delimiter(csv, csv + 4, '\n', &in_quote);
+    MACRO_ASSERT_TRUE(p == NULL && in_quote);
+    p = io_find_csv_delimiter(csv + 4, ep, ',', &in_quote);
+    MACRO_ASSERT_TRUE(p == csv + 9 && !in_quote);
+}
+
 /* --- runner --- */
 int main(void) {
     macro_test_case tests[64];
@@ -240,6 +266,7 @@ int main(void) {
     MACRO_ADD(tests, io_read_file_and_chunks);
     MACRO_ADD(tests, io_list_and_sort_file_info);
     MACRO_ADD(tests, io_sort_records_and_hash_partition);
+    MACRO_ADD(tests, io_find_delimiter_scalar_and_vector_paths);
 
     macro_run_all("the-io-library/io.h", tests, test_count);
     return 0;
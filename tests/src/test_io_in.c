@@ -8,6 +8,7 @@
 #include "the-macro-library/macro_test.h"
 
 #include "the-io-library/io_in.h"
+#include "the-io-library/io_out.h"
 #include "the-io-library/io.h"
 #include "a-memory-library/aml_alloc.h"
 #include "a-memory-library/aml_pool.h"
@@ -159,6 +160,705 @@ MACRO_TEST(io_in_ext_merge_and_unique) {
     io_in_destroy(ext); /* should also close individual streams */
 }
 
+MACRO_TEST(io_in_mmap_prefix_and_fixed) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "prefix.dat");
+
+    /* three prefix formatted records: "a", "bb", "ccc" */
+    char data[64]; size_t len = 0;
+    const char *vals[] = { "a", "bb", "ccc" };
+    for (int i = 0; i < 3; i++) {
+        uint32_t l = (uint32_t)strlen(vals[i]);
+        memcpy(data + len, &l, sizeof(l)); len += sizeof(l);
+        memcpy(data + len, vals[i], l); len += l;
+    }
+    write_file(f, data, len);
+
+    io_in_options_t opt;
+    io_in_options_init(&opt);
+    io_in_options_format(&opt, io_prefix());
+    io_in_options_mmap(&opt);
+
+    io_in_t *in = io_in_init(f, &opt);
+    MACRO_ASSERT_TRUE(in != NULL);
+    for (int i = 0; i < 3; i++) {
+        io_record_t *r = io_in_advance(in);
+        MACRO_ASSERT_TRUE(r != NULL);
+        MACRO_ASSERT_EQ_INT((int)r->length, (int)strlen(vals[i]));
+        MACRO_ASSERT_TRUE(memcmp(r->record, vals[i], r->length) == 0);
+    }
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+
+    /* same bytes read as 7 byte fixed records (one partial record dropped) */
+    io_in_options_format(&opt, io_fixed(7));
+    in = io_in_init(f, &opt);
+    MACRO_ASSERT_TRUE(in != NULL);
+    io_record_t *r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r != NULL && r->length == 7);
+    MACRO_ASSERT_TRUE(memcmp(r->record, data, 7) == 0);
+    r = io_in_advance(in);
+    MACRO_ASSERT_TRUE(r != NULL && r->length == 7);
+    MACRO_ASSERT_TRUE(memcmp(r->record, data + 7, 7) == 0);
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+
+    unlink(f); rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_mmap_delimited_without_trailing_delimiter) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "lines.txt");
+    const char *vals[] = { "a", "bb", "ccc" };
+
+    /* the last record ends at the end of the mapping with no newline */
+    write_file(f, "a\nbb\nccc", 8);
+
+    io_in_options_t opt;
+    io_in_options_init(&opt);
+    io_in_options_format(&opt, io_delimiter('\n'));
+    io_in_options_mmap(&opt);
+
+    /* by default the partial record is dropped */
+    io_in_t *in = io_in_init(f, &opt);
+    MACRO_ASSERT_TRUE(in != NULL);
+    for (int i = 0; i < 2; i++) {
+        io_record_t *r = io_in_advance(in);
+        MACRO_ASSERT_TRUE(r != NULL);
+        MACRO_ASSERT_EQ_INT((int)r->length, (int)strlen(vals[i]));
+        MACRO_ASSERT_TRUE(memcmp(r->record, vals[i], r->length) == 0);
+    }
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+
+    /* when allowed, it is returned straight from the mapping */
+    io_in_options_allow_partial_records(&opt);
+    in = io_in_init(f, &opt);
+    MACRO_ASSERT_TRUE(in != NULL);
+    for (int i = 0; i < 3; i++) {
+        io_record_t *r = io_in_advance(in);
+        MACRO_ASSERT_TRUE(r != NULL);
+        MACRO_ASSERT_EQ_INT((int)r->length, (int)strlen(vals[i]));
+        MACRO_ASSERT_TRUE(memcmp(r->record, vals[i], r->length) == 0);
+    }
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+
+    /* a file ending in the delimiter yields the same records either way */
+    write_file(f, "a\nbb\nccc\n", 9);
+    in = io_in_init(f, &opt);
+    MACRO_ASSERT_TRUE(in != NULL);
+    for (int i = 0; i < 3; i++) {
+        io_record_t *r = io_in_advance(in);
+        MACRO_ASSERT_TRUE(r != NULL);
+        MACRO_ASSERT_EQ_INT((int)r->length, (int)strlen(vals[i]));
+        MACRO_ASSERT_TRUE(memcmp(r->record, vals[i], r->length) == 0);
+    }
+    MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+    io_in_destroy(in);
+
+    unlink(f); rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_read_ahead_plain_gz_lz4) {
+    char *td = mktempdir();
+    const char *names[] = { "ra.txt", "ra.txt.gz", "ra.txt.lz4" };
+    for (int i = 0; i < 3; i++) {
+        char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, names[i]);
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, io_delimiter('\n'));
+        io_out_t *out = io_out_init(f, &oopt);
+        MACRO_ASSERT_TRUE(out != NULL);
+        char line[32];
+        for (int j = 0; j < 50000; j++) {
+            int n = snprintf(line, sizeof(line), "record-%d", j);
+            io_out_write_record(out, line, n);
+        }
+        io_out_destroy(out);
+
+        io_in_options_t opt;
+        io_in_options_init(&opt);
+        io_in_options_buffer_size(&opt, 1000);
+        io_in_options_format(&opt, io_delimiter('\n'));
+        io_in_options_read_ahead(&opt);
+        io_in_t *in = io_in_init(f, &opt);
+        MACRO_ASSERT_TRUE(in != NULL);
+        io_record_t *r;
+        int j = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            int n = snprintf(line, sizeof(line), "record-%d", j++);
+            if ((int)r->length != n || memcmp(r->record, line, n))
+                ok = false;
+        }
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_INT(j, 50000);
+        io_in_destroy(in);
+
+        /* destroying before the end must stop the helper thread */
+        in = io_in_init(f, &opt);
+        MACRO_ASSERT_TRUE(io_in_advance(in) != NULL);
+        io_in_destroy(in);
+        unlink(f);
+    }
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_lz4_threads_formats) {
+    /* prefix, fixed and delimited lz4 files of ~50 64kb blocks */
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/threads.lz4", td);
+    io_format_t formats[] = { io_prefix(), io_fixed(16), io_delimiter('\n') };
+    for (int i = 0; i < 3; i++) {
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, formats[i]);
+        io_out_t *out = io_out_init(f, &oopt);
+        char rec[17];
+        for (int j = 0; j < 200000; j++) {
+            snprintf(rec, sizeof(rec), "%015d", j);
+            io_out_write_record(out, rec, 15 + (i == 1));
+        }
+        io_out_destroy(out);
+
+        for (size_t threads = 1; threads <= 4; threads += 3) {
+            io_in_options_t opt;
+            io_in_options_init(&opt);
+            io_in_options_format(&opt, formats[i]);
+            io_in_options_lz4_threads(&opt, threads);
+            io_in_t *in = io_in_init(f, &opt);
+            io_record_t *r;
+            int j = 0;
+            bool ok = true;
+            while ((r = io_in_advance(in)) != NULL) {
+                snprintf(rec, sizeof(rec), "%015d", j++);
+                if (r->length != 15u + (i == 1) || memcmp(r->record, rec, 15))
+                    ok = false;
+            }
+            MACRO_ASSERT_TRUE(ok);
+            MACRO_ASSERT_EQ_INT(j, 200000);
+            io_in_destroy(in);
+
+            /* destroying before the end must stop the threads */
+            in = io_in_init(f, &opt);
+            MACRO_ASSERT_TRUE(io_in_advance(in) != NULL);
+            io_in_destroy(in);
+        }
+        unlink(f);
+    }
+    rmdir(td); aml_free(td);
+}
+
+static size_t idx_len(int i) {
+    return (i % 5000) == 4999 ? 150000 : 10 + (i % 37);
+}
+
+static bool idx_check(io_in_t *in, int first, int end) {
+    io_record_t *r;
+    bool ok = true;
+    char rec[16];
+    int j = first;
+    while ((r = io_in_advance(in)) != NULL) {
+        snprintf(rec, sizeof(rec), "%09d", j);
+        if (j >= end || r->length != idx_len(j) || memcmp(r->record, rec, 9))
+            ok = false;
+        j++;
+    }
+    io_in_destroy(in);
+    return ok && j == end;
+}
+
+MACRO_TEST(io_in_lz4_index_seek_and_ranges) {
+    /* some records span several 64kb blocks */
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/index.lz4", td);
+    int n = 30000;
+    char *buf = (char *)aml_zalloc(150000);
+    char id[16];
+    for (size_t threads = 0; threads <= 2; threads += 2) {
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, io_prefix());
+        io_out_options_lz4_threads(&oopt, threads);
+        io_out_options_lz4_index(&oopt);
+        io_out_t *out = io_out_init(f, &oopt);
+        for (int i = 0; i < n; i++) {
+            size_t len = idx_len(i);
+            memset(buf, 'x', len);
+            snprintf(id, sizeof(id), "%09d", i);
+            memcpy(buf, id, 9);
+            io_out_write_record(out, buf, len);
+        }
+        io_out_destroy(out);
+
+        io_lz4_index_t *index = io_lz4_index_load(f);
+        MACRO_ASSERT_TRUE(index != NULL);
+        MACRO_ASSERT_TRUE(index->num_blocks > 20);
+        MACRO_ASSERT_TRUE(index->num_records == (uint64_t)n);
+
+        io_in_options_t opt;
+        io_in_options_init(&opt);
+        io_in_options_format(&opt, io_prefix());
+
+        /* ranges of blocks return every record once */
+        size_t step = index->num_blocks / 4 + 1, total = 0;
+        for (size_t b = 0; b < index->num_blocks; b += step) {
+            size_t e = b + step;
+            int first = (int)index->blocks[b].first_record;
+            int end = e < index->num_blocks ? (int)index->blocks[e].first_record : n;
+            MACRO_ASSERT_TRUE(idx_check(io_in_init_lz4_blocks(f, index, b, e, &opt),
+                                        first, end));
+            total += end - first;
+        }
+        MACRO_ASSERT_EQ_SZ(total, (size_t)n);
+
+        int records[] = { 0, 1, 4999, 5000, 12345, n - 1 };
+        for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++)
+            MACRO_ASSERT_TRUE(idx_check(io_in_init_lz4_at_record(f, index, records[i], &opt),
+                                        records[i], n));
+        MACRO_ASSERT_TRUE(idx_check(io_in_init_lz4_at_record(f, index, n, &opt), n, n));
+
+        /* an offset in the middle of record 9999 (which is 150000 bytes) */
+        uint64_t offset = 0;
+        for (int i = 0; i < 9999; i++)
+            offset += 4 + idx_len(i);
+        MACRO_ASSERT_TRUE(idx_check(io_in_init_lz4_at_offset(f, index, offset, &opt),
+                                    9999, n));
+        MACRO_ASSERT_TRUE(idx_check(io_in_init_lz4_at_offset(f, index, offset + 1000, &opt),
+                                    10000, n));
+
+        io_lz4_index_destroy(index);
+        unlink(f);
+        snprintf(f, sizeof(f), "%s/index.lz4.idx", td);
+        unlink(f);
+        snprintf(f, sizeof(f), "%s/index.lz4", td);
+    }
+    aml_free(buf);
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_split_formats) {
+    /* the split cursors read in order must match reading the whole file */
+    char *td = mktempdir();
+    char f[PATH_MAX];
+    /* split.bin has no record index, so it is only read by the first
+       cursor */
+    const char *names[] = { "split.txt", "split.bin", "split.fixed", "split.lz4",
+                            "split.idx.bin" };
+    io_format_t formats[] = { io_delimiter('\n'), io_prefix(), io_fixed(12), io_prefix(),
+                              io_prefix() };
+    for (int k = 0; k < 5; k++) {
+        snprintf(f, sizeof(f), "%s/%s", td, names[k]);
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, formats[k]);
+        io_out_options_lz4_index(&oopt);
+        if (k == 4)
+            io_out_options_record_index(&oopt);
+        io_out_t *out = io_out_init(f, &oopt);
+        char rec[64];
+        for (int j = 0; j < 50000; j++) {
+            size_t len = k == 2 ? 12 : 12 + (j % 40);
+            snprintf(rec, sizeof(rec), "%011d", j);
+            memset(rec + 11, 'a' + (j % 26), len - 11);
+            io_out_write_record(out, rec, len);
+        }
+        io_out_destroy(out);
+
+        size_t ns[] = { 1, 3, 8 };
+        for (size_t i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+            io_in_t *all = io_in_quick_init(f, formats[k], 4096);
+            io_in_t **parts = io_in_split(f, formats[k], ns[i], NULL);
+            bool ok = true;
+            size_t total = 0, num_nonempty = 0;
+            for (size_t p = 0; p < ns[i]; p++) {
+                io_record_t *r;
+                size_t num = 0;
+                while ((r = io_in_advance(parts[p])) != NULL) {
+                    io_record_t *e = io_in_advance(all);
+                    if (!e || e->length != r->length ||
+                        memcmp(e->record, r->record, r->length))
+                        ok = false;
+                    num++;
+                }
+                io_in_destroy(parts[p]);
+                total += num;
+                if (num)
+                    num_nonempty++;
+            }
+            aml_free(parts);
+            MACRO_ASSERT_TRUE(ok);
+            MACRO_ASSERT_EQ_SZ(num_nonempty, k == 1 ? 1 : ns[i]);
+            MACRO_ASSERT_TRUE(io_in_advance(all) == NULL);
+            MACRO_ASSERT_EQ_SZ(total, (size_t)50000);
+            io_in_destroy(all);
+        }
+        unlink(f);
+    }
+    snprintf(f, sizeof(f), "%s/split.lz4.idx", td);
+    unlink(f);
+    snprintf(f, sizeof(f), "%s/split.idx.bin.idx", td);
+    unlink(f);
+    rmdir(td); aml_free(td);
+}
+
+MACRO_TEST(io_in_gz_index_ranges) {
+    /* two gz members (the second is appended) with points every 64kb */
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/index.gz", td);
+    int n = 100000;
+    for (int m = 0; m < 2; m++) {
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, io_delimiter('\n'));
+        if (m)
+            io_out_options_append_mode(&oopt);
+        io_out_t *out = io_out_init(f, &oopt);
+        char rec[64];
+        for (int j = m * (n / 2); j < (m + 1) * (n / 2); j++) {
+            int len = snprintf(rec, sizeof(rec), "%09d %0*d", j, j % 40, j);
+            io_out_write_record(out, rec, len);
+        }
+        io_out_destroy(out);
+    }
+
+    io_gz_index_t *index = io_gz_index_init(f, 64 * 1024);
+    MACRO_ASSERT_TRUE(index != NULL);
+    MACRO_ASSERT_TRUE(index->num_points > 10);
+    io_gz_index_destroy(index);
+    /* the second init loads the saved index */
+    index = io_gz_index_init(f, 64 * 1024);
+    MACRO_ASSERT_TRUE(index != NULL);
+
+    aml_buffer_t *bh = aml_buffer_init(1024);
+    io_in_t *in = io_in_quick_init(f, io_delimiter('\n'), 64 * 1024);
+    io_record_t *r;
+    while ((r = io_in_advance(in)) != NULL) {
+        aml_buffer_append(bh, r->record, r->length);
+        aml_buffer_appendc(bh, '\n');
+    }
+    io_in_destroy(in);
+    char *all = aml_buffer_data(bh);
+    size_t len = aml_buffer_length(bh);
+    MACRO_ASSERT_EQ_SZ(len, (size_t)index->uncompressed_size);
+
+    /* ranges starting at arbitrary offsets match the data */
+    io_in_options_t opt;
+    io_in_options_init(&opt);
+    io_in_options_format(&opt, io_delimiter('\n'));
+    size_t offsets[] = { 0, 1, 65536, len / 2, len - 100 };
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        size_t length = len - offsets[i] < 50000 ? len - offsets[i] : 50000;
+        in = io_in_init_gz_range(f, index, offsets[i], length, &opt);
+        r = io_in_advance(in);
+        MACRO_ASSERT_TRUE(r != NULL);
+        MACRO_ASSERT_TRUE(r->length <= length);
+        MACRO_ASSERT_TRUE(!memcmp(r->record, all + offsets[i], r->length));
+        io_in_destroy(in);
+    }
+
+    /* split cursors return every line once */
+    io_in_t **parts = io_in_split(f, io_delimiter('\n'), 6, NULL);
+    char rec[64];
+    int j = 0;
+    bool ok = true;
+    for (size_t p = 0; p < 6; p++) {
+        while ((r = io_in_advance(parts[p])) != NULL) {
+            int l = snprintf(rec, sizeof(rec), "%09d %0*d", j, j % 40, j);
+            if (r->length != (uint32_t)l || memcmp(r->record, rec, l))
+                ok = false;
+            j++;
+        }
+        io_in_destroy(parts[p]);
+    }
+    aml_free(parts);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_INT(j, n);
+
+    aml_buffer_destroy(bh);
+    io_gz_index_destroy(index);
+    unlink(f);
+    snprintf(f, sizeof(f), "%s/index.gz.idx", td);
+    unlink(f);
+    rmdir(td); aml_free(td);
+}
+
+static size_t batch_matches(io_in_t *a, io_in_t *b) {
+    /* a is read with io_in_advance_batch, b with io_in_advance */
+    io_record_t recs[7];
+    size_t total = 0, n;
+    bool ok = true;
+    while ((n = io_in_advance_batch(a, recs, 7)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            io_record_t *r = io_in_advance(b);
+            if (!r || r->length != recs[i].length ||
+                memcmp(r->record, recs[i].record, r->length))
+                ok = false;
+        }
+        total += n;
+    }
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_TRUE(io_in_advance(b) == NULL);
+    io_in_destroy(a);
+    io_in_destroy(b);
+    return total;
+}
+
+MACRO_TEST(io_in_advance_batch_formats) {
+    char *td = mktempdir();
+    char f[PATH_MAX]; snprintf(f, sizeof(f), "%s/%s", td, "batch.lz4");
+    char g[PATH_MAX]; snprintf(g, sizeof(g), "%s/%s", td, "batch");
+    io_format_t formats[] = { io_prefix(), io_delimiter('\n'), io_fixed(12) };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 2; j++) {
+            const char *fn = j ? f : g;
+            io_out_options_t oopt;
+            io_out_options_init(&oopt);
+            io_out_options_format(&oopt, formats[i]);
+            io_out_t *out = io_out_init(fn, &oopt);
+            char line[32];
+            for (int k = 0; k < 1000; k++) {
+                memset(line, 0, sizeof(line));
+                int len = snprintf(line, sizeof(line), "r%d", k * 7);
+                io_out_write_record(out, line, i == 2 ? 12 : len);
+            }
+            io_out_destroy(out);
+
+            io_in_options_t opt;
+            io_in_options_init(&opt);
+            io_in_options_format(&opt, formats[i]);
+            io_in_options_buffer_size(&opt, 100);
+            MACRO_ASSERT_EQ_SZ(batch_matches(io_in_init(fn, &opt),
+                                             io_in_init(fn, &opt)), 1000);
+
+            /* batches respect io_in_limit */
+            io_in_t *in = io_in_init(fn, &opt);
+            io_in_limit(in, 10);
+            io_record_t recs[64];
+            size_t total = 0, n;
+            while ((n = io_in_advance_batch(in, recs, 64)) > 0)
+                total += n;
+            MACRO_ASSERT_EQ_SZ(total, 10);
+            io_in_destroy(in);
+        }
+    }
+
+    /* list cursor over both files */
+    io_file_info_t files[2];
+    memset(files, 0, sizeof(files));
+    files[0].filename = g; files[0].size = 1 << 20;
+    files[1].filename = f; files[1].size = 1 << 20;
+    io_in_options_t opt;
+    io_in_options_init(&opt);
+    io_in_options_format(&opt, io_fixed(12));
+    MACRO_ASSERT_EQ_SZ(batch_matches(io_in_init_from_list(files, 2, &opt),
+                                     io_in_init_from_list(files, 2, &opt)),
+                       2000);
+
+    /* records cursor */
+    io_record_t recs[3] = { { "a", 1, 0 }, { "bb", 2, 0 }, { "c", 1, 0 } };
+    MACRO_ASSERT_EQ_SZ(batch_matches(io_in_records_init(recs, 3, &opt),
+                                     io_in_records_init(recs, 3, &opt)), 3);
+
+    unlink(f); unlink(g); rmdir(td); aml_free(td);
+}
+
+static int cmp_u32(const io_record_t *a, const io_record_t *b, void *arg) {
+    (void)arg;
+    uint32_t x, y;
+    memcpy(&x, a->record, 4);
+    memcpy(&y, b->record, 4);
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+MACRO_TEST(io_in_range_merge_lz4_tags) {
+    /* the first run is empty, so the tags must still be the file index */
+    char *td = mktempdir();
+    char names[4][PATH_MAX];
+    char *filenames[4];
+    char rec[200];
+    memset(rec, 'x', sizeof(rec));
+    for (uint32_t i = 0; i < 4; i++) {
+        snprintf(names[i], sizeof(names[i]), "%s/run%u.lz4", td, i);
+        filenames[i] = names[i];
+        io_out_options_t oopt;
+        io_out_options_init(&oopt);
+        io_out_options_format(&oopt, io_prefix());
+        io_out_options_lz4_index(&oopt);
+        io_out_t *out = io_out_init(names[i], &oopt);
+        for (uint32_t key = 0; i && key < 30000; key++) {
+            if (key % 3 != i - 1)
+                continue;
+            memcpy(rec, &key, sizeof(key));
+            io_out_write_record(out, rec, sizeof(rec));
+        }
+        io_out_destroy(out);
+    }
+
+    io_in_options_t opt;
+    io_in_options_init(&opt);
+    io_in_options_format(&opt, io_prefix());
+    io_in_t **ranges =
+        io_in_range_merge(filenames, 4, 4, cmp_u32, NULL, NULL, NULL, &opt);
+    uint32_t next = 0;
+    size_t num_nonempty = 0;
+    bool ok = true;
+    for (size_t i = 0; i < 4; i++) {
+        io_record_t *r;
+        size_t n = 0;
+        while ((r = io_in_advance(ranges[i])) != NULL) {
+            uint32_t key;
+            memcpy(&key, r->record, sizeof(key));
+            if (key != next++ || r->tag != (int)(1 + (key % 3)))
+                ok = false;
+            n++;
+        }
+        io_in_destroy(ranges[i]);
+        if (n)
+            num_nonempty++;
+    }
+    aml_free(ranges);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_INT(next, 30000);
+    MACRO_ASSERT_EQ_SZ(num_nonempty, 4);
+
+    for (size_t i = 0; i < 4; i++) {
+        char idx[PATH_MAX];
+        snprintf(idx, sizeof(idx), "%s/run%zu.lz4.idx", td, i);
+        unlink(idx);
+        unlink(names[i]);
+    }
+    rmdir(td); aml_free(td);
+}
+
+static io_in_t *merge_of(uint32_t *vals, io_record_t *recs, size_t k,
+                         size_t per, size_t threshold) {
+    io_in_options_t o;
+    io_in_options_init(&o);
+    io_in_options_loser_tree(&o, threshold);
+    io_in_t *ext = io_in_ext_init(cmp_u32, NULL, &o);
+    for (size_t i = 0; i < k; i++) {
+        io_in_t *in = io_in_records_init(recs + i * per, per, &o);
+        io_in_ext_add(ext, in, (int)i);
+    }
+    (void)vals;
+    return ext;
+}
+
+MACRO_TEST(io_in_ext_loser_tree_matches_heap) {
+    /* 37 streams of sorted values with duplicates within and across */
+    enum { K = 37, PER = 50 };
+    static uint32_t vals[K * PER];
+    static io_record_t recs[K * PER];
+    for (size_t i = 0; i < K; i++) {
+        uint32_t v = (uint32_t)(i % 5);
+        for (size_t j = 0; j < PER; j++) {
+            v += (uint32_t)((i * 7 + j * 3) % 4);
+            vals[i * PER + j] = v;
+            recs[i * PER + j].record = (char *)(vals + i * PER + j);
+            recs[i * PER + j].length = 4;
+            recs[i * PER + j].tag = 0;
+        }
+    }
+
+    io_in_t *heap = merge_of(vals, recs, K, PER, 0);
+    io_in_t *loser = merge_of(vals, recs, K, PER, 1);
+    size_t n = 0;
+    bool ok = true;
+    uint32_t last = 0;
+    io_record_t *a, *b;
+    while ((a = io_in_advance(heap)) != NULL) {
+        b = io_in_advance(loser);
+        if (!b || cmp_u32(a, b, NULL) || cmp_u32(b, &(io_record_t){(char *)&last, 4, 0}, NULL) < 0)
+            ok = false;
+        memcpy(&last, b->record, 4);
+        n++;
+    }
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(n, K * PER);
+    MACRO_ASSERT_TRUE(io_in_advance(loser) == NULL);
+    io_in_destroy(heap);
+    io_in_destroy(loser);
+
+    /* advance_unique groups equal values the same way */
+    heap = merge_of(vals, recs, K, PER, 0);
+    loser = merge_of(vals, recs, K, PER, 1);
+    size_t na, nb, total = 0;
+    while ((a = io_in_advance_unique(heap, &na)) != NULL) {
+        b = io_in_advance_unique(loser, &nb);
+        if (!b || na != nb || cmp_u32(a, b, NULL))
+            ok = false;
+        total += na;
+    }
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(total, K * PER);
+    MACRO_ASSERT_TRUE(io_in_advance_unique(loser, &nb) == NULL);
+    io_in_destroy(heap);
+    io_in_destroy(loser);
+}
+
+static int cmp_bytes(const io_record_t *a, const io_record_t *b, void *arg) {
+    (void)arg;
+    uint32_t len = a->length < b->length ? a->length : b->length;
+    int n = memcmp(a->record, b->record, len);
+    if (n)
+        return n;
+    return a->length < b->length ? -1 : (a->length > b->length ? 1 : 0);
+}
+
+MACRO_TEST(io_in_ext_key_prefix_matches_compare) {
+    /* short keys, keys sharing the first 8 bytes, and duplicates */
+    enum { K = 12, PER = 40 };
+    static char keys[K * PER][24];
+    static io_record_t recs[K * PER];
+    for (size_t i = 0; i < K; i++) {
+        for (size_t j = 0; j < PER; j++) {
+            char *k = keys[i * PER + j];
+            size_t v = j * 3 + (i % 4);
+            if (j % 5 == 0)
+                snprintf(k, 24, "%c", (int)('a' + (v % 26)));
+            else
+                snprintf(k, 24, "samefirst%04zu", v);
+            recs[i * PER + j].record = k;
+            recs[i * PER + j].length = (uint32_t)strlen(k);
+            recs[i * PER + j].tag = 0;
+        }
+        io_sort_records(recs + i * PER, PER, cmp_bytes, NULL);
+    }
+
+    io_in_options_t o;
+    io_in_options_init(&o);
+    for (size_t threshold = 0; threshold < 2; threshold++) {
+        io_in_options_loser_tree(&o, threshold);
+        io_in_t *plain = io_in_ext_init(cmp_bytes, NULL, &o);
+        io_in_t *prefixed = io_in_ext_init(cmp_bytes, NULL, &o);
+        for (size_t i = 0; i < K; i++) {
+            io_in_ext_add(plain, io_in_records_init(recs + i * PER, PER, &o), 0);
+            if (i == K / 2)
+                io_in_ext_key_prefix(prefixed, io_key_prefix_bytes, NULL);
+            io_in_ext_add(prefixed, io_in_records_init(recs + i * PER, PER, &o), 0);
+        }
+        size_t na, nb, total = 0;
+        bool ok = true;
+        io_record_t *a, *b;
+        while ((a = io_in_advance_unique(plain, &na)) != NULL) {
+            b = io_in_advance_unique(prefixed, &nb);
+            if (!b || na != nb || cmp_bytes(a, b, NULL))
+                ok = false;
+            total += na;
+        }
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(total, K * PER);
+        MACRO_ASSERT_TRUE(io_in_advance_unique(prefixed, &nb) == NULL);
+        io_in_destroy(plain);
+        io_in_destroy(prefixed);
+    }
+
+    io_record_t r = { (char *)"ab", 2, 0 };
+    MACRO_ASSERT_TRUE(io_key_prefix_bytes(&r, NULL) == 0x6162000000000000ULL);
+}
+
 /* --- runner --- */
 int main(void) {
     macro_test_case tests[64];
@@ -167,6 +867,17 @@ int main(void) {
     MACRO_ADD(tests, io_in_options_and_quick_init_delimited);
     MACRO_ADD(tests, io_in_with_buffer_and_records_init);
     MACRO_ADD(tests, io_in_ext_merge_and_unique);
+    MACRO_ADD(tests, io_in_mmap_prefix_and_fixed);
+    MACRO_ADD(tests, io_in_mmap_delimited_without_trailing_delimiter);
+    MACRO_ADD(tests, io_in_read_ahead_plain_gz_lz4);
+    MACRO_ADD(tests, io_in_advance_batch_formats);
+    MACRO_ADD(tests, io_in_ext_loser_tree_matches_heap);
+    MACRO_ADD(tests, io_in_ext_key_prefix_matches_compare);
+    MACRO_ADD(tests, io_in_lz4_threads_formats);
+    MACRO_ADD(tests, io_in_lz4_index_seek_and_ranges);
+    MACRO_ADD(tests, io_in_split_formats);
+    MACRO_ADD(tests, io_in_gz_index_ranges);
+    MACRO_ADD(tests, io_in_range_merge_lz4_tags);
 
     macro_run_all("the-io-library/io_in.h", tests, test_count);
     return 0;
@@ -12,6 +12,7 @@
 #include "the-io-library/io.h"
 #include "a-memory-library/aml_alloc.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,6 +20,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
 
 static char *mktempdir(void) {
     char buf[] = "/tmp/ioout_test_XXXXXX";
@@ -123,6 +126,1092 @@ MACRO_TEST(io_out_options_lz4_gz_and_ext_options_api_surface) {
     io_out_ext_options_use_extra_thread(&x);
 }
 
+static int cmp_u32(const io_record_t *a, const io_record_t *b, void *arg) {
+    (void)arg;
+    uint32_t x, y;
+    memcpy(&x, a->record, 4);
+    memcpy(&y, b->record, 4);
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+MACRO_TEST(io_out_sorted_num_buffer_sort_threads) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted.lz4");
+
+    /* one buffer (sorted in memory) and small buffers (spilled to tmp) */
+    size_t buffer_sizes[] = { 64 * 1024 * 1024, 6 * 1024 * 1024 };
+    for (size_t b = 0; b < 2; b++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_prefix());
+        io_out_options_buffer_size(&o, buffer_sizes[b]);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_u32, NULL);
+        io_out_ext_options_reducer(&x, io_keep_first, NULL);
+        io_out_ext_options_num_buffer_sort_threads(&x, 4);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+
+        /* 300000 records with every value in 0..99999 three times */
+        for (size_t i = 0; i < 300000; i++) {
+            uint32_t k = (uint32_t)((i * 7919u) % 100000u);
+            io_out_write_record(out, &k, sizeof(k));
+        }
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        io_record_t *r;
+        uint32_t expect = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            uint32_t k;
+            memcpy(&k, r->record, 4);
+            if (k != expect)
+                ok = false;
+            expect++;
+        }
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_INT((int)expect, 100000);
+        io_in_destroy(in);
+    }
+    rmdir(dir);
+    aml_free(dir);
+}
+
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+} kv_t;
+
+static int cmp_kv(const void *a, const void *b, void *arg) {
+    (void)arg;
+    const kv_t *x = (const kv_t *)a, *y = (const kv_t *)b;
+    return x->key < y->key ? -1 : (x->key > y->key ? 1 : 0);
+}
+
+static int qsort_kv(const void *a, const void *b) { return cmp_kv(a, b, NULL); }
+
+static int cmp_kv_count(const void *a, const void *b, void *arg) {
+    (void)arg;
+    const kv_t *x = (const kv_t *)a, *y = (const kv_t *)b;
+    int c = cmp_kv(a, b, NULL);
+    if (c)
+        return c;
+    return x->count < y->count ? -1 : (x->count > y->count ? 1 : 0);
+}
+
+static void sort_kv(void *p, size_t n) { qsort(p, n, sizeof(kv_t), qsort_kv); }
+
+static bool sum_kv(char *d, size_t num_r, void *arg) {
+    (void)arg;
+    kv_t *r = (kv_t *)d;
+    for (size_t i = 1; i < num_r; i++)
+        r->count += r[i].count;
+    return r->key != 13; /* drop one key */
+}
+
+MACRO_TEST(io_out_sorted_fixed_records) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "fixed.lz4");
+
+    /* one buffer (sorted in memory) and small buffers (spilled to tmp) */
+    size_t buffer_sizes[] = { 16 * 1024 * 1024, 64 * 1024 };
+    for (size_t b = 0; b < 2; b++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, buffer_sizes[b]);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_fixed_compare(&x, cmp_kv, NULL);
+        io_out_ext_options_fixed_sort(&x, sort_kv, NULL);
+        io_out_ext_options_fixed_reducer(&x, sum_kv, NULL);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+
+        for (size_t i = 0; i < 100000; i++) {
+            kv_t kv = { (uint32_t)((i * 7919u) % 1000u), 1 };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+
+        io_in_t *in = io_out_in(out);
+        MACRO_ASSERT_TRUE(in != NULL);
+        io_record_t *r;
+        uint32_t expect = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            if (expect == 13)
+                expect++;
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if (r->length != sizeof(kv) || kv.key != expect || kv.count != 100)
+                ok = false;
+            expect++;
+        }
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_INT((int)expect, 1000);
+        io_in_destroy(in);
+    }
+    rmdir(dir);
+    aml_free(dir);
+}
+
+/* uint64_t key followed by a string, ties broken by the string */
+static int cmp_key_then_tail(const io_record_t *a, const io_record_t *b, void *arg) {
+    (void)arg;
+    uint64_t x, y;
+    memcpy(&x, a->record, 8);
+    memcpy(&y, b->record, 8);
+    if (x != y)
+        return x < y ? -1 : 1;
+    return strcmp(a->record + 8, b->record + 8);
+}
+
+static io_in_t *sorted_keys(const char *path, size_t buffer_size, bool radix) {
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_prefix());
+    io_out_options_buffer_size(&o, buffer_size);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_key_then_tail, NULL);
+    if (radix)
+        io_out_ext_options_radix_key(&x, 0, 8);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    for (size_t i = 0; i < 50000; i++) {
+        char rec[32];
+        uint64_t key = ((uint64_t)((i * 7919u) % 5000u) << 40) | (i % 3);
+        memcpy(rec, &key, 8);
+        int n = snprintf(rec + 8, sizeof(rec) - 8, "%zu", (i * 31u) % 977u);
+        io_out_write_record(out, rec, 8 + n + 1);
+    }
+    return io_out_in(out);
+}
+
+MACRO_TEST(io_out_sorted_radix_key) {
+    char *dir = mktempdir();
+    char path[PATH_MAX], path2[PATH_MAX];
+    path_join(path, dir, "cmp.lz4");
+    path_join(path2, dir, "radix.lz4");
+
+    /* one buffer (sorted in memory) and small buffers (spilled to tmp) */
+    size_t buffer_sizes[] = { 16 * 1024 * 1024, 256 * 1024 };
+    for (size_t b = 0; b < 2; b++) {
+        io_in_t *expected = sorted_keys(path, buffer_sizes[b], false);
+        io_in_t *in = sorted_keys(path2, buffer_sizes[b], true);
+        io_record_t *r, *e;
+        size_t n = 0;
+        bool ok = true;
+        while ((e = io_in_advance(expected)) != NULL) {
+            r = io_in_advance(in);
+            if (!r || r->length != e->length || memcmp(r->record, e->record, e->length))
+                ok = false;
+            n++;
+        }
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(n, 50000);
+        MACRO_ASSERT_TRUE(io_in_advance(in) == NULL);
+        io_in_destroy(expected);
+        io_in_destroy(in);
+    }
+
+    /* fixed records sorted by the radix key alone (no fixed_sort) */
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+    io_out_options_buffer_size(&o, 64 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_fixed_compare(&x, cmp_kv, NULL);
+    io_out_ext_options_fixed_reducer(&x, sum_kv, NULL);
+    io_out_ext_options_radix_key(&x, 0, 4);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    for (size_t i = 0; i < 100000; i++) {
+        kv_t kv = { (uint32_t)((i * 7919u) % 1000u) * 100000u, 1 };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+    io_in_t *in = io_out_in(out);
+    io_record_t *r;
+    uint32_t expect = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if (kv.key != expect * 100000u || kv.count != 100)
+            ok = false;
+        expect++;
+    }
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_INT((int)expect, 1000);
+    io_in_destroy(in);
+
+    /* long runs of equal keys are ordered by compare */
+    io_out_options_buffer_size(&o, 1024 * 1024);
+    io_out_ext_options_init(&x);
+    io_out_ext_options_fixed_compare(&x, cmp_kv_count, NULL);
+    io_out_ext_options_radix_key(&x, 0, 4);
+    out = io_out_ext_init(path, &o, &x);
+    for (uint32_t i = 0; i < 50000; i++) {
+        kv_t kv = { (i % 7) << 20, (i * 7919u) % 50000u };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+    in = io_out_in(out);
+    kv_t prev = { 0, 0 };
+    size_t n = 0;
+    while ((r = io_in_advance(in)) != NULL) {
+        kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if (n && cmp_kv_count(&prev, &kv, NULL) >= 0)
+            ok = false;
+        prev = kv;
+        n++;
+    }
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(n, 50000);
+    io_in_destroy(in);
+    rmdir(dir);
+    aml_free(dir);
+}
+
+static size_t read_all(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "rb");
+    MACRO_ASSERT_TRUE(f != NULL);
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return n;
+}
+
+MACRO_TEST(io_out_lz4_threads_matches_inline) {
+    char *dir = mktempdir();
+    char path[PATH_MAX], path2[PATH_MAX];
+    path_join(path, dir, "inline.lz4");
+    path_join(path2, dir, "threads.lz4");
+
+    /* about 40 64kb blocks written through small and large writes */
+    for (size_t t = 0; t < 2; t++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_delimiter('\n'));
+        if (t)
+            io_out_options_lz4_threads(&o, 3);
+        io_out_t *out = io_out_init(t ? path2 : path, &o);
+        static char big[200000];
+        for (size_t i = 0; i < sizeof(big); i++)
+            big[i] = 'a' + (i % 23);
+        for (size_t i = 0; i < 100000; i++) {
+            char line[32];
+            int n = snprintf(line, sizeof(line), "line %zu", i);
+            io_out_write_record(out, line, n);
+            if (i % 25000 == 0)
+                io_out_write_record(out, big, sizeof(big));
+        }
+        io_out_destroy(out);
+    }
+
+    size_t len = 4 * 1024 * 1024;
+    char *a = (char *)aml_malloc(len);
+    char *b = (char *)aml_malloc(len);
+    size_t na = read_all(path, a, len);
+    size_t nb = read_all(path2, b, len);
+    MACRO_ASSERT_TRUE(na > 1024 * 1024);
+    MACRO_ASSERT_EQ_SZ(na, nb);
+    MACRO_ASSERT_TRUE(!memcmp(a, b, na));
+    aml_free(a);
+    aml_free(b);
+
+    io_in_options_t io;
+    io_in_options_init(&io);
+    io_in_options_format(&io, io_delimiter('\n'));
+    io_in_t *in = io_in_init(path2, &io);
+    MACRO_ASSERT_EQ_SZ(io_in_count(in), 100004);
+
+    remove(path);
+    remove(path2);
+    rmdir(dir);
+    aml_free(dir);
+}
+
+MACRO_TEST(io_out_gz_threads_members) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "threads.gz");
+
+    /* a few 1MB members written through small and large writes */
+    static char big[1500000];
+    for (size_t i = 0; i < sizeof(big); i++)
+        big[i] = 'a' + (i % 23);
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_delimiter('\n'));
+    io_out_options_gz_threads(&o, 3);
+    io_out_t *out = io_out_init(path, &o);
+    for (size_t i = 0; i < 200000; i++) {
+        char line[32];
+        int n = snprintf(line, sizeof(line), "line %zu", i);
+        io_out_write_record(out, line, n);
+        if (i % 50000 == 0)
+            io_out_write_record(out, big, sizeof(big));
+    }
+    io_out_destroy(out);
+
+    io_in_options_t io;
+    io_in_options_init(&io);
+    io_in_options_format(&io, io_delimiter('\n'));
+    io_in_t *in = io_in_init(path, &io);
+    io_record_t *r;
+    size_t i = 0, num_big = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        if (r->length == sizeof(big)) {
+            num_big++;
+            if (memcmp(r->record, big, sizeof(big)))
+                ok = false;
+            continue;
+        }
+        char line[32];
+        int n = snprintf(line, sizeof(line), "line %zu", i++);
+        if (r->length != (uint32_t)n || memcmp(r->record, line, n))
+            ok = false;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(i, 200000);
+    MACRO_ASSERT_EQ_SZ(num_big, 4);
+
+    /* an empty output is still a valid gz file */
+    out = io_out_init(path, &o);
+    io_out_destroy(out);
+    MACRO_ASSERT_TRUE(io_file_size(path) > 0);
+    MACRO_ASSERT_EQ_SZ(io_in_count(io_in_init(path, &io)), 0);
+    remove(path);
+
+    /* a path which can't be opened fails init */
+    MACRO_ASSERT_EQ_INT(mkdir(path, 0755), 0);
+    MACRO_ASSERT_TRUE(io_out_init(path, &o) == NULL);
+    rmdir(path);
+
+    rmdir(dir);
+    aml_free(dir);
+}
+
+MACRO_TEST(io_out_zstd_output_and_tmp_files) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "lines.zst");
+
+    /* compressed on libzstd's worker threads */
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_delimiter('\n'));
+    io_out_options_zstd(&o, 3, 2);
+    io_out_t *out = io_out_init(path, &o);
+    for (size_t i = 0; i < 200000; i++) {
+        char line[32];
+        int n = snprintf(line, sizeof(line), "line %zu", i);
+        io_out_write_record(out, line, n);
+    }
+    io_out_destroy(out);
+    MACRO_ASSERT_TRUE(io_file_size(path) < 200000 * 6);
+
+    io_in_options_t io;
+    io_in_options_init(&io);
+    io_in_options_format(&io, io_delimiter('\n'));
+    io_in_options_read_ahead(&io);
+    io_in_t *in = io_in_init(path, &io);
+    io_record_t *r;
+    size_t i = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        char line[32];
+        int n = snprintf(line, sizeof(line), "line %zu", i++);
+        if (r->length != (uint32_t)n || memcmp(r->record, line, n))
+            ok = false;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(i, 200000);
+    remove(path);
+
+    /* sorted output spilling zstd tmp files */
+    path_join(path, dir, "sorted.zst");
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+    io_out_options_buffer_size(&o, 64 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_fixed_compare(&x, cmp_kv, NULL);
+    io_out_ext_options_fixed_reducer(&x, sum_kv, NULL);
+    io_out_ext_options_zstd_tmp(&x, 1);
+    out = io_out_ext_init(path, &o, &x);
+    /* sum_kv drops key 13, so keep the keys above it */
+    for (size_t i = 0; i < 100000; i++) {
+        kv_t kv = { 1000u + (uint32_t)((i * 7919u) % 1000u), 1 };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+    io_out_destroy(out);
+
+    io_in_options_init(&io);
+    io_in_options_format(&io, io_fixed(sizeof(kv_t)));
+    in = io_in_init(path, &io);
+    uint32_t expect = 0;
+    while ((r = io_in_advance(in)) != NULL) {
+        kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if (kv.key != 1000u + expect || kv.count != 100)
+            ok = false;
+        expect++;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_INT((int)expect, 1000);
+
+    /* the tmp files were removed */
+    remove(path);
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+static size_t part_by_key(const io_record_t *r, size_t num_part, void *arg) {
+    (void)arg;
+    uint32_t key;
+    memcpy(&key, r->record, 4);
+    return key % num_part;
+}
+
+static bool sum_kv_records(io_record_t *res, const io_record_t *r,
+                           size_t num_r, aml_buffer_t *bh, void *arg) {
+    (void)arg;
+    kv_t kv;
+    memcpy(&kv, r[0].record, sizeof(kv));
+    for (size_t i = 1; i < num_r; i++) {
+        kv_t o;
+        memcpy(&o, r[i].record, sizeof(o));
+        kv.count += o.count;
+    }
+    aml_buffer_clear(bh);
+    aml_buffer_append(bh, &kv, sizeof(kv));
+    res->record = aml_buffer_data(bh);
+    res->length = sizeof(kv);
+    return true;
+}
+
+MACRO_TEST(io_out_partitioned_key_ranges) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "parts");
+
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+    io_out_options_buffer_size(&o, 256 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_partition(&x, part_by_key, NULL);
+    io_out_ext_options_num_partitions(&x, 3);
+    io_out_ext_options_compare(&x, cmp_u32, NULL);
+    io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    for (size_t i = 0; i < 100000; i++) {
+        kv_t kv = { (uint32_t)((i * 7919u) % 5000u), 1 };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+
+    /* each range is sorted and reduced across the partitions and the
+       ranges follow each other */
+    io_in_t **ranges = io_out_in_ranges(out, 4);
+    int64_t prev = -1;
+    size_t num_keys = 0, num_nonempty = 0;
+    bool ok = true;
+    for (size_t i = 0; i < 4; i++) {
+        io_record_t *r;
+        size_t n = 0;
+        while ((r = io_in_advance(ranges[i])) != NULL) {
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if ((int64_t)kv.key <= prev || kv.count != 20)
+                ok = false;
+            prev = kv.key;
+            n++;
+        }
+        io_in_destroy(ranges[i]);
+        num_keys += n;
+        if (n)
+            num_nonempty++;
+    }
+    aml_free(ranges);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(num_keys, 5000);
+    MACRO_ASSERT_EQ_SZ(num_nonempty, 4);
+
+    for (size_t i = 0; i < 3; i++) {
+        char part[PATH_MAX];
+        io_out_partition_filename(part, path, i);
+        remove(part);
+    }
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+MACRO_TEST(io_out_partitioned_in_cursors) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "parts");
+
+    /* sorted after partitioning and while partitioning */
+    for (int mode = 0; mode < 2; mode++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, 256 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_partition(&x, part_by_key, NULL);
+        io_out_ext_options_num_partitions(&x, 3);
+        io_out_ext_options_compare(&x, cmp_u32, NULL);
+        io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+        io_out_ext_options_num_sort_threads(&x, 2);
+        if (mode)
+            io_out_ext_options_sort_while_partitioning(&x);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+        for (size_t i = 0; i < 100000; i++) {
+            kv_t kv = { (uint32_t)((i * 7919u) % 5000u), 1 };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+
+        io_in_t **parts = io_out_partitioned_in(out);
+        size_t num_keys = 0;
+        bool ok = true;
+        for (size_t i = 0; i < 3; i++) {
+            io_record_t *r;
+            int64_t prev = -1;
+            while ((r = io_in_advance(parts[i])) != NULL) {
+                kv_t kv;
+                memcpy(&kv, r->record, sizeof(kv));
+                if ((int64_t)kv.key <= prev || kv.key % 3 != i ||
+                    kv.count != 20)
+                    ok = false;
+                prev = kv.key;
+                num_keys++;
+            }
+            io_in_destroy(parts[i]);
+        }
+        aml_free(parts);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(num_keys, 5000);
+    }
+
+    /* the partitions were handed off without leaving files behind */
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+typedef struct {
+    io_out_t *out;
+    uint32_t id;
+} producer_t;
+
+static void *produce_kv(void *arg) {
+    producer_t *p = (producer_t *)arg;
+    for (uint32_t i = 0; i < 50000; i++) {
+        kv_t kv = { (p->id * 50000u + i) % 5000u, 1 };
+        io_out_write_record(p->out, &kv, sizeof(kv));
+    }
+    return NULL;
+}
+
+MACRO_TEST(io_out_partitioned_concurrent_writers) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "parts");
+
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+    io_out_options_buffer_size(&o, 256 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_partition(&x, part_by_key, NULL);
+    io_out_ext_options_num_partitions(&x, 4);
+    io_out_ext_options_compare(&x, cmp_u32, NULL);
+    io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+    io_out_ext_options_num_sort_threads(&x, 2);
+    io_out_ext_options_concurrent(&x);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+
+    /* 8 producers write into one handle */
+    pthread_t threads[8];
+    producer_t producers[8];
+    for (uint32_t i = 0; i < 8; i++) {
+        producers[i].out = out;
+        producers[i].id = i;
+        pthread_create(threads + i, NULL, produce_kv, producers + i);
+    }
+    for (size_t i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+
+    io_in_t **parts = io_out_partitioned_in(out);
+    size_t num_keys = 0;
+    bool ok = true;
+    for (size_t i = 0; i < 4; i++) {
+        io_record_t *r;
+        int64_t prev = -1;
+        while ((r = io_in_advance(parts[i])) != NULL) {
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if ((int64_t)kv.key <= prev || kv.key % 4 != i || kv.count != 80)
+                ok = false;
+            prev = kv.key;
+            num_keys++;
+        }
+        io_in_destroy(parts[i]);
+    }
+    aml_free(parts);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(num_keys, 5000);
+
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+MACRO_TEST(io_out_partitioned_shared_buffer) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "parts");
+
+    /* unsorted, sorted after partitioning and unsorted prefix records (which
+       are written from the shared blocks without a copy) */
+    for (int mode = 0; mode < 3; mode++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, mode == 2 ? io_prefix()
+                                            : io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, 512 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_partition(&x, part_by_key, NULL);
+        io_out_ext_options_num_partitions(&x, 16);
+        io_out_ext_options_shared_partition_buffer(&x);
+        if (mode == 1)
+            io_out_ext_options_compare(&x, cmp_u32, NULL);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+
+        /* most of the records go to partition 0, the count is the order */
+        for (uint32_t i = 0; i < 200000; i++) {
+            kv_t kv = { (i % 10) ? (i % 1000) * 16 : i % 1000, i };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+
+        io_in_t **parts = io_out_partitioned_in(out);
+        size_t num_records = 0;
+        bool ok = true;
+        for (size_t i = 0; i < 16; i++) {
+            io_record_t *r;
+            kv_t prev = { 0, 0 };
+            bool first = true;
+            while ((r = io_in_advance(parts[i])) != NULL) {
+                kv_t kv;
+                memcpy(&kv, r->record, sizeof(kv));
+                if (kv.key % 16 != i)
+                    ok = false;
+                if (!first &&
+                    (mode == 1 ? kv.key < prev.key : kv.count <= prev.count))
+                    ok = false;
+                prev = kv;
+                first = false;
+                num_records++;
+            }
+            io_in_destroy(parts[i]);
+        }
+        aml_free(parts);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(num_records, 200000);
+
+        for (size_t i = 0; i < 16; i++) {
+            char part[PATH_MAX];
+            io_out_partition_filename(part, path, i);
+            remove(part);
+        }
+    }
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+static int cmp_str(const io_record_t *a, const io_record_t *b, void *arg) {
+    (void)arg;
+    return strcmp(a->record, b->record);
+}
+
+static size_t count_tmp_runs(const char *path) {
+    size_t n = 0;
+    char tmp[PATH_MAX + 32];
+    while (true) {
+        snprintf(tmp, sizeof(tmp), "%s_%zu_tmp.lz4", path, n);
+        if (!io_file_exists(tmp))
+            return n;
+        n++;
+    }
+}
+
+MACRO_TEST(io_out_sorted_replacement_selection) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted");
+
+    /* random keys without and with replacement selection, then ascending
+       keys with a little disorder */
+    size_t runs[3];
+    for (int mode = 0; mode < 3; mode++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_prefix());
+        io_out_options_buffer_size(&o, 64 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_str, NULL);
+        if (mode)
+            io_out_ext_options_replacement_selection(&x);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+        srand(7);
+        for (uint32_t i = 0; i < 50000; i++) {
+            char key[32];
+            uint32_t k = mode == 2 ? i * 4 + (rand() % 16) : (uint32_t)rand();
+            int len = snprintf(key, sizeof(key), "%010u%.*s", k,
+                               (int)(k % 20), "xxxxxxxxxxxxxxxxxxxx");
+            io_out_write_record(out, key, len);
+        }
+        runs[mode] = count_tmp_runs(path);
+
+        io_in_t *in = io_out_in(out);
+        io_record_t *r;
+        size_t n = 0;
+        bool ok = true;
+        char prev[32] = "";
+        while ((r = io_in_advance(in)) != NULL) {
+            if (strcmp(prev, r->record) > 0)
+                ok = false;
+            snprintf(prev, sizeof(prev), "%s", r->record);
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(n, 50000);
+    }
+    /* about twice as long on random input and one run when nearly sorted */
+    MACRO_ASSERT_TRUE(runs[1] * 3 < runs[0] * 2);
+    MACRO_ASSERT_EQ_SZ(runs[2], 1);
+
+    /* equal keys are reduced as they leave the heap */
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_prefix());
+    io_out_options_buffer_size(&o, 64 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_u32, NULL);
+    io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+    io_out_ext_options_replacement_selection(&x);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    srand(11);
+    for (uint32_t i = 0; i < 100000; i++) {
+        kv_t kv = { (uint32_t)(rand() % 20000), 1 };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+    io_in_t *in = io_out_in(out);
+    io_record_t *r;
+    int64_t prev = -1;
+    size_t total = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if ((int64_t)kv.key <= prev)
+            ok = false;
+        prev = kv.key;
+        total += kv.count;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(total, 100000);
+
+    remove(path);
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+static size_t count_files(const char *dir) {
+    size_t n = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.')
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+MACRO_TEST(io_out_sorted_merge_fan_in) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted");
+
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+    io_out_options_buffer_size(&o, 64 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_u32, NULL);
+    io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+    io_out_ext_options_merge_fan_in(&x, 4);
+    io_out_ext_options_num_merge_threads(&x, 3);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    for (size_t i = 0; i < 200000; i++) {
+        kv_t kv = { (uint32_t)((i * 7919u) % 10000u), 1 };
+        io_out_write_record(out, &kv, sizeof(kv));
+    }
+    MACRO_ASSERT_TRUE(count_files(dir) > 4);
+
+    /* the runs were merged down to 4 before the final merge */
+    io_in_t *in = io_out_in(out);
+    MACRO_ASSERT_EQ_SZ(count_files(dir), 4);
+    io_record_t *r;
+    int64_t prev = -1;
+    size_t n = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        kv_t kv;
+        memcpy(&kv, r->record, sizeof(kv));
+        if ((int64_t)kv.key <= prev || kv.count != 20)
+            ok = false;
+        prev = kv.key;
+        n++;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(n, 10000);
+
+    remove(path);
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+static uint64_t hash_key(const io_record_t *r, void *arg) {
+    (void)arg;
+    uint32_t key;
+    memcpy(&key, r->record, 4);
+    return key * 2654435761u;
+}
+
+MACRO_TEST(io_out_sorted_combiner) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted");
+
+    /* 500 keys fit in the table, 50000 keys spill, a small table, a buffer
+       too small for a table, and a limit cut which keeps records */
+    uint32_t num_keys[5] = { 500, 50000, 5000, 5000, 50000 };
+    size_t buffer_size[5] = { 256 * 1024, 256 * 1024, 4096, 1024, 256 * 1024 };
+    size_t limit[5] = { 0, 0, 0, 0, 100 };
+    for (int mode = 0; mode < 5; mode++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, buffer_size[mode]);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_u32, NULL);
+        io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+        io_out_ext_options_combiner(&x, hash_key, NULL);
+        if (limit[mode])
+            io_out_ext_options_limit(&x, limit[mode]);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+        for (uint32_t i = 0; i < 200000; i++) {
+            kv_t kv = { (i * 7919u) % num_keys[mode], 1 };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+        if (mode == 1)
+            MACRO_ASSERT_TRUE(count_files(dir) > 0);
+        else if (mode == 0 || mode == 4)
+            MACRO_ASSERT_EQ_SZ(count_files(dir), 0);
+
+        io_in_t *in = io_out_in(out);
+        io_record_t *r;
+        int64_t prev = -1;
+        size_t n = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if ((int64_t)kv.key <= prev || kv.count != 200000 / num_keys[mode])
+                ok = false;
+            prev = kv.key;
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(n, limit[mode] ? limit[mode] : num_keys[mode]);
+        remove(path);
+    }
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+MACRO_TEST(io_out_sorted_spill_threads) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted");
+
+    /* variable length and fixed records sorted in place */
+    for (int mode = 0; mode < 2; mode++) {
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, 256 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        if (mode) {
+            io_out_ext_options_fixed_compare(&x, cmp_kv, NULL);
+            io_out_ext_options_fixed_sort(&x, sort_kv, NULL);
+            io_out_ext_options_fixed_reducer(&x, sum_kv, NULL);
+        } else {
+            io_out_ext_options_compare(&x, cmp_u32, NULL);
+            io_out_ext_options_reducer(&x, sum_kv_records, NULL);
+        }
+        io_out_ext_options_spill_threads(&x, 4, 3);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+        for (size_t i = 0; i < 300000; i++) {
+            kv_t kv = { (uint32_t)((i * 7919u) % 30000u) + 1000, 1 };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+
+        io_in_t *in = io_out_in(out);
+        io_record_t *r;
+        int64_t prev = -1;
+        size_t n = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if ((int64_t)kv.key <= prev || kv.count != 10)
+                ok = false;
+            prev = kv.key;
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(n, 30000);
+        remove(path);
+    }
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
+static int qsort_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+MACRO_TEST(io_out_sorted_limit) {
+    char *dir = mktempdir();
+    char path[PATH_MAX];
+    path_join(path, dir, "sorted");
+
+    size_t num = 200000;
+    uint32_t *keys = (uint32_t *)aml_malloc(sizeof(uint32_t) * num);
+    for (size_t i = 0; i < num; i++)
+        keys[i] = (uint32_t)(i * 2654435761u);
+    uint32_t *expected = (uint32_t *)aml_malloc(sizeof(uint32_t) * num);
+    memcpy(expected, keys, sizeof(uint32_t) * num);
+    qsort(expected, num, sizeof(uint32_t), qsort_u32);
+
+    /* 100 records stay in memory, 20000 records need tmp files which are cut
+       by the writer, the extra thread or the spill threads */
+    size_t limits[2] = { 100, 20000 };
+    for (int mode = 0; mode < 6; mode++) {
+        size_t limit = limits[mode & 1];
+        io_out_options_t o;
+        io_out_options_init(&o);
+        io_out_options_format(&o, io_fixed(sizeof(kv_t)));
+        io_out_options_buffer_size(&o, 256 * 1024);
+        io_out_ext_options_t x;
+        io_out_ext_options_init(&x);
+        io_out_ext_options_compare(&x, cmp_u32, NULL);
+        io_out_ext_options_limit(&x, limit);
+        if (mode / 2 == 1)
+            io_out_ext_options_use_extra_thread(&x);
+        else if (mode / 2 == 2)
+            io_out_ext_options_spill_threads(&x, 3, 2);
+        io_out_t *out = io_out_ext_init(path, &o, &x);
+        for (size_t i = 0; i < num; i++) {
+            kv_t kv = { keys[i], 1 };
+            io_out_write_record(out, &kv, sizeof(kv));
+        }
+        if (mode & 1)
+            MACRO_ASSERT_TRUE(count_files(dir) > 0);
+        else
+            MACRO_ASSERT_EQ_SZ(count_files(dir), 0);
+
+        io_in_t *in = io_out_in(out);
+        io_record_t *r;
+        size_t n = 0;
+        bool ok = true;
+        while ((r = io_in_advance(in)) != NULL) {
+            kv_t kv;
+            memcpy(&kv, r->record, sizeof(kv));
+            if (kv.key != expected[n])
+                ok = false;
+            n++;
+        }
+        io_in_destroy(in);
+        MACRO_ASSERT_TRUE(ok);
+        MACRO_ASSERT_EQ_SZ(n, limit);
+        remove(path);
+    }
+
+    /* every 50th record has one of the smallest keys and is 3000 bytes, so
+       the 50 records kept by the cut take more than half of the buffer even
+       though 50 average records don't */
+    io_out_options_t o;
+    io_out_options_init(&o);
+    io_out_options_format(&o, io_prefix());
+    io_out_options_buffer_size(&o, 256 * 1024);
+    io_out_ext_options_t x;
+    io_out_ext_options_init(&x);
+    io_out_ext_options_compare(&x, cmp_u32, NULL);
+    io_out_ext_options_limit(&x, 50);
+    io_out_t *out = io_out_ext_init(path, &o, &x);
+    char rec[3000];
+    memset(rec, 'x', sizeof(rec));
+    for (size_t i = 0; i < num; i++) {
+        uint32_t key = (i % 50) ? 0x10000000u + (keys[i] >> 4) : i / 50;
+        memcpy(rec, &key, sizeof(key));
+        io_out_write_record(out, rec, (i % 50) ? sizeof(key) : sizeof(rec));
+    }
+    MACRO_ASSERT_TRUE(count_files(dir) > 0);
+    io_in_t *in = io_out_in(out);
+    io_record_t *r;
+    size_t n = 0;
+    bool ok = true;
+    while ((r = io_in_advance(in)) != NULL) {
+        uint32_t key;
+        memcpy(&key, r->record, sizeof(key));
+        if (key != n || r->length != sizeof(rec))
+            ok = false;
+        n++;
+    }
+    io_in_destroy(in);
+    MACRO_ASSERT_TRUE(ok);
+    MACRO_ASSERT_EQ_SZ(n, 50);
+    remove(path);
+
+    aml_free(expected);
+    aml_free(keys);
+    MACRO_ASSERT_EQ_INT(rmdir(dir), 0);
+    aml_free(dir);
+}
+
 /* --- runner --- */
 int main(void) {
     macro_test_case tests[64];
@@ -131,6 +1220,21 @@ int main(void) {
     MACRO_ADD(tests, io_out_options_and_basic_write_record_delimited);
     MACRO_ADD(tests, io_out_write_and_write_delimiter_with_fd_owner);
     MACRO_ADD(tests, io_out_options_lz4_gz_and_ext_options_api_surface);
+    MACRO_ADD(tests, io_out_sorted_num_buffer_sort_threads);
+    MACRO_ADD(tests, io_out_sorted_fixed_records);
+    MACRO_ADD(tests, io_out_sorted_radix_key);
+    MACRO_ADD(tests, io_out_lz4_threads_matches_inline);
+    MACRO_ADD(tests, io_out_gz_threads_members);
+    MACRO_ADD(tests, io_out_zstd_output_and_tmp_files);
+    MACRO_ADD(tests, io_out_partitioned_key_ranges);
+    MACRO_ADD(tests, io_out_partitioned_in_cursors);
+    MACRO_ADD(tests, io_out_partitioned_concurrent_writers);
+    MACRO_ADD(tests, io_out_partitioned_shared_buffer);
+    MACRO_ADD(tests, io_out_sorted_replacement_selection);
+    MACRO_ADD(tests, io_out_sorted_merge_fan_in);
+    MACRO_ADD(tests, io_out_sorted_combiner);
+    MACRO_ADD(tests, io_out_sorted_spill_threads);
+    MACRO_ADD(tests, io_out_sorted_limit);
 
     macro_run_all("the-io-library/io_out.h", tests, test_count);
     return 0;